@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/flags.h"
+#include "../src/json_writer.h"
+#include "../src/mercuryparser.h"
+#include "../src/parser_options.h"
+#include "../src/tape.h"
+#include "../src/utils.h"
+
+#if PERF_EVENTS
+# include "../src/linux-perf-events.h"
+#endif
+#if HAVE_RAPIDJSON
+# include "rapidjson/include/rapidjson/document.h"
+#endif
+#if HAVE_SIMDJSON
+# include "simdjson/singleheader/simdjson.h"
+#endif
+
+using namespace MercuryJson;
+
+
+// Counts CPU cycles through perf events, or reports no cycles where they are unavailable.
+class CycleCounter {
+#if PERF_EVENTS
+    LinuxEvents<PERF_TYPE_HARDWARE> events{std::vector<int>{PERF_COUNT_HW_CPU_CYCLES}};
+    std::vector<unsigned long long> results = std::vector<unsigned long long>(1, 0);
+#endif
+
+public:
+    inline void start() {
+#if PERF_EVENTS
+        events.start();
+#endif
+    }
+
+    inline unsigned long long end() {
+#if PERF_EVENTS
+        events.end(results);
+        return results[0];
+#else
+        return 0;
+#endif
+    }
+};
+
+// One parse of a file. Stage times are zero for parsers without stages.
+struct Sample {
+    double seconds, stage1_seconds, stage2_seconds;
+    unsigned long long cycles;
+};
+
+// Parse `input`, a copy of the file of `size` bytes, padded as `read_file` does.
+typedef Sample (*ParseFunction)(char *input, size_t size, CycleCounter &counter);
+
+static Sample __parse_mercuryjson(char *input, size_t size, CycleCounter &counter, bool use_tape) {
+    // Keep the memory of the DOM across runs, as a service parsing documents continuously would.
+    static BlockAllocator<JsonValue> allocator(1024);
+    allocator.reset();
+    JSON json(input, size, allocator, true);
+    std::optional<Tape> tape;
+    if (use_tape) tape.emplace(size, size);
+    counter.start();
+    auto start_time = std::chrono::steady_clock::now();
+    json.exec_stage1();
+    auto stage1_end_time = std::chrono::steady_clock::now();
+    if (use_tape) {
+        tape->state_machine(json.input, json.indices, json.num_indices, json.options, json.get_stage1_strings());
+    } else {
+        json.exec_stage2();
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    unsigned long long cycles = counter.end();
+    std::chrono::duration<double> stage1_time = stage1_end_time - start_time, stage2_time = end_time - stage1_end_time;
+    return {stage1_time.count() + stage2_time.count(), stage1_time.count(), stage2_time.count(), cycles};
+}
+
+static Sample __parse_mercuryjson_tape(char *input, size_t size, CycleCounter &counter) {
+    return __parse_mercuryjson(input, size, counter, true);
+}
+
+static Sample __parse_mercuryjson_dom(char *input, size_t size, CycleCounter &counter) {
+    return __parse_mercuryjson(input, size, counter, false);
+}
+
+#if HAVE_RAPIDJSON
+static Sample __parse_rapidjson(char *input, size_t size, CycleCounter &counter) {
+    rapidjson::Document document;
+    counter.start();
+    auto start_time = std::chrono::steady_clock::now();
+    document.ParseInsitu<rapidjson::kParseValidateEncodingFlag>(input);
+    std::chrono::duration<double> runtime = std::chrono::steady_clock::now() - start_time;
+    unsigned long long cycles = counter.end();
+    if (document.HasParseError()) throw std::runtime_error("rapidjson parse error");
+    return {runtime.count(), 0, 0, cycles};
+}
+#endif
+
+#if HAVE_SIMDJSON
+static Sample __parse_simdjson(char *input, size_t size, CycleCounter &counter) {
+    // The input is padded beyond what simdjson requires, so it is parsed where it is.
+    static simdjson::dom::parser parser;
+    counter.start();
+    auto start_time = std::chrono::steady_clock::now();
+    auto document = parser.parse(input, size, false);
+    std::chrono::duration<double> runtime = std::chrono::steady_clock::now() - start_time;
+    unsigned long long cycles = counter.end();
+    if (document.error()) throw std::runtime_error(simdjson::error_message(document.error()));
+    return {runtime.count(), 0, 0, cycles};
+}
+#endif
+
+struct Parser {
+    const char *name;
+    ParseFunction parse;
+};
+
+static const Parser kParsers[] = {
+        {"mercuryjson-tape", __parse_mercuryjson_tape},
+        {"mercuryjson-dom", __parse_mercuryjson_dom},
+#if HAVE_RAPIDJSON
+        {"rapidjson", __parse_rapidjson},
+#endif
+#if HAVE_SIMDJSON
+        {"simdjson", __parse_simdjson},
+#endif
+};
+
+// JSON files of `path`, in name order if it is a directory.
+static std::vector<std::string> __corpus_files(const char *path) {
+    namespace fs = std::filesystem;
+    if (!fs::is_directory(path)) return {path};
+    std::vector<std::string> files;
+    for (const auto &entry : fs::directory_iterator(path)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".json") files.push_back(entry.path().string());
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Runs every parser over every JSON file of a corpus, and reports the throughput of each, with the variance of repeated
+// runs, the split between stage 1 and stage 2 where the parser has one, and cycles per byte where perf events are
+// available. rapidjson and simdjson are compared when checked out under `benchmark/`.
+int main(int argc, char **argv) {
+    std::vector<std::string> files;
+    size_t repeat = 10;
+    const char *json_path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = std::max(atol(argv[++i]), 1L);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else {
+            for (std::string &file : __corpus_files(argv[i])) files.push_back(std::move(file));
+        }
+    }
+    if (files.empty()) {
+        printf("usage: %s [--repeat N] [--json results.json] <corpus directory or file.json>...\n", argv[0]);
+        return 1;
+    }
+
+    CycleCounter counter;
+    JsonWriter writer(true);
+    writer.start_object();
+    writer.key("repeat");
+    writer.value(repeat);
+    writer.key("files");
+    writer.start_array();
+    printf("%-40s %-18s %10s %10s %8s %10s %10s %10s\n",
+           "file", "parser", "MB/s", "best MB/s", "cv %", "cycles/B", "stage 1 %", "stage 2 %");
+    for (const std::string &file : files) {
+        size_t size;
+        char *buf = read_file(file.c_str(), &size);
+        char *input = aligned_malloc(size + 2 * kAlignmentSize);
+        // Stage 1 reads whole blocks, so the padding must not hold leftovers of a previous file.
+        memset(input + size, 0, 2 * kAlignmentSize);
+        std::string name = std::filesystem::path(file).filename().string();
+        writer.start_object();
+        writer.key("file");
+        writer.value(name);
+        writer.key("size");
+        writer.value(size);
+        writer.key("results");
+        writer.start_array();
+
+        for (const Parser &parser : kParsers) {
+            writer.start_object();
+            writer.key("parser");
+            writer.value(parser.name);
+            std::vector<Sample> samples;
+            try {
+                // The first run warms up caches and allocators, and is not counted.
+                for (size_t i = 0; i <= repeat; ++i) {
+                    memcpy(input, buf, size + 1);  // include the null terminator
+                    Sample sample = parser.parse(input, size, counter);
+                    if (i > 0) samples.push_back(sample);
+                }
+            } catch (std::exception &e) {
+                printf("%-40s %-18s error: %s\n", name.c_str(), parser.name, e.what());
+                writer.key("error");
+                writer.value(e.what());
+                writer.end_object();
+                continue;
+            }
+
+            double total = 0, best = 1e10, total_stage1 = 0, total_stage2 = 0;
+            unsigned long long total_cycles = 0;
+            for (const Sample &sample : samples) {
+                total += sample.seconds;
+                best = std::min(best, sample.seconds);
+                total_stage1 += sample.stage1_seconds;
+                total_stage2 += sample.stage2_seconds;
+                total_cycles += sample.cycles;
+            }
+            double mean = total / repeat, variance = 0;
+            for (const Sample &sample : samples) variance += (sample.seconds - mean) * (sample.seconds - mean);
+            double stddev = repeat > 1 ? sqrt(variance / (repeat - 1)) : 0;
+            double megabytes = size / 1024.0 / 1024.0;
+            double cycles_per_byte = static_cast<double>(total_cycles) / repeat / size;
+            printf("%-40s %-18s %10.2f %10.2f %8.2f ", name.c_str(), parser.name, megabytes / mean, megabytes / best,
+                   100 * stddev / mean);
+            if (total_cycles > 0) printf("%10.2f ", cycles_per_byte);
+            else printf("%10s ", "-");
+            if (total_stage1 + total_stage2 > 0) {
+                printf("%10.2f %10.2f\n", 100 * total_stage1 / total, 100 * total_stage2 / total);
+            } else {
+                printf("%10s %10s\n", "-", "-");
+            }
+
+            writer.key("runs");
+            writer.value(repeat);
+            writer.key("mean_seconds");
+            writer.value(mean);
+            writer.key("best_seconds");
+            writer.value(best);
+            writer.key("stddev_seconds");
+            writer.value(stddev);
+            writer.key("mb_per_second");
+            writer.value(megabytes / mean);
+            writer.key("best_mb_per_second");
+            writer.value(megabytes / best);
+            writer.key("cycles_per_byte");
+            if (total_cycles > 0) writer.value(cycles_per_byte);
+            else writer.null_value();
+            if (total_stage1 + total_stage2 > 0) {
+                writer.key("stage1_mean_seconds");
+                writer.value(total_stage1 / repeat);
+                writer.key("stage2_mean_seconds");
+                writer.value(total_stage2 / repeat);
+            }
+            writer.end_object();
+        }
+
+        writer.end_array();
+        writer.end_object();
+        aligned_free(input);
+        aligned_free(buf);
+    }
+    writer.end_array();
+    writer.end_object();
+
+    if (json_path != nullptr) {
+        FILE *output = fopen(json_path, "w");
+        if (output == nullptr) {
+            printf("cannot open %s\n", json_path);
+            return 1;
+        }
+        std::string_view text = writer.str();
+        fwrite(text.data(), 1, text.size(), output);
+        fputc('\n', output);
+        fclose(output);
+    }
+}
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/flags.h"
+#include "../src/mercuryparser.h"
+#include "../src/parsestring.h"
+#include "../src/utils.h"
+
+#if PERF_EVENTS
+# include "../src/linux-perf-events.h"
+#endif
+
+using namespace MercuryJson;
+
+
+// Fraction of the bytes of each input that are special to the kernel: backslashes, quotes, structural characters, set
+// bits or escape sequences.
+static const double kDensities[] = {0.0, 0.01, 0.05, 0.25, 0.5};
+
+static size_t kRepeat = 20;
+
+// Sink for the results of the kernels, so that they are not optimized away.
+static volatile uint64_t sink;
+
+#if PERF_EVENTS
+static LinuxEvents<PERF_TYPE_HARDWARE> &__cycle_events() {
+    static LinuxEvents<PERF_TYPE_HARDWARE> events(std::vector<int>{PERF_COUNT_HW_CPU_CYCLES});
+    return events;
+}
+#endif
+
+// Runs `kernel`, which processes `bytes` bytes, `kRepeat` times, and prints the best cycles per byte, as counted by
+// perf events where available, and the best throughput.
+template <typename Kernel>
+static void __measure(const char *name, double density, size_t bytes, Kernel &&kernel) {
+#if PERF_EVENTS
+    LinuxEvents<PERF_TYPE_HARDWARE> &events = __cycle_events();
+    std::vector<unsigned long long> results(1, 0);
+#endif
+    unsigned long long best_cycles = 0;
+    double best_time = 1e10;
+    for (size_t i = 0; i < kRepeat; ++i) {
+#if PERF_EVENTS
+        events.start();
+#endif
+        auto start_time = std::chrono::steady_clock::now();
+        sink = sink + kernel();
+        std::chrono::duration<double> runtime = std::chrono::steady_clock::now() - start_time;
+#if PERF_EVENTS
+        events.end(results);
+        if (best_cycles == 0 || (results[0] != 0 && results[0] < best_cycles)) best_cycles = results[0];
+#endif
+        best_time = std::min(best_time, runtime.count());
+    }
+    printf("%-44s %8.2f ", name, density);
+    if (best_cycles > 0) printf("%10.3f ", static_cast<double>(best_cycles) / bytes);
+    else printf("%10s ", "-");
+    printf("%10.2f\n", bytes / best_time / 1024 / 1024);
+}
+
+// `size` bytes, each `special` with probability `density`, and `other` otherwise, padded as `read_file` does.
+static char *__generate(size_t size, double density, const char *special, char other, std::mt19937_64 &random) {
+    char *input = aligned_malloc(size + 2 * kAlignmentSize);
+    std::bernoulli_distribution is_special(density);
+    size_t num_special = strlen(special);
+    for (size_t i = 0; i < size; ++i)
+        input[i] = is_special(random) ? special[random() % num_special] : other;
+    memset(input + size, ' ', 2 * kAlignmentSize);
+    return input;
+}
+
+static void __bench_stage1(size_t size, double density, std::mt19937_64 &random) {
+    size_t num_blocks = size / 64;
+
+    char *backslashes = __generate(size, density, "\\", 'a', random);
+    __measure("extract_escape_mask", density, size, [&] {
+        uint64_t prev_escape = 0, result = 0;
+        for (size_t i = 0; i < num_blocks; ++i)
+            result ^= extract_escape_mask(Warp(backslashes + i * 64), &prev_escape);
+        return result;
+    });
+    aligned_free(backslashes);
+
+    char *quotes = __generate(size, density, "\"", 'a', random);
+    __measure("extract_literal_mask", density, size, [&] {
+        uint64_t prev_literal = 0, quote_mask, result = 0;
+        for (size_t i = 0; i < num_blocks; ++i)
+            result ^= extract_literal_mask(Warp(quotes + i * 64), 0, &prev_literal, &quote_mask);
+        return result;
+    });
+    aligned_free(quotes);
+
+    char *structurals = __generate(size, density, "{}[]:, \n", 'a', random);
+    __measure("extract_structural_whitespace_characters", density, size, [&] {
+        uint64_t structural_mask, whitespace_mask, result = 0;
+        for (size_t i = 0; i < num_blocks; ++i) {
+            extract_structural_whitespace_characters(Warp(structurals + i * 64), 0, &structural_mask,
+                                                     &whitespace_mask);
+            result ^= structural_mask ^ whitespace_mask;
+        }
+        return result;
+    });
+
+    // The masks of a text of structural characters, whitespace and strings, computed ahead of time.
+    char *text = __generate(size, density, "{}[]:, \n\"", 'a', random);
+    std::vector<uint64_t> structural_masks(num_blocks), whitespace_masks(num_blocks);
+    std::vector<uint64_t> quote_masks(num_blocks), literal_masks(num_blocks);
+    uint64_t prev_escape = 0, prev_literal = 0;
+    for (size_t i = 0; i < num_blocks; ++i) {
+        Warp warp(text + i * 64);
+        uint64_t escape_mask = extract_escape_mask(warp, &prev_escape);
+        literal_masks[i] = extract_literal_mask(warp, escape_mask, &prev_literal, &quote_masks[i]);
+        extract_structural_whitespace_characters(warp, literal_masks[i], &structural_masks[i], &whitespace_masks[i]);
+    }
+    __measure("extract_pseudo_structural_mask", density, size, [&] {
+        uint64_t prev_pseudo = 0, result = 0;
+        for (size_t i = 0; i < num_blocks; ++i) {
+            result ^= extract_pseudo_structural_mask(structural_masks[i], whitespace_masks[i], quote_masks[i],
+                                                     literal_masks[i], &prev_pseudo);
+        }
+        return result;
+    });
+    aligned_free(text);
+    aligned_free(structurals);
+
+    std::vector<uint64_t> masks(num_blocks);
+    std::bernoulli_distribution is_set(density);
+    for (uint64_t &mask : masks) {
+        mask = 0;
+        for (size_t bit = 0; bit < 64; ++bit) mask |= static_cast<uint64_t>(is_set(random)) << bit;
+    }
+    // Indices are written 8 at a time, so there is room for 8 more.
+    std::vector<size_t> indices(size + 8);
+    __measure("construct_structural_character_pointers", density, size, [&] {
+        size_t num_indices = 0;
+        for (size_t i = 0; i < num_blocks; ++i)
+            construct_structural_character_pointers(masks[i], i * 64, indices.data(), &num_indices);
+        return num_indices;
+    });
+}
+
+static void __bench_parse_str(size_t size, double density, std::mt19937_64 &random) {
+    // Strings of 62 characters, each an escape sequence with probability `density`, between quotes.
+    const size_t kStringLength = 64;
+    size_t num_strings = size / kStringLength;
+    char *input = aligned_malloc(size + 2 * kAlignmentSize);
+    char *dest = aligned_malloc(size + 2 * kAlignmentSize);
+    std::bernoulli_distribution is_escape(density);
+    for (size_t i = 0; i < num_strings; ++i) {
+        char *str = input + i * kStringLength;
+        str[0] = '"';
+        for (size_t j = 1; j < kStringLength - 1; ++j) {
+            if (j + 2 < kStringLength && is_escape(random)) {
+                str[j++] = '\\';
+                str[j] = "n\"\\/t"[random() % 5];
+            } else {
+                str[j] = 'a';
+            }
+        }
+        str[kStringLength - 1] = '"';
+    }
+    memset(input + num_strings * kStringLength, ' ', size - num_strings * kStringLength + 2 * kAlignmentSize);
+
+    auto parse_all = [&](auto parse) {
+        return [&, parse] {
+            size_t total = 0, len;
+            for (size_t i = 0; i < num_strings; ++i) {
+                parse(input, dest + i * kStringLength, &len, i * kStringLength + 1);
+                total += len;
+            }
+            return total;
+        };
+    };
+    __measure("parse_str_avx", density, size, parse_all(parse_str_avx));
+    __measure("parse_str_per_bit", density, size, parse_all(parse_str_per_bit));
+    __measure("parse_str_naive", density, size, parse_all(parse_str_naive));
+    aligned_free(dest);
+    aligned_free(input);
+}
+
+static void __bench_parse_eight_digits(size_t size, std::mt19937_64 &random) {
+    char *digits = aligned_malloc(size + 2 * kAlignmentSize);
+    for (size_t i = 0; i < size; ++i) digits[i] = static_cast<char>('0' + random() % 10);
+    __measure("_parse_eight_digits", 1.0, size, [&] {
+        uint64_t result = 0;
+        for (size_t i = 0; i + 8 <= size; i += 8) result += _parse_eight_digits(digits + i);
+        return result;
+    });
+    aligned_free(digits);
+}
+
+// Microbenchmarks of the primitives of stage 1 and of string and number parsing, each on synthetic inputs with a
+// controlled density of the characters it reacts to, so that a regression can be traced to a single kernel.
+int main(int argc, char **argv) {
+    size_t size = 1 << 20;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--size") == 0) size = std::max(atol(argv[i + 1]), 64L);
+        else if (strcmp(argv[i], "--repeat") == 0) kRepeat = std::max(atol(argv[i + 1]), 1L);
+    }
+    size = size / 64 * 64;
+    printf("Input size: %lu, best of %lu runs\n", size, kRepeat);
+    printf("%-44s %8s %10s %10s\n", "kernel", "density", "cycles/B", "MB/s");
+
+    std::mt19937_64 random(42);
+    for (double density : kDensities) __bench_stage1(size, density, random);
+    for (double density : kDensities) __bench_parse_str(size, density, random);
+    __bench_parse_eight_digits(size, random);
+}
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/mercuryparser.h"
+#include "../src/parser_options.h"
+#include "../src/tape.h"
+#include "../src/utils.h"
+
+using namespace MercuryJson;
+
+
+// Stage 2 runtime of the tape state machine with numbers parsed inline, in batches, and by dedicated threads, for
+// number-heavy documents such as citylots.json. Then the runtime of `parse_number` alone against `strtod` on every
+// number of the document, and the number of decimals that `parse_number` does not round as `strtod` does.
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("usage: %s <file.json>\n", argv[0]);
+        return 1;
+    }
+    size_t size;
+    char *buf = read_file(argv[1], &size);
+    printf("File size: %lu\n", size);
+    char *input = aligned_malloc(size + 2 * kAlignmentSize);
+
+    struct Config {
+        const char *name;
+        size_t parse_num_num_threads;
+        bool batch_numbers;
+    };
+    const Config configs[] = {
+            {"inline", 0, false},
+            {"inline, batched", 0, true},
+            {"1 number thread", 1, false},
+            {"2 number threads", 2, false},
+            {"4 number threads", 4, false},
+            {"4 number threads, batched", 4, true},
+    };
+
+    size_t REPEAT = size < 100LL * 1000 * 1000 ? 100 : 10;
+    for (const Config &config : configs) {
+        ParserOptions options;
+        options.parse_num_num_threads = config.parse_num_num_threads;
+        options.batch_numbers = config.batch_numbers;
+        double total_time = 0.0, best_time = 1e10;
+        for (size_t i = 0; i < REPEAT; ++i) {
+            memcpy(input, buf, size + 1);  // include the null terminator
+            JSON json(input, size, true, options);
+            json.exec_stage1();
+            Tape tape(size, json.num_indices);
+            auto start_time = std::chrono::steady_clock::now();
+            tape.state_machine(input, json.indices, json.num_indices, options, json.get_stage1_strings());
+            std::chrono::duration<double> runtime = std::chrono::steady_clock::now() - start_time;
+            total_time += runtime.count();
+            best_time = std::min(best_time, runtime.count());
+        }
+        printf("%-28s average stage 2 runtime: %.4lf s (%.2lf MB/s), best: %.4lf s (%.2lf MB/s)\n",
+               config.name, total_time / REPEAT, (size * REPEAT / 1024.0 / 1024.0) / total_time,
+               best_time, (size / 1024.0 / 1024.0) / best_time);
+    }
+
+    memcpy(input, buf, size + 1);
+    std::vector<size_t> offsets;
+    {
+        JSON json(input, size, true);
+        json.exec_stage1();
+        for (size_t i = 0; i < json.num_indices; ++i) {
+            char ch = input[json.indices[i]];
+            if (ch == '-' || (ch >= '0' && ch <= '9')) offsets.push_back(json.indices[i]);
+        }
+    }
+    size_t num_decimals = 0, num_incorrect = 0;
+    for (size_t offset : offsets) {
+        bool is_decimal;
+        long long int value = parse_number(input, &is_decimal, offset);
+        if (!is_decimal) continue;
+        ++num_decimals;
+        if (value != plain_convert(strtod(input + offset, nullptr))) ++num_incorrect;
+    }
+    printf("%lu numbers, %lu decimals, %lu not correctly rounded\n", offsets.size(), num_decimals, num_incorrect);
+
+    double best_parse_number = 1e10, best_strtod = 1e10;
+    volatile long long int sink = 0;
+    for (size_t i = 0; i < REPEAT; ++i) {
+        auto start_time = std::chrono::steady_clock::now();
+        for (size_t offset : offsets) {
+            bool is_decimal;
+            sink = sink + parse_number(input, &is_decimal, offset);
+        }
+        std::chrono::duration<double> runtime = std::chrono::steady_clock::now() - start_time;
+        best_parse_number = std::min(best_parse_number, runtime.count());
+        start_time = std::chrono::steady_clock::now();
+        for (size_t offset : offsets) sink = sink + plain_convert(strtod(input + offset, nullptr));
+        runtime = std::chrono::steady_clock::now() - start_time;
+        best_strtod = std::min(best_strtod, runtime.count());
+    }
+    size_t num_numbers = std::max(offsets.size(), static_cast<size_t>(1));
+    printf("%-28s best: %.4lf s (%.2lf ns per number)\n", "parse_number", best_parse_number,
+           best_parse_number * 1e9 / num_numbers);
+    printf("%-28s best: %.4lf s (%.2lf ns per number)\n", "strtod", best_strtod, best_strtod * 1e9 / num_numbers);
+    aligned_free(input);
+}
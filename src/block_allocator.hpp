@@ -1,8 +1,10 @@
 #ifndef MERCURYJSON_BLOCK_ALLOCATOR_HPP
 #define MERCURYJSON_BLOCK_ALLOCATOR_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <new>
 #include <stdexcept>
-#include <vector>
 
 #include "flags.h"
 #include "utils.h"
@@ -14,63 +16,166 @@ namespace MercuryJson {
     class BlockAllocator {
     private:
         static constexpr size_t kAlignment = sizeof(default_class);
+        // Each new block is this many times as large as the previous one, up to `kMaxBlockSize`.
+        static constexpr size_t kGrowthFactor = 2;
+        // Blocks stop growing at this size, so that a large document does not reserve up to twice the memory it needs.
+        // Larger single allocations still get a block of their own size.
+        static constexpr size_t kMaxBlockSize = round_up(64 * 1024 * 1024, kAlignment);
+        // With huge pages, blocks of at least this size are mapped directly, in multiples of this size.
+        static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+        // On reset, a block larger than this many times the memory used by the last parse is trimmed.
+        static constexpr size_t kTrimFactor = 4;
+
+        // Blocks are linked through a header at their start, so that the blocks of a forked allocator can be spliced
+        // into its parent with a single compare-and-swap.
+        struct Block {
+            Block *next;
+            size_t size;
+            bool mapped;  // mapped with `__huge_page_malloc` instead of allocated with `aligned_malloc`
+        };
+        static constexpr size_t kHeaderSize = round_up(sizeof(Block), kAlignment);
 
         char *ptr;
-        std::vector<char *> all_memory;
-        size_t block_size, allocated;
+        size_t block_size, allocated, capacity;
+        // Size of the next block to allocate, grown geometrically up to `kMaxBlockSize`.
+        size_t next_block_size;
+        // Bytes allocated from previous blocks since the last reset, and by forks that joined since then.
+        size_t used_size;
+        std::atomic<size_t> joined_size;
+        bool huge_pages;
+        // Blocks owned by this allocator, newest first. Forked allocators keep their own list until they join.
+        std::atomic<Block *> blocks;
+        Block *oldest_block;
         BlockAllocator *parent;
 
-        inline void check_alloc(size_t size) {
-            if (allocated + size > block_size) {
-                allocated = 0;
-                ptr = aligned_malloc(block_size, kAlignment);
-                if (parent != nullptr) parent->all_memory.push_back(ptr);  // TODO: Make this thread-safe.
-                else all_memory.push_back(ptr);
+        // Link the chain of blocks from `newest` to `oldest` in front of the list. Forks may join concurrently with
+        // the owner of the list allocating new blocks.
+        inline void _push_blocks(Block *newest, Block *oldest) {
+            Block *head = blocks.load(std::memory_order_relaxed);
+            do {
+                oldest->next = head;
+            } while (!blocks.compare_exchange_weak(head, newest, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        static void _free_blocks(Block *block) {
+            while (block != nullptr) {
+                Block *next = block->next;
+                if (block->mapped) __untouched_free(block, kHeaderSize + block->size);
+                else aligned_free(reinterpret_cast<char *>(block));
+                block = next;
             }
         }
 
-        BlockAllocator(size_t block_size, BlockAllocator *parent) : parent(parent) {
-            block_size = round_up(block_size, kAlignment);
-            ptr = aligned_malloc(block_size, kAlignment);
-            parent->all_memory.push_back(ptr);
-            allocated = 0;
-            this->block_size = block_size;
+        void _new_block(size_t size) {
+            size_t usable_size = std::max(next_block_size, round_up(size, kAlignment));
+            bool mapped = huge_pages && kHeaderSize + usable_size >= kHugePageSize;
+            Block *block;
+            if (mapped) {
+                usable_size = round_up(kHeaderSize + usable_size, kHugePageSize) - kHeaderSize;
+                block = static_cast<Block *>(__huge_page_malloc(kHeaderSize + usable_size));
+            } else {
+                block = reinterpret_cast<Block *>(aligned_malloc(kHeaderSize + usable_size, kAlignment));
+            }
+            if (block == nullptr) throw std::bad_alloc();
+            block->size = usable_size;
+            block->mapped = mapped;
+            if (oldest_block == nullptr) oldest_block = block;
+            _push_blocks(block, block);
+            _use_block(block);
+            next_block_size = std::min(next_block_size * kGrowthFactor, kMaxBlockSize);
         }
 
-    public:
-        explicit BlockAllocator(size_t block_size) : parent(nullptr) {
-            block_size = round_up(block_size, kAlignment);
-            ptr = aligned_malloc(block_size, kAlignment);
-            all_memory.push_back(ptr);
+        inline void _use_block(Block *block) {
+            used_size += allocated;
+            ptr = reinterpret_cast<char *>(block) + kHeaderSize;
             allocated = 0;
-            this->block_size = block_size;
+            capacity = block->size;
         }
 
-        BlockAllocator(BlockAllocator &&other) noexcept {
-            ptr = other.ptr;
-            all_memory = std::move(other.all_memory);
-            block_size = other.block_size;
-            allocated = other.allocated;
-            parent = other.parent;
+        inline void check_alloc(size_t size) {
+            if (allocated + size > capacity) _new_block(size);
+        }
+
+        BlockAllocator(size_t block_size, bool huge_pages, BlockAllocator *parent)
+                : allocated(0), used_size(0), joined_size(0), huge_pages(huge_pages), blocks(nullptr),
+                  oldest_block(nullptr), parent(parent) {
+            this->block_size = next_block_size = round_up(block_size, kAlignment);
+            _new_block(0);
+        }
+
+    public:
+        // With `huge_pages`, large blocks are backed by huge pages, to reduce TLB misses on large documents.
+        explicit BlockAllocator(size_t block_size, bool huge_pages = false)
+                : BlockAllocator(block_size, huge_pages, nullptr) {}
+
+        BlockAllocator(BlockAllocator &&other) noexcept
+                : ptr(other.ptr), block_size(other.block_size), allocated(other.allocated), capacity(other.capacity),
+                  next_block_size(other.next_block_size), used_size(other.used_size),
+                  joined_size(other.joined_size.exchange(0)), huge_pages(other.huge_pages),
+                  blocks(other.blocks.exchange(nullptr)), oldest_block(other.oldest_block), parent(other.parent) {
+            other.oldest_block = nullptr;
         }
 
         ~BlockAllocator() {
-            for (char *p : all_memory)
-                aligned_free(p);
+            if (parent != nullptr) join();
+            else _free_blocks(blocks.load(std::memory_order_acquire));
         }
 
+        // Create an allocator with its own blocks, to be used by another thread. Its blocks are handed over to this
+        // allocator when it joins or is destroyed, so it must not outlive this allocator.
         BlockAllocator fork() {
             if (parent != nullptr) throw std::runtime_error("Cannot fork a forked allocator.");
-            return {block_size, this};
+            return {block_size, huge_pages, this};
         }
 
         BlockAllocator fork(size_t block_size) {
             if (parent != nullptr) throw std::runtime_error("Cannot fork a forked allocator.");
-            return {block_size, this};
+            return {block_size, huge_pages, this};
+        }
+
+        // Hand the blocks of a forked allocator over to its parent. Values allocated so far remain valid until the
+        // parent is destroyed, and the forked allocator can still be used afterwards.
+        void join() {
+            if (parent == nullptr || oldest_block == nullptr) return;
+            parent->_push_blocks(blocks.exchange(nullptr, std::memory_order_acquire), oldest_block);
+            parent->joined_size.fetch_add(used_size + allocated, std::memory_order_relaxed);
+            oldest_block = nullptr;
+            used_size = allocated = capacity = 0;
+        }
+
+        // Release all values allocated so far, keeping the memory for the next parse instead of freeing it. If a
+        // single block held the last parse, it is reused as is, unless it is more than `kTrimFactor` times larger than
+        // what the parse used. Otherwise, the blocks are replaced by a single block of `kGrowthFactor` times the
+        // high-water mark of the last parse, so that a slightly larger parse still fits in it, but with no more than
+        // `kMaxBlockSize` bytes to spare. All forks must have joined.
+        void reset() {
+            if (parent != nullptr) throw std::runtime_error("Cannot reset a forked allocator.");
+            size_t high_water = std::max(used_size + allocated + joined_size.exchange(0), block_size);
+            Block *head = blocks.exchange(nullptr, std::memory_order_acquire);
+            used_size = allocated = 0;
+            if (head != nullptr && head->next == nullptr && head->size <= kTrimFactor * high_water) {
+                blocks.store(head, std::memory_order_relaxed);
+                oldest_block = head;
+                _use_block(head);
+            } else {
+                _free_blocks(head);
+                oldest_block = nullptr;
+                size_t spare_size = std::min((kGrowthFactor - 1) * high_water, kMaxBlockSize);
+                next_block_size = round_up(high_water + spare_size, kAlignment);
+                _new_block(0);
+            }
         }
 
         inline size_t size() { return block_size; }
 
+        // Total size of the blocks held by this allocator, not including those of forks that have not joined yet.
+        size_t reserved_size() const {
+            size_t total = 0;
+            for (Block *block = blocks.load(std::memory_order_acquire); block != nullptr; block = block->next)
+                total += block->size;
+            return total;
+        }
+
         template <typename T = default_class>
         T *allocate(size_t size, size_t ensure_extra = 0) {
             size_t alloc_size = round_up(size * sizeof(T), kAlignment);
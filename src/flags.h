@@ -16,6 +16,12 @@
 # endif
 #endif
 
+// Whether to keep the escape and quote masks computed by stage 1 by default (2 bits per input character), so that
+// string parsing only has to copy characters. Can be overridden at runtime through `ParserOptions`.
+#ifndef PARSE_STR_STAGE1_MASKS
+# define PARSE_STR_STAGE1_MASKS 0
+#endif
+
 // Whether to use fully-vectorized string parsing implementation. Only works when PARSE_STR_MODE == 1.
 #ifndef PARSE_STR_FULLY_AVX
 # define PARSE_STR_FULLY_AVX 0
@@ -30,7 +36,8 @@
 # endif
 #endif
 
-// Number of extra dedicated threads for string parsing. Set to 0 to disable.
+// Default number of extra dedicated threads for string parsing. Set to 0 to disable, or -1 to select automatically.
+// Can be overridden at runtime through `ParserOptions`.
 #ifndef PARSE_STR_NUM_THREADS
 # define PARSE_STR_NUM_THREADS 4
 #endif
@@ -47,7 +54,17 @@
 # define PARSE_NUMBER_AVX 1
 #endif
 
-// Number of extra dedicated threads for number parsing. Set to 0 to disable.
+// Whether to parse numbers in batches of four by default, one per 64-bit lane of AVX2 vectors, either collected by
+// the state machine, or by the number parsing threads. Integers and decimals without exponents of up to 15 characters
+// are parsed this way, and other numbers one at a time. Only works when TAPE_STATE_MACHINE == 1. Can be overridden at
+// runtime through `ParserOptions`.
+#ifndef PARSE_NUMBER_BATCH
+# define PARSE_NUMBER_BATCH 0
+#endif
+
+// Default number of extra dedicated threads for number parsing. Set to 0 to disable, or -1 to select automatically.
+// The state machine then only lists numbers, which are parsed afterwards by these threads and the calling thread in
+// equal shares, while strings may still be parsed. Can be overridden at runtime through `ParserOptions`.
 #ifndef PARSE_NUM_NUM_THREADS
 # define PARSE_NUM_NUM_THREADS 0
 #endif
@@ -59,7 +76,8 @@
 # define SHIFT_REDUCE_PARSER 0
 #endif
 
-// Number of threads to use for shift-reduce parsing.
+// Default number of threads to use for shift-reduce parsing. Set to -1 to select automatically.
+// Can be overridden at runtime through `ParserOptions`.
 #ifndef SHIFT_REDUCE_NUM_THREADS
 # define SHIFT_REDUCE_NUM_THREADS 4
 #endif
@@ -74,11 +92,88 @@
 # define TAPE_STATE_MACHINE 1
 #endif
 
-// Number of threads to use for state machine-based tape parsing.
+// Default number of threads to use for state machine-based tape parsing. Set to -1 to select automatically.
+// Can be overridden at runtime through `ParserOptions`.
 #ifndef TAPE_STATE_MACHINE_NUM_THREADS
 # define TAPE_STATE_MACHINE_NUM_THREADS 4
 #endif
 
+// Whether to intern object keys into a per-document symbol table by default, storing key ids on the tape instead of
+// strings. Only works when TAPE_STATE_MACHINE == 1. Can be overridden at runtime through `ParserOptions`. Keys are
+// compared by their unescaped content, except with PARSE_STR_MODE == -1, where no string is unescaped and keys are
+// compared as written, so that `"a\u0062"` and `"ab"` are different keys.
+#ifndef TAPE_INTERN_KEYS
+# define TAPE_INTERN_KEYS 0
+#endif
+
+// Whether to leave strings unparsed on the tape by default. Stage 1 records which strings contain escapes, strings
+// without escapes are read directly from the input, and the others are unescaped on first access through
+// `Tape::get_string`. Only works when TAPE_STATE_MACHINE == 1. Can be overridden at runtime through `ParserOptions`.
+#ifndef TAPE_LAZY_STRINGS
+# define TAPE_LAZY_STRINGS 0
+#endif
+
+// Whether to store numbers out of range (integers beyond 64 bits, decimals beyond the range of a double) on the tape as
+// raw numbers by default, keeping their source text, instead of failing. Integers above INT64_MAX up to UINT64_MAX are
+// always stored as unsigned. Only works when TAPE_STATE_MACHINE == 1. Can be overridden at runtime through
+// `ParserOptions`.
+#ifndef TAPE_RAW_BIG_NUMBERS
+# define TAPE_RAW_BIG_NUMBERS 0
+#endif
+
+// Whether to store arrays whose elements are all numbers as packed arrays by default, with the elements stored on the
+// tape as int64_t, or as doubles if any of them is a decimal, and read through `Tape::get_array_span`. Arrays that
+// cannot be packed as they are closed, because numbers are deferred or batched or the array crosses tape segments,
+// are packed in a pass over the finished tape. Only works when TAPE_STATE_MACHINE == 1. Can be overridden at runtime
+// through `ParserOptions`.
+#ifndef TAPE_PACK_NUMERIC_ARRAYS
+# define TAPE_PACK_NUMERIC_ARRAYS 0
+#endif
+
+// Default number of threads to use for building a DOM from a tape (`Tape::to_dom`), splitting the elements of the
+// root array or object between them. Set to -1 to select automatically. Can be overridden at runtime through
+// `ParserOptions`.
+#ifndef TAPE_TO_DOM_NUM_THREADS
+# define TAPE_TO_DOM_NUM_THREADS 4
+#endif
+
+// Default number of threads to use for encoding a tape into other formats, such as MessagePack and CBOR, splitting the
+// elements of the root array or object between them. Set to -1 to select automatically. Can be overridden at runtime
+// through `ParserOptions`.
+#ifndef TAPE_EXPORT_NUM_THREADS
+# define TAPE_EXPORT_NUM_THREADS 4
+#endif
+
+
+/* Thread Pool */
+// Number of worker threads in the global thread pool. Set to 0 to use one worker per extra hardware thread.
+#ifndef THREAD_POOL_NUM_THREADS
+# define THREAD_POOL_NUM_THREADS 0
+#endif
+
+// Whether to pin each worker thread of the global thread pool to a CPU. Only available for Linux.
+#ifndef THREAD_POOL_PIN_WORKERS
+# ifdef __linux__
+#  define THREAD_POOL_PIN_WORKERS 1
+# else
+#  define THREAD_POOL_PIN_WORKERS 0
+# endif
+#endif
+
+// Whether to place workers, parsing phases and buffers on NUMA nodes. When enabled, stage 1 runs in parallel chunks
+// by default, and each chunk or segment runs on a worker of the node that first touches its part of `indices` and
+// the tape.
+#ifndef NUMA_AWARE
+# define NUMA_AWARE 0
+#endif
+
+
+/* Memory */
+// Whether to back large blocks of the DOM allocator with huge pages by default, using reserved huge pages if any, or
+// transparent huge pages otherwise. Only available for Linux. Can be overridden at runtime through `ParserOptions`.
+#ifndef ALLOCATOR_HUGE_PAGES
+# define ALLOCATOR_HUGE_PAGES 0
+#endif
 
 /* Testing */
 // Whether to run performance test for only one iteration.
@@ -91,11 +186,13 @@
 # define PRINT_JSON 0
 #endif
 
-// Whether to perf events. Only available for Linux.
-#ifdef __linux__
-# define PERF_EVENTS 1
-#else
-# define PERF_EVENTS 0
+// Whether to count cycles and other hardware events with perf events. Only available for Linux.
+#ifndef PERF_EVENTS
+# ifdef __linux__
+#  define PERF_EVENTS 1
+# else
+#  define PERF_EVENTS 0
+# endif
 #endif
 
 #endif // MERCURYJSON_FLAGS_H
@@ -0,0 +1,244 @@
+#include "json_writer.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <charconv>
+#include <new>
+
+
+namespace MercuryJson {
+
+    static const char kDigitPairs[] =
+            "00010203040506070809"
+            "10111213141516171819"
+            "20212223242526272829"
+            "30313233343536373839"
+            "40414243444546474849"
+            "50515253545556575859"
+            "60616263646566676869"
+            "70717273747576777879"
+            "80818283848586878889"
+            "90919293949596979899";
+
+    static const char kHexDigits[] = "0123456789abcdef";
+
+    // Write the decimal digits of `value` to `out`, two at a time from the end, and return their number.
+    static inline size_t __format_digits(uint64_t value, char *out) {
+        char digits[20];
+        char *ptr = digits + sizeof(digits);
+        while (value >= 100) {
+            ptr -= 2;
+            memcpy(ptr, kDigitPairs + value % 100 * 2, 2);
+            value /= 100;
+        }
+        if (value >= 10) {
+            ptr -= 2;
+            memcpy(ptr, kDigitPairs + value * 2, 2);
+        } else {
+            *--ptr = static_cast<char>('0' + value);
+        }
+        size_t len = digits + sizeof(digits) - ptr;
+        memcpy(out, ptr, len);
+        return len;
+    }
+
+    // Write the escape sequence of `ch` to `out`, and return its length.
+    static inline size_t __escape_char(unsigned char ch, char *out) {
+        out[0] = '\\';
+        switch (ch) {
+            case '"': out[1] = '"'; return 2;
+            case '\\': out[1] = '\\'; return 2;
+            case '\b': out[1] = 'b'; return 2;
+            case '\f': out[1] = 'f'; return 2;
+            case '\n': out[1] = 'n'; return 2;
+            case '\r': out[1] = 'r'; return 2;
+            case '\t': out[1] = 't'; return 2;
+            default:
+                memcpy(out + 1, "u00", 3);
+                out[4] = kHexDigits[ch >> 4U];
+                out[5] = kHexDigits[ch & 0xfU];
+                return 6;
+        }
+    }
+
+    JsonWriter::JsonWriter(bool pretty, size_t initial_capacity)
+            : size(0), capacity(std::max(initial_capacity, static_cast<size_t>(64))), depth(0), pretty(pretty),
+              need_comma(false), after_key(false) {
+        buffer = static_cast<char *>(malloc(capacity));
+        if (buffer == nullptr) throw std::bad_alloc();
+    }
+
+    JsonWriter::~JsonWriter() {
+        free(buffer);
+    }
+
+    void JsonWriter::_grow(size_t min_capacity) {
+        size_t new_capacity = std::max(2 * capacity, min_capacity);
+        auto *new_buffer = static_cast<char *>(realloc(buffer, new_capacity));
+        if (new_buffer == nullptr) throw std::bad_alloc();
+        buffer = new_buffer;
+        capacity = new_capacity;
+    }
+
+    void JsonWriter::_separate() {
+        if (after_key) {
+            after_key = false;
+            return;
+        }
+        _reserve(2 + 2 * depth);
+        if (need_comma) buffer[size++] = ',';
+        if (pretty && depth > 0) {
+            buffer[size++] = '\n';
+            memset(buffer + size, ' ', 2 * depth);
+            size += 2 * depth;
+        }
+    }
+
+    void JsonWriter::_write_string(const char *str, size_t len) {
+        // Each character takes at most 6 bytes escaped, and each block of 32 characters is stored whole before
+        // looking at its characters to escape.
+        _reserve(6 * len + 2 + 32);
+        char *out = buffer + size;
+        *out++ = '"';
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i backslash = _mm256_set1_epi8('\\');
+        const __m256i max_control = _mm256_set1_epi8(0x1f);
+        size_t idx = 0;
+        while (idx < len) {
+            size_t block_len = std::min(len - idx, static_cast<size_t>(32));
+            __m256i block;
+            if (block_len == 32) {
+                block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + idx));
+            } else {
+                // Pad the end of the string with spaces, which need no escaping.
+                alignas(32) char tail[32];
+                memset(tail, ' ', sizeof(tail));
+                memcpy(tail, str + idx, block_len);
+                block = _mm256_load_si256(reinterpret_cast<const __m256i *>(tail));
+            }
+            __m256i special = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)),
+                    _mm256_cmpeq_epi8(_mm256_min_epu8(block, max_control), block));
+            auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), block);
+            if (mask == 0) {
+                out += block_len;
+                idx += block_len;
+                continue;
+            }
+            // Keep the characters up to the first one to escape, and go on after it.
+            size_t pos = _tzcnt_u32(mask);
+            out += pos;
+            idx += pos;
+            out += __escape_char(static_cast<unsigned char>(str[idx]), out);
+            ++idx;
+        }
+        *out++ = '"';
+        size = out - buffer;
+    }
+
+    void JsonWriter::_write_integer(int64_t value) {
+        _separate();
+        _reserve(20);
+        if (value < 0) {
+            buffer[size++] = '-';
+            size += __format_digits(0 - static_cast<uint64_t>(value), buffer + size);
+        } else {
+            size += __format_digits(static_cast<uint64_t>(value), buffer + size);
+        }
+        need_comma = true;
+    }
+
+    void JsonWriter::_write_unsigned(uint64_t value) {
+        _separate();
+        _reserve(20);
+        size += __format_digits(value, buffer + size);
+        need_comma = true;
+    }
+
+    void JsonWriter::_open(char bracket) {
+        _separate();
+        _reserve(1);
+        buffer[size++] = bracket;
+        ++depth;
+        need_comma = false;
+    }
+
+    void JsonWriter::_close(char bracket) {
+        --depth;
+        _reserve(2 + 2 * depth);
+        // Empty containers are closed on the same line.
+        if (pretty && need_comma) {
+            buffer[size++] = '\n';
+            memset(buffer + size, ' ', 2 * depth);
+            size += 2 * depth;
+        }
+        buffer[size++] = bracket;
+        need_comma = true;
+    }
+
+    void JsonWriter::key(std::string_view key) {
+        _separate();
+        _write_string(key.data(), key.size());
+        _reserve(2);
+        buffer[size++] = ':';
+        if (pretty) buffer[size++] = ' ';
+        after_key = true;
+    }
+
+    void JsonWriter::value(std::string_view value) {
+        _separate();
+        _write_string(value.data(), value.size());
+        need_comma = true;
+    }
+
+    void JsonWriter::value(double value) {
+        if (!isfinite(value)) {
+            null_value();
+            return;
+        }
+        _separate();
+        // The shortest representation takes at most 24 characters, plus ".0".
+        _reserve(32);
+        char *begin = buffer + size;
+        char *end = std::to_chars(begin, begin + 32, value).ptr;
+        if (std::find_if(begin, end, [](char ch) { return ch == '.' || ch == 'e'; }) == end) {
+            memcpy(end, ".0", 2);
+            end += 2;
+        }
+        size = end - buffer;
+        need_comma = true;
+    }
+
+    void JsonWriter::value(bool value) {
+        _separate();
+        _reserve(5);
+        if (value) {
+            memcpy(buffer + size, "true", 4);
+            size += 4;
+        } else {
+            memcpy(buffer + size, "false", 5);
+            size += 5;
+        }
+        need_comma = true;
+    }
+
+    void JsonWriter::null_value() {
+        _separate();
+        _reserve(4);
+        memcpy(buffer + size, "null", 4);
+        size += 4;
+        need_comma = true;
+    }
+
+    void JsonWriter::clear() {
+        size = 0;
+        depth = 0;
+        need_comma = false;
+        after_key = false;
+    }
+
+}
@@ -0,0 +1,75 @@
+#ifndef MERCURYJSON_JSON_WRITER_H
+#define MERCURYJSON_JSON_WRITER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <string_view>
+#include <type_traits>
+
+
+namespace MercuryJson {
+
+    // Writes a JSON text token by token into a growable buffer, inserting commas, colons, and in pretty mode line
+    // breaks and indentation. `clear()` keeps the buffer, so messages written in turn reuse its memory, and only a
+    // message larger than all previous ones allocates. Calls must form a well-formed value, which is not checked.
+    class JsonWriter {
+        char *buffer;
+        size_t size, capacity;
+        size_t depth;
+        bool pretty;
+        bool need_comma;  // a value has been written in the current container
+        bool after_key;  // a key has been written, and its value comes next
+
+        void _grow(size_t min_capacity);
+
+        inline void _reserve(size_t length) {
+            if (size + length > capacity) _grow(size + length);
+        }
+
+        // Write the separator before a key, or before a value that does not follow a key.
+        void _separate();
+        void _open(char bracket);
+        void _close(char bracket);
+        void _write_string(const char *str, size_t len);
+        void _write_integer(int64_t value);
+        void _write_unsigned(uint64_t value);
+
+    public:
+        explicit JsonWriter(bool pretty = false, size_t initial_capacity = 4096);
+        ~JsonWriter();
+
+        JsonWriter(const JsonWriter &) = delete;
+        JsonWriter &operator=(const JsonWriter &) = delete;
+
+        inline void start_object() { _open('{'); }
+        inline void end_object() { _close('}'); }
+        inline void start_array() { _open('['); }
+        inline void end_array() { _close(']'); }
+
+        void key(std::string_view key);
+
+        void value(std::string_view value);
+        inline void value(const char *value) { this->value(std::string_view(value)); }
+        // Non-finite decimals have no JSON representation and are written as null. Other decimals are written in
+        // their shortest form that reads back to the same double, with a fraction or exponent to keep them decimal.
+        void value(double value);
+        void value(bool value);
+        void null_value();
+
+        template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+        inline void value(T value) {
+            if constexpr (std::is_signed_v<T>) _write_integer(static_cast<int64_t>(value));
+            else _write_unsigned(static_cast<uint64_t>(value));
+        }
+
+        // The text written since the last `clear()`. Not NUL-terminated.
+        inline std::string_view str() const { return std::string_view(buffer, size); }
+
+        // Start a new message, keeping the buffer.
+        void clear();
+    };
+
+}
+
+#endif // MERCURYJSON_JSON_WRITER_H
@@ -39,6 +39,7 @@ public:
 
     int group = -1; // no group
     num_events = config_vec.size();
+    ids.resize(num_events);
     uint32_t i = 0;
     for (auto config : config_vec) {
       attribs.config = config;
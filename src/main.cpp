@@ -45,13 +45,22 @@ void run(int argc, char **argv) {
 
         double total_time = 0.0, best_time = 1e10, total_stage1_time = 0.0, total_stage2_time = 0.0;
         size_t iterations = FORCE_ONE_ITERATION ? 1 : (size < 100 * 1000 * 1000 ? 1000 : 10);
+#if !USE_TAPE
+        // Keep the memory of the DOM across iterations, as a service parsing documents continuously would.
+        MercuryJson::BlockAllocator<MercuryJson::JsonValue> allocator(size, MercuryJson::ParserOptions().huge_pages);
+#endif
 
         for (size_t i = 0; i < iterations; ++i) {
 #if PERF_EVENTS
             unified.start();
 #endif
             memcpy(input, buf, size + 1);  // include the null terminator
+#if USE_TAPE
             auto json = MercuryJson::JSON(input, size, true);
+#else
+            allocator.reset();
+            auto json = MercuryJson::JSON(input, size, allocator, true);
+#endif
 #if USE_TAPE
             MercuryJson::Tape tape(size, size);
 #endif
@@ -86,7 +95,8 @@ void run(int argc, char **argv) {
 #endif
 #if USE_TAPE
 #if TAPE_STATE_MACHINE
-            tape.state_machine(const_cast<char *>(json.input), json.indices, json.num_indices);
+            tape.state_machine(const_cast<char *>(json.input), json.indices, json.num_indices, json.options,
+                               json.get_stage1_strings());
 #else
             MercuryJson::TapeWriter tape_writer(&tape, json.input, json.indices);
             tape_writer.parse_value();
@@ -184,6 +194,30 @@ void run(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
+#if RUN_TESTS
+    // Built as the `tests` target: run the tests that check their own results.
+    test_tfn_value();
+    test_parse_str_unicode();
+    test_parse_float();
+    test_parse_integer_range();
+    test_parse_decimal_range();
+    test_parse_numbers_batch();
+    test_minify();
+    test_deferred_numbers();
+    test_packed_arrays();
+    test_intern_keys();
+    test_lazy_strings();
+    test_tape_to_dom();
+    test_shift_reduce();
+    test_json_containers();
+    test_tape_transcode();
+    test_tape_to_csv();
+    test_block_allocator();
+    test_allocator_reset();
+    test_untouched_malloc();
+    test_json_writer();
+    return 0;
+#endif
 
 //    test_extract_warp_mask();
 //    test_tfn_value();
@@ -192,8 +226,13 @@ int main(int argc, char **argv) {
 //    test_parse_str_naive();
 //    test_parse_str_avx();
 //    test_parse_str_per_bit();
+//    test_parse_str_unicode();
 //    test_parse_string();
 //    test_parse_float();
+//    test_parse_integer_range();
+//    test_parse_decimal_range();
+//    test_parse_numbers_batch();
+//    test_minify();
 //    test_translate();
 
 //    test_remove_escaper();
@@ -201,6 +240,19 @@ int main(int argc, char **argv) {
 //    if (argc > 1) {
 //        test_tape(argv[1]);
 //    }
+//    test_deferred_numbers();
+//    test_packed_arrays();
+//    test_intern_keys();
+//    test_lazy_strings();
+//    test_tape_to_dom();
+//    test_shift_reduce();
+//    test_json_containers();
+//    test_tape_transcode();
+//    test_tape_to_csv();
+//    test_block_allocator();
+//    test_allocator_reset();
+//    test_untouched_malloc();
+//    test_json_writer();
 
    run(argc, argv);
 
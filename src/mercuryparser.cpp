@@ -5,14 +5,16 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <sstream>
 #include <string>
-#include <thread>
 #include <variant>
 #include <vector>
 
 #include "constants.h"
+#include "parsenumber.h"
 #include "parsestring.h"
+#include "thread_pool.h"
 
 
 namespace MercuryJson {
@@ -98,7 +100,7 @@ namespace MercuryJson {
 
     const size_t kStructuralUnrollCount = 8;
 
-    inline void construct_structural_character_pointers(
+    void construct_structural_character_pointers(
             uint64_t pseudo_structural_mask, size_t offset, size_t *indices, size_t *base) {
         size_t next_base = *base + __builtin_popcountll(pseudo_structural_mask);
         while (pseudo_structural_mask) {
@@ -118,7 +120,7 @@ namespace MercuryJson {
     }
 
     void print_json(JsonValue *value, int indent) {
-        int cnt;
+        size_t cnt;
         switch (value->type) {
             case JsonValue::TYPE_NULL:
                 std::cout << "null";
@@ -133,14 +135,13 @@ namespace MercuryJson {
             case JsonValue::TYPE_OBJ:
                 std::cout << "{" << std::endl;
                 cnt = 0;
-                for (auto *elem = value->object; elem; elem = elem->next) {
+                for (auto &member : *value->object) {
                     print_indent(indent + 2);
-                    std::cout << "\"" << elem->key << "\": ";
-                    print_json(elem->value, indent + 2);
-                    if (elem->next != nullptr)
+                    std::cout << "\"" << member.key << "\": ";
+                    print_json(&member.value, indent + 2);
+                    if (++cnt < value->object->size)
                         std::cout << ",";
                     std::cout << std::endl;
-                    ++cnt;
                 }
                 print_indent(indent);
                 std::cout << "}";
@@ -148,13 +149,12 @@ namespace MercuryJson {
             case JsonValue::TYPE_ARR:
                 std::cout << "[" << std::endl;
                 cnt = 0;
-                for (auto *elem = value->array; elem; elem = elem->next) {
+                for (auto &elem : *value->array) {
                     print_indent(indent + 2);
-                    print_json(elem->value, indent + 2);
-                    if (elem->next != nullptr)
+                    print_json(&elem, indent + 2);
+                    if (++cnt < value->array->size)
                         std::cout << ",";
                     std::cout << std::endl;
-                    ++cnt;
                 }
                 print_indent(indent);
                 std::cout << "]";
@@ -229,8 +229,8 @@ namespace MercuryJson {
         return 0LL;
 #endif
         const char *s = input + offset;
-        long long int integer = 0LL;
-        double decimal = 0.0;
+        uint64_t integer = 0ULL;
+        int64_t exponent = 0;
         bool negative = false, _is_decimal = false;
         if (*s == '-') {
             ++s;
@@ -252,58 +252,52 @@ namespace MercuryJson {
             while (*s >= '0' && *s <= '9')
                 integer = integer * 10 + (*s++ - '0');
         }
-        if (s - input - offset > 18)
-            __error("integer part too large", input, offset);
+        size_t num_digits = s - input - offset - negative;
         if (*s == '.') {
             _is_decimal = true;
-            decimal = integer;
-            double multiplier = 0.1;
-            ++s;
+            const char *const fraction = ++s;
 #if PARSE_NUMBER_AVX
             while (_all_digits(s)) {
-                decimal += _parse_eight_digits(s) * multiplier * 0.0000001;  // 7 digits
-                multiplier *= 0.00000001;  // 8 digits
+                integer = integer * 100000000 + _parse_eight_digits(s);
                 s += 8;
             }
 #endif
-            while (*s >= '0' && *s <= '9') {
-                decimal += (*s++ - '0') * multiplier;
-                multiplier *= 0.1;
-            }if (multiplier == 0.1)
+            while (*s >= '0' && *s <= '9')
+                integer = integer * 10 + (*s++ - '0');
+            if (s == fraction)
                 __error("excessive characters at end of number", input, s - input - 1);
+            exponent = fraction - s;
+            num_digits += s - fraction;
         }
         if (*s == 'e' || *s == 'E') {
-            if (!_is_decimal) {
-                _is_decimal = true;
-                decimal = integer;
-            }
+            _is_decimal = true;
             ++s;
             bool negative_exp = false;
             if (*s == '-') {
                 negative_exp = true;
                 ++s;
             } else if (*s == '+') ++s;
-            double exponent = 0.0;
+            int64_t expo = 0;
             if (*s < '0' || *s > '9')
                 MercuryJson::__error("numbers must not have null exponents", input, s - input);
             do {
-                exponent = exponent * 10.0 + (*s++ - '0');
+                if (expo < kMaxDecimalExponent) expo = expo * 10 + (*s - '0');
+                ++s;
             } while (*s >= '0' && *s <= '9');
-            if (negative_exp) exponent = -exponent;
-            if (exponent < -308 || exponent > 308)
-                __error("decimal exponent out of range", input, offset);
-            decimal *= pow(10.0, exponent);
+            exponent += negative_exp ? -expo : expo;
         }
+        if (!_is_decimal && !integer_fits_int64(integer, num_digits, negative))
+            __error("integer out of range", input, offset);
         if (!kStructuralOrWhitespace[*s])
             __error("excessive characters at end of number", input, s - input);
         *is_decimal = _is_decimal;
-        if (negative) {
-            if (_is_decimal) return plain_convert(-decimal);
-            else return -integer;
-        } else {
-            if (_is_decimal) return plain_convert(decimal);
-            else return integer;
+        if (_is_decimal) {
+            double decimal = parse_decimal(input, offset, integer, exponent, num_digits, negative);
+            if (decimal_out_of_range(decimal, input, offset, integer, num_digits))
+                __error("decimal out of range", input, offset);
+            return plain_convert(decimal);
         }
+        return static_cast<long long int>(negative ? -integer : integer);
     }
 
     bool parse_true(const char *s, size_t offset) {
@@ -343,49 +337,96 @@ namespace MercuryJson {
         MercuryJson::__error(stream.str(), input, index);
     }
 
-#if PARSE_STR_NUM_THREADS
-
-    void JSON::_thread_parse_str(size_t pid) {
+    void JSON::_thread_parse_str(size_t pid, size_t num_threads) {
+        if (string_starts != nullptr) {
+            // Split by the length of strings, so threads finish together even if long strings are clustered.
+            Stage1Strings strings = get_stage1_strings();
+            for (size_t i = strings.split(pid, num_threads), end = strings.split(pid + 1, num_threads); i < end; ++i)
+                _parse_str<true>(indices[string_starts[i]]);
+            return;
+        }
 //        auto start_time = std::chrono::steady_clock::now();
         size_t idx;
-        const size_t *idx_ptr = indices + pid * num_indices / PARSE_STR_NUM_THREADS;  // deliberate shadowing
-        const size_t *end_ptr = indices + (pid + 1) * num_indices / PARSE_STR_NUM_THREADS;
+        const size_t *idx_ptr = indices + pid * num_indices / num_threads;  // deliberate shadowing
+        const size_t *end_ptr = indices + (pid + 1) * num_indices / num_threads;
         char ch;
         do {
             idx = *idx_ptr++;
             ch = input[idx];
             if (ch == '"') {
-# if ALLOC_PARSED_STR
+#if ALLOC_PARSED_STR
                 char *dest = literals + idx + 1;
-# else
+#else
                 char *dest = input + idx + 1;
-# endif
+#endif
 
-# if PARSE_STR_MODE == 2
+#if PARSE_STR_MODE >= 0
+                if (string_masks != nullptr) {
+                    parse_str_masked(input, dest, nullptr, idx + 1, string_masks);
+                    continue;
+                }
+#endif
+#if PARSE_STR_MODE == 2
                 parse_str_per_bit(input, dest, nullptr, idx + 1);
-# elif PARSE_STR_MODE == 1
+#elif PARSE_STR_MODE == 1
                 parse_str_avx(input, dest, nullptr, idx + 1);
-# elif PARSE_STR_MODE == 0
+#elif PARSE_STR_MODE == 0
                 parse_str_naive(input, dest, nullptr, idx + 1);
-# endif
+#endif
             }
         } while (idx_ptr != end_ptr);
 //        std::chrono::duration<double> runtime = std::chrono::steady_clock::now() - start_time;
 //        printf("parse str thread %lu: %.6lf\n", pid, runtime.count());
     }
 
-#endif
+    JSON::JSON(char *document, size_t size, bool manual_construct, const ParserOptions &options)
+            : owned_allocator(std::in_place, size, options.huge_pages), allocator(*owned_allocator), options(options) {
+        _construct(document, size, manual_construct);
+    }
+
+    JSON::JSON(char *document, size_t size, BlockAllocator<JsonValue> &allocator, bool manual_construct,
+               const ParserOptions &options)
+            : allocator(allocator), options(options) {
+        _construct(document, size, manual_construct);
+    }
+
+    template <typename T>
+    T *JSON::_alloc_buffer(size_t count) {
+        if (owned_allocator) return aligned_malloc<T>(count);
+        // The allocator only aligns to the size of a value.
+        char *buffer = allocator.allocate<char>(count * sizeof(T) + kAlignmentSize);
+        return reinterpret_cast<T *>(round_up(reinterpret_cast<uintptr_t>(buffer), kAlignmentSize));
+    }
+
+    template <typename T>
+    void JSON::_free_buffer(T *buffer) {
+        if (owned_allocator) aligned_free(buffer);
+    }
 
-    JSON::JSON(char *document, size_t size, bool manual_construct) : allocator(size) {
+    void JSON::_construct(char *document, size_t size, bool manual_construct) {
         input = document;
         input_len = size;
         this->document = nullptr;
 
-        idx_ptr = indices = aligned_malloc<size_t>(size);
+#if NUMA_AWARE
+        // Leave the pages untouched so each stage 1 chunk places its part of `indices` on its own node.
+        idx_ptr = indices = untouched_malloc<size_t>(size + kStructuralUnrollCount);
+#else
+        idx_ptr = indices = _alloc_buffer<size_t>(size);
+#endif
         num_indices = 0;
 #if ALLOC_PARSED_STR
-        literals = static_cast<char *>(aligned_malloc(size));
+        literals = _alloc_buffer<char>(size);
 #endif
+        // One bit per structural character, zeroed by stage 1 as indices are written.
+        escaped_strings = options.lazy_strings ? _alloc_buffer<uint64_t>(size / 64 + 2) : nullptr;
+        // Escape and quote masks of each block.
+        string_masks = options.string_masks ? _alloc_buffer<uint64_t>(2 * (size / 64 + 1)) : nullptr;
+        // The string list only helps to balance two or more string threads. The structural count is not known yet,
+        // but cannot exceed the input size, for which the automatic thread count is the largest.
+        collect_strings = !options.lazy_strings && options.get_parse_str_num_threads(size) >= 2;
+        string_starts = string_bytes = nullptr;
+        num_strings = string_capacity = 0;
 
         if (!manual_construct) {
             exec_stage1();
@@ -393,17 +434,164 @@ namespace MercuryJson {
         }
     }
 
+    // Shuffle indices moving the bytes of an 8-byte word selected by an 8-bit mask to the front of the word.
+    struct CompressTable {
+        uint64_t entries[256];
+
+        constexpr CompressTable() : entries() {
+            for (size_t mask = 0; mask < 256; ++mask) {
+                size_t num_kept = 0;
+                for (size_t idx = 0; idx < 8; ++idx)
+                    if (mask & (1U << idx)) entries[mask] |= static_cast<uint64_t>(idx) << (8 * num_kept++);
+            }
+        }
+    };
+
+    static constexpr CompressTable kCompressTable;
+
+    // Write the bytes of the 64-byte block at `block` selected by `keep_mask` to `output`, and return their number.
+    // Writes up to 8 bytes past the kept bytes, but never past the block when `output` is at most `block`.
+    static inline size_t __compress_block(const char *block, uint64_t keep_mask, char *output) {
+#if defined(__AVX512VBMI2__)
+        _mm512_mask_compressstoreu_epi8(output, keep_mask, _mm512_loadu_si512(block));
+        return __builtin_popcountll(keep_mask);
+#else
+        char *out = output;
+        for (size_t idx = 0; idx < 64; idx += 8, keep_mask >>= 8U) {
+            uint64_t word, mask = keep_mask & 0xffU;
+            memcpy(&word, block + idx, 8);
+            word = _mm_cvtsi128_si64(_mm_shuffle_epi8(_mm_cvtsi64_si128(word),
+                                                      _mm_cvtsi64_si128(kCompressTable.entries[mask])));
+            memcpy(out, &word, 8);
+            out += __builtin_popcountll(mask);
+        }
+        return out - output;
+#endif
+    }
+
+    size_t minify(const char *input, size_t len, char *output) {
+        uint64_t prev_escape_mask = 0;
+        uint64_t prev_quote_mask = 0;
+        uint64_t quote_mask, structural_mask, whitespace_mask;
+        char *out = output;
+        for (size_t offset = 0; offset < len; offset += 64) {
+            // The last block is copied, since its last stores may go past the end of the output, and its padding
+            // is dropped.
+            alignas(64) char tail[64];
+            const char *block = input + offset;
+            uint64_t keep_mask = ~0ULL;
+            if (len - offset < 64) {
+                memset(tail, ' ', 64);
+                memcpy(tail, block, len - offset);
+                block = tail;
+                keep_mask = _bzhi_u64(keep_mask, len - offset);
+            }
+            Warp warp(block);
+            uint64_t escape_mask = extract_escape_mask(warp, &prev_escape_mask);
+            uint64_t literal_mask = extract_literal_mask(warp, escape_mask, &prev_quote_mask, &quote_mask);
+            extract_structural_whitespace_characters(warp, literal_mask, &structural_mask, &whitespace_mask);
+            keep_mask &= ~whitespace_mask;
+            if (block == tail) {
+                size_t num_kept = __compress_block(tail, keep_mask, tail);
+                memcpy(out, tail, num_kept);
+                out += num_kept;
+            } else {
+                out += __compress_block(block, keep_mask, out);
+            }
+        }
+        return out - output;
+    }
+
     void JSON::exec_stage1() {
+        size_t num_threads = options.get_stage1_num_threads(input_len);
+        if (num_threads > 1) exec_stage1_parallel(num_threads);
+        else _exec_stage1_sequential();
+    }
+
+    static const size_t kNoString = static_cast<size_t>(-1);
+
+    // Mark the strings containing escaped characters in a block, given the structural index `base` of the first
+    // structural character in the block. `last_string` holds the structural index of the last string opened before
+    // the block (or `kNoString` if unknown), and is updated to the last one opened within the block. Returns whether
+    // an escaped character belongs to a string opened before the block. Words at the ends of parallel stage 1 chunks
+    // are shared, so bits are set atomically.
+    static inline bool __mark_escaped_strings(uint64_t escape_mask, uint64_t quote_mask, uint64_t literal_mask,
+                                              uint64_t pseudo_mask, size_t base, size_t *last_string,
+                                              uint64_t *escaped_strings) {
+        uint64_t open_mask = quote_mask & literal_mask;
+        uint64_t escaped_mask = escape_mask & literal_mask;
+        bool escaped_before = false;
+        size_t marked = kNoString;
+        for (; escaped_mask; escaped_mask = _blsr_u64(escaped_mask)) {
+            // Escaped characters belong to the last string opened before them.
+            uint64_t owner_mask = open_mask & _blsmsk_u64(escaped_mask);
+            size_t str_idx = *last_string;
+            if (owner_mask != 0)
+                str_idx = base + __builtin_popcountll(pseudo_mask & ((1ULL << (63 - _lzcnt_u64(owner_mask))) - 1));
+            else if (str_idx == kNoString) {
+                escaped_before = true;
+                continue;
+            }
+            if (str_idx == marked) continue;
+            __atomic_fetch_or(&escaped_strings[str_idx / 64], 1ULL << (str_idx % 64), __ATOMIC_RELAXED);
+            marked = str_idx;
+        }
+        if (open_mask != 0)
+            *last_string = base + __builtin_popcountll(pseudo_mask & ((1ULL << (63 - _lzcnt_u64(open_mask))) - 1));
+        return escaped_before;
+    }
+
+    // A string takes at least 2 bytes, so at most 32 strings are opened in a block.
+    static const size_t kMaxStringsPerBlock = 32;
+
+    // Append the strings opened in a block to the string list, given the structural index `base` of the first
+    // structural character in the block, and the number of bytes within strings before the block.
+    static inline void __collect_strings(uint64_t quote_mask, uint64_t literal_mask, uint64_t pseudo_mask, size_t base,
+                                         size_t bytes_base, size_t *string_starts, size_t *string_bytes,
+                                         size_t *num_strings) {
+        for (uint64_t open_mask = quote_mask & literal_mask; open_mask; open_mask = _blsr_u64(open_mask)) {
+            uint64_t before_mask = (open_mask & -open_mask) - 1;
+            string_starts[*num_strings] = base + __builtin_popcountll(pseudo_mask & before_mask);
+            string_bytes[(*num_strings)++] = bytes_base + __builtin_popcountll(literal_mask & before_mask);
+        }
+    }
+
+    // Make room for `capacity` strings in the string list, keeping its first `num_kept` strings.
+    void JSON::_reserve_strings(size_t capacity, size_t num_kept) {
+        if (capacity <= string_capacity) return;
+        size_t *starts = _alloc_buffer<size_t>(capacity);
+        size_t *bytes = _alloc_buffer<size_t>(capacity + 1);
+        if (num_kept > 0) {
+            memcpy(starts, string_starts, num_kept * sizeof(size_t));
+            memcpy(bytes, string_bytes, num_kept * sizeof(size_t));
+        }
+        _free_buffer(string_starts);
+        _free_buffer(string_bytes);
+        string_starts = starts;
+        string_bytes = bytes;
+        string_capacity = capacity;
+    }
+
+    void JSON::_exec_stage1_sequential() {
         uint64_t prev_escape_mask = 0;
         uint64_t prev_quote_mask = 0;
         uint64_t prev_pseudo_mask = 1;  // initial value set to 1 to allow literals at beginning of input
         uint64_t quote_mask, structural_mask, whitespace_mask;
         uint64_t pseudo_mask = 0;
+        size_t last_string = kNoString, num_zeroed_words = 0;
+        size_t num_string_bytes = 0;
+        num_strings = 0;
+        // The string count is only known at the end, so the list starts at one string per block and grows.
+        if (collect_strings) _reserve_strings(input_len / 64 + kMaxStringsPerBlock, 0);
         size_t offset = 0;
         for (; offset < input_len; offset += 64) {
             Warp warp(input + offset);
             uint64_t escape_mask = extract_escape_mask(warp, &prev_escape_mask);
             uint64_t literal_mask = extract_literal_mask(warp, escape_mask, &prev_quote_mask, &quote_mask);
+            if (string_masks != nullptr) {
+                string_masks[2 * (offset / 64)] = escape_mask;
+                string_masks[2 * (offset / 64) + 1] = quote_mask;
+            }
 
             // Dump pointers for *previous* iteration.
             construct_structural_character_pointers(pseudo_mask, offset - 64, indices, &num_indices);
@@ -411,52 +599,283 @@ namespace MercuryJson {
             extract_structural_whitespace_characters(warp, literal_mask, &structural_mask, &whitespace_mask);
             pseudo_mask = extract_pseudo_structural_mask(
                     structural_mask, whitespace_mask, quote_mask, literal_mask, &prev_pseudo_mask);
+
+            if (escaped_strings != nullptr) {
+                // Structural characters of this block are written to indices [num_indices, num_indices + 64].
+                for (; num_zeroed_words <= (num_indices + 64) / 64; ++num_zeroed_words)
+                    escaped_strings[num_zeroed_words] = 0;
+                __mark_escaped_strings(escape_mask, quote_mask, literal_mask, pseudo_mask, num_indices,
+                                       &last_string, escaped_strings);
+            }
+            if (collect_strings) {
+                if (num_strings + kMaxStringsPerBlock > string_capacity)
+                    _reserve_strings(2 * string_capacity, num_strings);
+                __collect_strings(quote_mask, literal_mask, pseudo_mask, num_indices, num_string_bytes,
+                                  string_starts, string_bytes, &num_strings);
+                num_string_bytes += __builtin_popcountll(literal_mask);
+            }
         }
         // Dump pointers for the final iteration.
         construct_structural_character_pointers(pseudo_mask, offset - 64, indices, &num_indices);
         if (num_indices == 0 || input[indices[num_indices - 1]] != '\0')  // Ensure '\0' is added to indices.
             indices[num_indices++] = offset - 64 + strlen(input + offset - 64);
+        if (string_bytes != nullptr) string_bytes[num_strings] = num_string_bytes;
         if (prev_quote_mask != 0)
             throw std::runtime_error("unclosed quotation marks");
     }
 
+    static const size_t kNumChunkCounts = 6;
+
+    /* Parallel stage 1:
+     * The input is split into chunks at block boundaries that are not preceded by a backslash, so the escape state
+     * of each chunk starts cleared. The only unknown state is whether a chunk starts inside a string. The first pass
+     * counts the structural characters of each chunk for both cases, together with the quote parity. A prefix sum
+     * then fixes the state and the output position of each chunk, and the second pass writes the indices directly
+     * into place.
+     */
+
+    // Returns the quote parity of the chunk as a full mask, and stores the number of structural characters when
+    // starting outside and inside a string to `counts[0]` and `counts[1]`. When collecting strings, also stores the
+    // number of strings opened to `counts[2]` and `counts[3]`, and the number of bytes within strings to `counts[4]`
+    // and `counts[5]`.
+    uint64_t JSON::_count_stage1_chunk(size_t begin, size_t end, uint64_t prev_pseudo_mask, size_t *counts) {
+        uint64_t prev_escape_mask = 0;
+        uint64_t prev_quote_mask = 0;
+        uint64_t prev_pseudo_masks[2] = {prev_pseudo_mask, 0};
+        uint64_t quote_mask, structural_mask, whitespace_mask;
+        for (size_t i = 0; i < kNumChunkCounts; ++i) counts[i] = 0;
+        for (size_t offset = begin; offset < end; offset += 64) {
+            Warp warp(input + offset);
+            uint64_t escape_mask = extract_escape_mask(warp, &prev_escape_mask);
+            uint64_t literal_mask = extract_literal_mask(warp, escape_mask, &prev_quote_mask, &quote_mask);
+            extract_structural_whitespace_characters(warp, 0, &structural_mask, &whitespace_mask);
+            for (int inside = 0; inside < 2; ++inside) {
+                uint64_t _literal_mask = inside ? ~literal_mask : literal_mask;
+                uint64_t pseudo_mask = extract_pseudo_structural_mask(
+                        structural_mask & ~_literal_mask, whitespace_mask & ~_literal_mask, quote_mask, _literal_mask,
+                        &prev_pseudo_masks[inside]);
+                counts[inside] += __builtin_popcountll(pseudo_mask);
+                if (collect_strings) {
+                    counts[2 + inside] += __builtin_popcountll(quote_mask & _literal_mask);
+                    counts[4 + inside] += __builtin_popcountll(_literal_mask);
+                }
+            }
+        }
+        return prev_quote_mask;
+    }
+
+    // Same as `construct_structural_character_pointers`, but never writes past `indices[limit - 1]`.
+    static inline void __construct_structural_character_pointers_bounded(
+            uint64_t pseudo_structural_mask, size_t offset, size_t *indices, size_t *base, size_t limit) {
+        if (*base + round_up(__builtin_popcountll(pseudo_structural_mask), kStructuralUnrollCount) <= limit) {
+            construct_structural_character_pointers(pseudo_structural_mask, offset, indices, base);
+            return;
+        }
+        for (; pseudo_structural_mask; pseudo_structural_mask = _blsr_u64(pseudo_structural_mask))
+            indices[(*base)++] = offset + _tzcnt_u64(pseudo_structural_mask);
+    }
+
+    // Same as the sequential stage 1 on a chunk, writing `num_chunk_indices` indices starting at `first_index`. The
+    // next chunk may already be writing right after this one, so the unrolled writes must not go past the indices
+    // of the chunk. Strings are collected starting at `first_string`, after `num_string_bytes` bytes within strings.
+    // When marking escaped strings, stores the last string opened in the chunk (or `kNoString`) to `last_string`,
+    // and returns whether the string continued from the previous chunk contains escaped characters.
+    bool JSON::_exec_stage1_chunk(size_t begin, size_t end, uint64_t prev_quote_mask, uint64_t prev_pseudo_mask,
+                                  size_t first_index, size_t num_chunk_indices, size_t first_string,
+                                  size_t num_string_bytes, size_t *last_string) {
+        uint64_t prev_escape_mask = 0;
+        uint64_t quote_mask, structural_mask, whitespace_mask;
+        uint64_t pseudo_mask = 0;
+        size_t *chunk_indices = indices + first_index;
+        size_t count = 0;
+        bool escaped_before = false;
+        *last_string = kNoString;
+        if (escaped_strings != nullptr) {
+            // Words shared with neighboring chunks are zeroed beforehand.
+            size_t first_word = (first_index + 63) / 64, end_word = (first_index + num_chunk_indices) / 64;
+            if (first_word < end_word) memset(escaped_strings + first_word, 0, (end_word - first_word) * 8);
+        }
+        size_t offset = begin;
+        for (; offset < end; offset += 64) {
+            Warp warp(input + offset);
+            uint64_t escape_mask = extract_escape_mask(warp, &prev_escape_mask);
+            uint64_t literal_mask = extract_literal_mask(warp, escape_mask, &prev_quote_mask, &quote_mask);
+            if (string_masks != nullptr) {
+                string_masks[2 * (offset / 64)] = escape_mask;
+                string_masks[2 * (offset / 64) + 1] = quote_mask;
+            }
+
+            // Dump pointers for *previous* iteration.
+            __construct_structural_character_pointers_bounded(
+                    pseudo_mask, offset - 64, chunk_indices, &count, num_chunk_indices);
+
+            extract_structural_whitespace_characters(warp, literal_mask, &structural_mask, &whitespace_mask);
+            pseudo_mask = extract_pseudo_structural_mask(
+                    structural_mask, whitespace_mask, quote_mask, literal_mask, &prev_pseudo_mask);
+
+            if (escaped_strings != nullptr) {
+                escaped_before |= __mark_escaped_strings(escape_mask, quote_mask, literal_mask, pseudo_mask,
+                                                         first_index + count, last_string, escaped_strings);
+            }
+            if (string_starts != nullptr) {
+                __collect_strings(quote_mask, literal_mask, pseudo_mask, first_index + count, num_string_bytes,
+                                  string_starts, string_bytes, &first_string);
+                num_string_bytes += __builtin_popcountll(literal_mask);
+            }
+        }
+        // Dump pointers for the final iteration.
+        __construct_structural_character_pointers_bounded(
+                pseudo_mask, offset - 64, chunk_indices, &count, num_chunk_indices);
+        return escaped_before;
+    }
+
+    void JSON::exec_stage1_parallel(size_t num_chunks) {
+        size_t num_blocks = (input_len + 63) / 64;
+        if (num_chunks > num_blocks) num_chunks = num_blocks;
+        if (num_chunks <= 1) {
+            _exec_stage1_sequential();
+            return;
+        }
+
+        std::vector<size_t> bounds(num_chunks + 1);
+        std::vector<uint64_t> prev_pseudo_masks(num_chunks);
+        bounds[0] = 0;
+        bounds[num_chunks] = input_len;
+        prev_pseudo_masks[0] = 1;
+        for (size_t i = 1; i < num_chunks; ++i) {
+            size_t begin = std::max(num_blocks * i / num_chunks * 64, bounds[i - 1]);
+            while (begin < input_len && input[begin - 1] == '\\') begin += 64;
+            bounds[i] = begin = std::min(begin, input_len);
+            // The pseudo-structural state when the chunk starts outside a string. Classify the previous block
+            // ignoring literals, since the last character before the chunk is not in a string in that case.
+            uint64_t structural_mask, whitespace_mask;
+            size_t prev_block = (begin - 1) / 64 * 64;
+            extract_structural_whitespace_characters(Warp(input + prev_block), 0, &structural_mask, &whitespace_mask);
+            prev_pseudo_masks[i] = ((structural_mask | whitespace_mask) >> ((begin - 1) % 64)) & 1U;
+        }
+
+        ThreadPool &pool = ThreadPool::global();
+        std::vector<size_t> counts(kNumChunkCounts * num_chunks);
+        std::vector<uint64_t> quote_parities(num_chunks);
+        {
+            Latch count_latch(pool);
+            for (size_t i = 0; i < num_chunks; ++i)
+                pool.submit(count_latch, [&, i] {
+                    quote_parities[i] = _count_stage1_chunk(bounds[i], bounds[i + 1], prev_pseudo_masks[i],
+                                                            &counts[kNumChunkCounts * i]);
+                }, pool.node_for_part(i, num_chunks));
+            count_latch.wait();
+        }
+
+        std::vector<uint64_t> prev_quote_masks(num_chunks);
+        std::vector<size_t> offsets(num_chunks), chunk_counts(num_chunks);
+        std::vector<size_t> string_offsets(num_chunks), string_byte_offsets(num_chunks);
+        uint64_t prev_quote_mask = 0;
+        size_t num_string_bytes = 0;
+        num_indices = num_strings = 0;
+        for (size_t i = 0; i < num_chunks; ++i) {
+            size_t inside = prev_quote_mask != 0;
+            const size_t *chunk_count = &counts[kNumChunkCounts * i];
+            prev_quote_masks[i] = prev_quote_mask;
+            if (inside) prev_pseudo_masks[i] = 0;
+            offsets[i] = num_indices;
+            chunk_counts[i] = chunk_count[inside];
+            num_indices += chunk_counts[i];
+            string_offsets[i] = num_strings;
+            num_strings += chunk_count[2 + inside];
+            string_byte_offsets[i] = num_string_bytes;
+            num_string_bytes += chunk_count[4 + inside];
+            prev_quote_mask ^= quote_parities[i];
+        }
+        if (collect_strings) {
+            _reserve_strings(num_strings, 0);
+            if (string_bytes != nullptr) string_bytes[num_strings] = num_string_bytes;
+        }
+        if (prev_quote_mask != 0)
+            throw std::runtime_error("unclosed quotation marks");
+
+        if (escaped_strings != nullptr) {
+            for (size_t i = 0; i < num_chunks; ++i) escaped_strings[offsets[i] / 64] = 0;
+            escaped_strings[num_indices / 64] = 0;
+        }
+        std::vector<size_t> last_strings(num_chunks);
+        std::vector<char> escaped_before(num_chunks);
+        {
+            Latch write_latch(pool);
+            for (size_t i = 0; i < num_chunks; ++i)
+                pool.submit(write_latch, [&, i] {
+                    escaped_before[i] = _exec_stage1_chunk(bounds[i], bounds[i + 1], prev_quote_masks[i],
+                                                           prev_pseudo_masks[i], offsets[i], chunk_counts[i],
+                                                           string_offsets[i], string_byte_offsets[i],
+                                                           &last_strings[i]);
+                }, pool.node_for_part(i, num_chunks));
+            write_latch.wait();
+        }
+        if (escaped_strings != nullptr) {
+            // Escaped characters at the start of a chunk belong to the last string opened in an earlier chunk.
+            size_t last_string = kNoString;
+            for (size_t i = 0; i < num_chunks; ++i) {
+                if (escaped_before[i] && last_string != kNoString)
+                    escaped_strings[last_string / 64] |= 1ULL << (last_string % 64);
+                if (last_strings[i] != kNoString) last_string = last_strings[i];
+            }
+        }
+
+        if (num_indices == 0 || input[indices[num_indices - 1]] != '\0') {  // Ensure '\0' is added to indices.
+            size_t last_block = (num_blocks - 1) * 64;
+            indices[num_indices++] = last_block + strlen(input + last_block);
+        }
+    }
+
     void JSON::exec_stage2() {
 //        std::chrono::time_point<std::chrono::steady_clock> start_time;
 //        std::chrono::duration<double> runtime;
-#if PARSE_STR_NUM_THREADS
+        size_t num_str_threads = options.get_parse_str_num_threads(num_indices);
 //        start_time = std::chrono::steady_clock::now();
-        std::thread parse_str_threads[PARSE_STR_NUM_THREADS];
-        for (size_t i = 0; i < PARSE_STR_NUM_THREADS; ++i)
-            parse_str_threads[i] = std::thread(&JSON::_thread_parse_str, this, i);
+        Latch parse_str_latch;
+        for (size_t i = 0; i < num_str_threads; ++i)
+            ThreadPool::global().submit(parse_str_latch, [this, i, num_str_threads] {
+                _thread_parse_str(i, num_str_threads);
+            });
 //        runtime = std::chrono::steady_clock::now() - start_time;
-//        printf("thread spawn: %.6lf\n", runtime.count());
-#endif
+//        printf("task submit: %.6lf\n", runtime.count());
 
 //        start_time = std::chrono::steady_clock::now();
 #if SHIFT_REDUCE_PARSER
-        document = _shift_reduce_parsing();  // final index is '\0'
+        // Final index is '\0'.
+        document = num_str_threads > 0 ? _shift_reduce_parsing<false>() : _shift_reduce_parsing<true>();
 #else
-        document = _parse_value();
+        document = allocator.construct(num_str_threads > 0 ? _parse_value<false>() : _parse_value<true>());
 #endif
         char ch = input[*idx_ptr];
         if (ch != '\0') _error("file end", ch, *idx_ptr);
 //        runtime = std::chrono::steady_clock::now() - start_time;
 //        printf("parse document: %.6lf\n", runtime.count());
-#if PARSE_STR_NUM_THREADS
 //        start_time = std::chrono::steady_clock::now();
-        for (std::thread &thread : parse_str_threads)
-            thread.join();
+        parse_str_latch.wait();
 //        runtime = std::chrono::steady_clock::now() - start_time;
 //        printf("wait join: %.6lf\n", runtime.count());
+        _free_indices();
+    }
+
+    void JSON::_free_indices() {
+        if (indices == nullptr) return;
+#if NUMA_AWARE
+        untouched_free(indices, input_len + kStructuralUnrollCount);
+#else
+        _free_buffer(indices);
 #endif
-        aligned_free(indices);
         indices = nullptr;
     }
 
     JSON::~JSON() {
-        if (indices != nullptr) aligned_free(indices);
+        _free_indices();
 #if ALLOC_PARSED_STR
-        aligned_free(literals);
+        _free_buffer(literals);
 #endif
+        _free_buffer(escaped_strings);
+        _free_buffer(string_masks);
+        _free_buffer(string_starts);
+        _free_buffer(string_bytes);
     }
 }
@@ -4,12 +4,15 @@
 #include <immintrin.h>
 #include <string.h>
 
+#include <algorithm>
+#include <optional>
 #include <string>
 #include <variant>
 #include <vector>
 
 #include "block_allocator.hpp"
 #include "flags.h"
+#include "parser_options.h"
 
 
 namespace MercuryJson {
@@ -37,6 +40,11 @@ namespace MercuryJson {
     void construct_structural_character_pointers(
             uint64_t pseudo_structural_mask, size_t offset, size_t *indices, size_t *base);
 
+    // Copy the `len` bytes of JSON text at `input` to `output` without the whitespace outside strings, 64 bytes at a
+    // time using the masks of stage 1, and return the length of the output. `output` must have room for `len` bytes,
+    // and may be `input` itself. The text is not validated.
+    size_t minify(const char *input, size_t len, char *output);
+
     /* Stage 2 */
 
     /* EBNF of JSON:
@@ -61,22 +69,30 @@ namespace MercuryJson {
      */
 
     struct JsonValue;
+    struct JsonMember;
 
-    struct JsonObject {
-        const char *key;
-        JsonValue *value;
-        JsonObject *next;
+    // Arrays and objects are stored contiguously: the number of elements, followed by the elements themselves.
+    // Object keys are null-terminated strings: their length is not cached in `JsonMember`, and is left to `strlen`.
+    struct JsonArray {
+        size_t size;
 
-        explicit JsonObject(const char *key, JsonValue *value, JsonObject *next = nullptr)
-                : key(key), value(value), next(next) {}
+        inline JsonValue *begin();
+        inline JsonValue *end();
+        inline JsonValue &operator[](size_t idx);
+
+        // Allocate an array of `size` elements from `allocator`, with the elements left uninitialized.
+        static inline JsonArray *allocate(BlockAllocator<JsonValue> &allocator, size_t size);
     };
 
-    struct JsonArray {
-        JsonValue *value;
-        JsonArray *next;
+    struct JsonObject {
+        size_t size;
+
+        inline JsonMember *begin();
+        inline JsonMember *end();
+        inline JsonMember &operator[](size_t idx);
 
-        explicit JsonArray(JsonValue *value, JsonArray *next = nullptr)
-                : value(value), next(next) {}
+        // Allocate an object of `size` members from `allocator`, with the members left uninitialized.
+        static inline JsonObject *allocate(BlockAllocator<JsonValue> &allocator, size_t size);
     };
 
     struct JsonValue {
@@ -101,11 +117,57 @@ namespace MercuryJson {
         //@formatter:on
     };
 
+    struct JsonMember {
+        const char *key;
+        JsonValue value;
+
+        JsonMember(const char *key, const JsonValue &value) : key(key), value(value) {}
+    };
+
+    inline JsonValue *JsonArray::begin() { return reinterpret_cast<JsonValue *>(this + 1); }
+    inline JsonValue *JsonArray::end() { return begin() + size; }
+    inline JsonValue &JsonArray::operator[](size_t idx) { return begin()[idx]; }
+
+    inline JsonArray *JsonArray::allocate(BlockAllocator<JsonValue> &allocator, size_t size) {
+        auto *array = reinterpret_cast<JsonArray *>(
+                allocator.allocate<char>(sizeof(JsonArray) + size * sizeof(JsonValue)));
+        array->size = size;
+        return array;
+    }
+
+    inline JsonMember *JsonObject::begin() { return reinterpret_cast<JsonMember *>(this + 1); }
+    inline JsonMember *JsonObject::end() { return begin() + size; }
+    inline JsonMember &JsonObject::operator[](size_t idx) { return begin()[idx]; }
+
+    inline JsonObject *JsonObject::allocate(BlockAllocator<JsonValue> &allocator, size_t size) {
+        auto *object = reinterpret_cast<JsonObject *>(
+                allocator.allocate<char>(sizeof(JsonObject) + size * sizeof(JsonMember)));
+        object->size = size;
+        return object;
+    }
+
     void __error_maybe_escape(char *context, size_t *length, char ch);
     [[noreturn]] void __error(const std::string &message, const char *input, size_t offset);
 
     namespace shift_reduce_impl { struct ParseStack; }
 
+    // What stage 1 found out about strings besides their structural indices, for stage 2 to parse strings with.
+    // Members are nullptr unless enabled through `ParserOptions`; see the members of `JSON` with the same names.
+    struct Stage1Strings {
+        const uint64_t *escaped_strings = nullptr;
+        const uint64_t *string_masks = nullptr;
+        const size_t *string_starts = nullptr;
+        const size_t *string_bytes = nullptr;
+        size_t num_strings = 0;
+
+        // First string of part `part` when splitting strings into `num_parts` parts of about the same total length.
+        // Requires `string_starts`.
+        inline size_t split(size_t part, size_t num_parts) const {
+            size_t bytes = string_bytes[num_strings] * part / num_parts;
+            return std::lower_bound(string_bytes, string_bytes + num_strings, bytes) - string_bytes;
+        }
+    };
+
     class JSON {
     public:
 #if ALLOC_PARSED_STR
@@ -118,32 +180,80 @@ namespace MercuryJson {
 #if ALLOC_PARSED_STR
         char *literals;
 #endif
+        // With `ParserOptions::lazy_strings`, bit `i` is set if `indices[i]` is the opening quote of a string that
+        // contains escape sequences. Otherwise nullptr.
+        uint64_t *escaped_strings;
+        // With `ParserOptions::string_masks`, the escape mask and quote mask computed by stage 1 for each 64-byte
+        // block of the input, interleaved, for string parsing. Otherwise nullptr.
+        uint64_t *string_masks;
+        // When strings are parsed by two or more dedicated threads, the structural index of the opening quote of each
+        // string, and the number of bytes within strings before each string, followed by the total. Otherwise nullptr.
+        // Allocated by stage 1, with room for `string_capacity` strings.
+        size_t *string_starts, *string_bytes;
+        size_t num_strings, string_capacity;
+        bool collect_strings;
 
         [[noreturn]] void _error(const char *expected, char encountered, size_t index);
 
-        JsonValue *_parse_value();
-        JsonValue *_parse_object();
-        JsonValue *_parse_array();
-
-        BlockAllocator<JsonValue> allocator;
-
+        // Parsing functions are specialized on whether strings are parsed inline, or by dedicated string threads.
+        template <bool kParseStrInline>
+        JsonValue _parse_value();
+        template <bool kParseStrInline>
+        JsonObject *_parse_object();
+        template <bool kParseStrInline>
+        JsonArray *_parse_array();
+        // Elements of the arrays and members of the objects being parsed, moved into the allocator once complete.
+        std::vector<JsonValue> value_stack;
+        std::vector<JsonMember> member_stack;
+
+        // Allocator for the values of the document: owned by the document, unless an external one is given.
+        std::optional<BlockAllocator<JsonValue>> owned_allocator;
+        BlockAllocator<JsonValue> &allocator;
+
+        template <bool kParseStrInline>
         char *_parse_str(size_t idx);
 
-#if PARSE_STR_NUM_THREADS
-        void _thread_parse_str(size_t pid);
-#endif
+        void _thread_parse_str(size_t pid, size_t num_threads);
 
+        template <bool kParseStrInline>
         void _thread_shift_reduce_parsing(const size_t *idx_begin, const size_t *idx_end,
                                           shift_reduce_impl::ParseStack *stack);
 
+        template <bool kParseStrInline>
         JsonValue *_shift_reduce_parsing();
 
+        void _reserve_strings(size_t capacity, size_t num_kept);
+        void _exec_stage1_sequential();
+        uint64_t _count_stage1_chunk(size_t begin, size_t end, uint64_t prev_pseudo_mask, size_t *counts);
+        bool _exec_stage1_chunk(size_t begin, size_t end, uint64_t prev_quote_mask, uint64_t prev_pseudo_mask,
+                                size_t first_index, size_t num_chunk_indices, size_t first_string,
+                                size_t num_string_bytes, size_t *last_string);
+        void _free_indices();
+        void _construct(char *document, size_t size, bool manual_construct);
+        // With an external allocator, the buffers of the document are allocated from it too, so that they are
+        // reused across documents. Otherwise they are allocated and freed with the document.
+        template <typename T>
+        T *_alloc_buffer(size_t count);
+        template <typename T>
+        void _free_buffer(T *buffer);
+
     public:
         JsonValue *document;
+        ParserOptions options;
 
-        JSON(char *document, size_t size, bool manual_construct = false);
+        JSON(char *document, size_t size, bool manual_construct = false,
+             const ParserOptions &options = ParserOptions());
+        // Allocate the values and buffers of the document from `allocator`, which can be reset and reused for the next
+        // document once this one is no longer needed, instead of allocating new memory for every document.
+        JSON(char *document, size_t size, BlockAllocator<JsonValue> &allocator, bool manual_construct = false,
+             const ParserOptions &options = ParserOptions());
 
         void exec_stage1();
+        inline Stage1Strings get_stage1_strings() const {
+            return {escaped_strings, string_masks, string_starts, string_bytes, num_strings};
+        }
+        // Run stage 1 on `num_chunks` chunks of the input in parallel. Each chunk writes its own part of `indices`.
+        void exec_stage1_parallel(size_t num_chunks);
         void exec_stage2();
 
         ~JSON();
@@ -156,25 +266,6 @@ namespace MercuryJson {
     void parse_null(const char *s, size_t offset = 0U);
     long long int parse_number(const char *s, bool *is_decimal, size_t offset = 0U);
 
-    inline char *JSON::_parse_str(size_t idx) {
-#if ALLOC_PARSED_STR
-        char *dest = literals + idx + 1;
-#else
-        char *dest = input + idx + 1;
-#endif
-
-#if !PARSE_STR_NUM_THREADS
-# if PARSE_STR_MODE == 2
-        parse_str_per_bit(input, dest, nullptr, idx + 1);
-# elif PARSE_STR_MODE == 1
-        parse_str_avx(input, dest, nullptr, idx + 1);
-# elif PARSE_STR_MODE == 0
-        parse_str_naive(input, dest, nullptr, idx + 1);
-# endif
-#endif
-        return dest;
-    }
-
     inline __m256i convert_to_mask(uint32_t input);
 
     void __printChar_m256i(__m256i raw);
@@ -0,0 +1,65 @@
+#ifndef MERCURYJSON_PARSENUMBER_H
+#define MERCURYJSON_PARSENUMBER_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace MercuryJson {
+
+    // Decimal exponents are only accumulated up to this value, so that they cannot overflow. Whether a decimal is out
+    // of range is decided from its value instead, as a large exponent can be offset by the position of the digits.
+    static const int64_t kMaxDecimalExponent = 1000;
+
+    // Whether the integer with `num_digits` digits, the first of which is `first_digit`, fits into 64 bits unsigned,
+    // given `value`, the integer accumulated modulo 2^64. Any 19 digits fit; 20 digits fit if they start with '1' and
+    // did not wrap around, since 2 * 10^19 - 2^64 < 2^63 <= 10^19.
+    inline bool integer_fits_uint64(uint64_t value, size_t num_digits, char first_digit) {
+        if (num_digits <= 19) return true;
+        return num_digits == 20 && first_digit == '1' && value > static_cast<uint64_t>(INT64_MAX);
+    }
+
+    // Whether the integer `value` with `num_digits` digits (see `integer_fits_uint64`), negated if `negative`, fits
+    // into 64 bits signed.
+    inline bool integer_fits_int64(uint64_t value, size_t num_digits, bool negative) {
+        if (num_digits > 19) return false;
+        return value <= static_cast<uint64_t>(INT64_MAX) + negative;
+    }
+
+    // Value of `mantissa` * 10^`exponent`, negated if `negative`, rounded to the nearest double using the
+    // Eisel-Lemire algorithm. Returns false if the result cannot be decided this way: when it is too close to a
+    // halfway point, subnormal, or out of range.
+    bool compute_decimal_fast(uint64_t mantissa, int64_t exponent, bool negative, double *result);
+
+    // Maximum length of the numbers parsed by `parse_numbers_x4`, so that they end within 16 bytes.
+    static const size_t kBatchMaxLength = 15;
+
+    // Parse the four numbers at `input + offsets[i]` at once with AVX2, if they are integers or decimals without
+    // exponents, of at most `kBatchMaxLength` characters. Returns the mask of numbers parsed this way. For these,
+    // `values[i]` holds the integer, or the bits of the double if bit `i` of `*decimal_mask` is set. Reads 16 bytes of
+    // input from each number on.
+    unsigned parse_numbers_x4(const char *input, const size_t *offsets, uint64_t *values, unsigned *decimal_mask);
+
+    // Correctly rounded value of the decimal number at `input[offset]`, which has `num_digits` digits in its integer
+    // and fractional parts, equal to `mantissa` * 10^`exponent` if they fit into `mantissa`. Numbers with more than 19
+    // significant digits, and those `compute_decimal_fast` cannot decide, are parsed again with `strtod`.
+    double parse_decimal(const char *input, size_t offset, uint64_t mantissa, int64_t exponent, size_t num_digits,
+                         bool negative);
+
+    // Whether `decimal`, as returned by `parse_decimal` for the number at `input[offset]`, is out of the range of
+    // doubles: infinite, or zero although one of its digits is not. Subnormal values are in range. `mantissa` and
+    // `num_digits` are as for `parse_decimal`. The mantissa wraps around with more than 19 digits, so the digits are
+    // checked instead.
+    inline bool decimal_out_of_range(double decimal, const char *input, size_t offset, uint64_t mantissa,
+                                     size_t num_digits) {
+        if (decimal != 0) return isinf(decimal);
+        if (num_digits <= 19) return mantissa != 0;
+        for (const char *s = input + offset + (input[offset] == '-'); (*s >= '0' && *s <= '9') || *s == '.'; ++s)
+            if (*s >= '1' && *s <= '9') return true;
+        return false;
+    }
+
+}
+
+#endif // MERCURYJSON_PARSENUMBER_H
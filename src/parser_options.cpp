@@ -0,0 +1,99 @@
+#include "parser_options.h"
+
+#include <algorithm>
+
+#include "thread_pool.h"
+
+
+namespace MercuryJson {
+
+    // Minimum amount of work per thread for automatically selected thread counts. Below these, the cost of
+    // scheduling tasks and merging partial results outweighs the parallel speed-up.
+    static const size_t kStage1BytesPerThread = 1 << 20;
+    static const size_t kTapeIndicesPerThread = 1 << 16;
+    static const size_t kShiftReduceIndicesPerThread = 1 << 16;
+    static const size_t kParseStrIndicesPerThread = 1 << 17;
+    static const size_t kParseNumIndicesPerThread = 1 << 17;
+    static const size_t kToDomTapeEntriesPerThread = 1 << 16;
+    static const size_t kExportTapeEntriesPerThread = 1 << 16;
+
+    // Threads for a phase that runs on the calling thread and the pool.
+    static size_t __auto_num_threads(size_t amount, size_t amount_per_thread) {
+        size_t max_threads = ThreadPool::global().size() + 1;
+        return std::max(static_cast<size_t>(1), std::min(amount / amount_per_thread, max_threads));
+    }
+
+    // Dedicated threads for a phase that can also be done inline by the main parsing algorithm.
+    static size_t __auto_num_dedicated_threads(size_t amount, size_t amount_per_thread) {
+        size_t num_threads = std::min(amount / amount_per_thread, ThreadPool::global().size());
+        return num_threads >= 2 ? num_threads : 0;
+    }
+
+    ParserOptions::ParserOptions()
+#if NUMA_AWARE
+            : stage1_num_threads(kAuto),
+#else
+            : stage1_num_threads(1),
+#endif
+              tape_num_threads(static_cast<size_t>(TAPE_STATE_MACHINE_NUM_THREADS)),
+              shift_reduce_num_threads(static_cast<size_t>(SHIFT_REDUCE_NUM_THREADS)),
+              parse_str_num_threads(static_cast<size_t>(PARSE_STR_NUM_THREADS)),
+              parse_num_num_threads(static_cast<size_t>(PARSE_NUM_NUM_THREADS)),
+              to_dom_num_threads(static_cast<size_t>(TAPE_TO_DOM_NUM_THREADS)),
+              export_num_threads(static_cast<size_t>(TAPE_EXPORT_NUM_THREADS)),
+              intern_keys(TAPE_INTERN_KEYS),
+              lazy_strings(TAPE_LAZY_STRINGS),
+              string_masks(PARSE_STR_STAGE1_MASKS),
+              raw_big_numbers(TAPE_RAW_BIG_NUMBERS),
+              batch_numbers(PARSE_NUMBER_BATCH),
+              pack_numeric_arrays(TAPE_PACK_NUMERIC_ARRAYS),
+              huge_pages(ALLOCATOR_HUGE_PAGES) {}
+
+    ParserOptions ParserOptions::automatic() {
+        ParserOptions options;
+        options.stage1_num_threads = kAuto;
+        options.tape_num_threads = kAuto;
+        options.shift_reduce_num_threads = kAuto;
+        options.parse_str_num_threads = kAuto;
+        options.parse_num_num_threads = kAuto;
+        options.to_dom_num_threads = kAuto;
+        options.export_num_threads = kAuto;
+        return options;
+    }
+
+    size_t ParserOptions::get_stage1_num_threads(size_t input_len) const {
+        if (stage1_num_threads != kAuto) return std::max(static_cast<size_t>(1), stage1_num_threads);
+        return __auto_num_threads(input_len, kStage1BytesPerThread);
+    }
+
+    size_t ParserOptions::get_tape_num_threads(size_t num_indices) const {
+        if (tape_num_threads != kAuto) return std::max(static_cast<size_t>(1), tape_num_threads);
+        return __auto_num_threads(num_indices, kTapeIndicesPerThread);
+    }
+
+    size_t ParserOptions::get_shift_reduce_num_threads(size_t num_indices) const {
+        if (shift_reduce_num_threads != kAuto) return std::max(static_cast<size_t>(1), shift_reduce_num_threads);
+        return __auto_num_threads(num_indices, kShiftReduceIndicesPerThread);
+    }
+
+    size_t ParserOptions::get_parse_str_num_threads(size_t num_indices) const {
+        if (parse_str_num_threads != kAuto) return parse_str_num_threads;
+        return __auto_num_dedicated_threads(num_indices, kParseStrIndicesPerThread);
+    }
+
+    size_t ParserOptions::get_parse_num_num_threads(size_t num_indices) const {
+        if (parse_num_num_threads != kAuto) return parse_num_num_threads;
+        return __auto_num_dedicated_threads(num_indices, kParseNumIndicesPerThread);
+    }
+
+    size_t ParserOptions::get_to_dom_num_threads(size_t tape_size) const {
+        if (to_dom_num_threads != kAuto) return std::max(static_cast<size_t>(1), to_dom_num_threads);
+        return __auto_num_threads(tape_size, kToDomTapeEntriesPerThread);
+    }
+
+    size_t ParserOptions::get_export_num_threads(size_t tape_size) const {
+        if (export_num_threads != kAuto) return std::max(static_cast<size_t>(1), export_num_threads);
+        return __auto_num_threads(tape_size, kExportTapeEntriesPerThread);
+    }
+
+}
@@ -0,0 +1,53 @@
+#ifndef MERCURYJSON_PARSER_OPTIONS_H
+#define MERCURYJSON_PARSER_OPTIONS_H
+
+#include <stddef.h>
+
+#include "flags.h"
+
+
+namespace MercuryJson {
+
+    // Number of threads used by each parsing phase, and other runtime choices. The defaults are taken from
+    // `flags.h`, so the same binary can parse small messages on a single thread and large dumps on the whole thread
+    // pool.
+    struct ParserOptions {
+        // Select the number of threads from the size of the input when parsing.
+        static const size_t kAuto = static_cast<size_t>(-1);
+
+        size_t stage1_num_threads;  // 1 for sequential stage 1
+        size_t tape_num_threads;  // number of segments for state machine-based tape parsing
+        size_t shift_reduce_num_threads;
+        size_t parse_str_num_threads;  // 0 to parse strings inline
+        size_t parse_num_num_threads;  // 0 to parse numbers inline
+        size_t to_dom_num_threads;  // number of threads for building a DOM from a tape
+        size_t export_num_threads;  // number of threads for encoding a tape into other formats
+
+        bool intern_keys;  // store object keys on the tape as ids into a per-document symbol table
+        bool lazy_strings;  // leave strings unparsed on the tape, and unescape them on first access
+        bool string_masks;  // keep the escape and quote masks of stage 1, and reuse them when parsing strings
+        bool raw_big_numbers;  // keep numbers out of the 64-bit integer or double range as source text on the tape
+        bool batch_numbers;  // parse numbers four at a time with AVX2
+        bool pack_numeric_arrays;  // store arrays of numbers as packed int64_t or double arrays on the tape
+        bool huge_pages;  // back large blocks of the DOM allocator with huge pages
+
+        ParserOptions();
+
+        // Options selecting all thread counts automatically.
+        static ParserOptions automatic();
+
+        // Resolved thread counts for an input of `input_len` bytes with `num_indices` structural characters.
+        size_t get_stage1_num_threads(size_t input_len) const;
+        size_t get_tape_num_threads(size_t num_indices) const;
+        size_t get_shift_reduce_num_threads(size_t num_indices) const;
+        size_t get_parse_str_num_threads(size_t num_indices) const;
+        size_t get_parse_num_num_threads(size_t num_indices) const;
+        // Resolved thread count for building a DOM from a tape of `tape_size` entries.
+        size_t get_to_dom_num_threads(size_t tape_size) const;
+        // Resolved thread count for encoding a tape of `tape_size` entries into other formats.
+        size_t get_export_num_threads(size_t tape_size) const;
+    };
+
+}
+
+#endif // MERCURYJSON_PARSER_OPTIONS_H
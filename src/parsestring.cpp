@@ -69,6 +69,67 @@ namespace MercuryJson {
                 h0 >> 32U, h1 >> 32U, h2 >> 32U, h3 >> 32U, h4 >> 32U, h5 >> 32U, h6 >> 32U, h7 >> 32U);
     }
 
+    // Decode the 4 hex digits at `src` and the 4 hex digits at `src + 6` (the second half of a possible surrogate
+    // pair "XXXX\\uXXXX") at once. The valid bit of each group is set in `*valid_mask` (bit 0 for the first group,
+    // bit 1 for the second).
+    static inline __m128i __decode_hex_pair(const char *src, int *valid_mask) {
+        const __m128i gather = _mm_setr_epi8(0, 1, 2, 3, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1, -1, -1);
+        __m128i chars = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src)), gather);
+
+        // '0'-'9' map to 0-9, and 'a'-'f' / 'A'-'F' map to 10-15.
+        __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits);
+        __m128i letters = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+        __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letters, _mm_set1_epi8(5)), letters);
+        __m128i values = _mm_blendv_epi8(_mm_add_epi8(letters, _mm_set1_epi8(10)), digits, is_digit);
+
+        uint32_t valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+        *valid_mask = ((valid & 0x0fU) == 0x0fU) | (((valid & 0xf0U) == 0xf0U) << 1U);
+
+        // Combine nibbles into bytes, then bytes into 16-bit code units.
+        __m128i bytes = _mm_maddubs_epi16(values, _mm_set1_epi16(0x0110));
+        return _mm_madd_epi16(bytes, _mm_set1_epi32(0x00010100));
+    }
+
+    // Decode the escape sequence "\\uXXXX", or a surrogate pair "\\uXXXX\\uXXXX", at `src` and write it to `*dest` as
+    // UTF-8. Returns the number of characters consumed from `src`, and advances `*dest` past the written bytes.
+    // `input` and `offset` are only used for error messages.
+    static inline size_t __parse_unicode_escape(const char *src, char **dest, const char *input, size_t offset) {
+        int valid_mask;
+        __m128i code_units = __decode_hex_pair(src + 2, &valid_mask);
+        if (!(valid_mask & 1)) __error("invalid Unicode escape sequence", input, offset);
+        uint32_t code_point = static_cast<uint32_t>(_mm_cvtsi128_si32(code_units));
+        size_t consumed = 6;
+        if ((code_point & 0xf800U) == 0xd800U) {
+            // Surrogates must come in pairs of a high surrogate followed by a low surrogate.
+            uint32_t low = static_cast<uint32_t>(_mm_extract_epi32(code_units, 1));
+            if (code_point >= 0xdc00U || src[6] != '\\' || src[7] != 'u' || !(valid_mask & 2)
+                || (low & 0xfc00U) != 0xdc00U)
+                __error("invalid Unicode surrogate pair", input, offset);
+            code_point = 0x10000U + ((code_point - 0xd800U) << 10U) + (low - 0xdc00U);
+            consumed = 12;
+        }
+
+        char *ptr = *dest;
+        if (code_point < 0x80U) {
+            *ptr++ = static_cast<char>(code_point);
+        } else if (code_point < 0x800U) {
+            *ptr++ = static_cast<char>(0xc0U | (code_point >> 6U));
+            *ptr++ = static_cast<char>(0x80U | (code_point & 0x3fU));
+        } else if (code_point < 0x10000U) {
+            *ptr++ = static_cast<char>(0xe0U | (code_point >> 12U));
+            *ptr++ = static_cast<char>(0x80U | ((code_point >> 6U) & 0x3fU));
+            *ptr++ = static_cast<char>(0x80U | (code_point & 0x3fU));
+        } else {
+            *ptr++ = static_cast<char>(0xf0U | (code_point >> 18U));
+            *ptr++ = static_cast<char>(0x80U | ((code_point >> 12U) & 0x3fU));
+            *ptr++ = static_cast<char>(0x80U | ((code_point >> 6U) & 0x3fU));
+            *ptr++ = static_cast<char>(0x80U | (code_point & 0x3fU));
+        }
+        *dest = ptr;
+        return consumed;
+    }
+
     // 1. '/'   0x2f 0x2f
     // 2. '""'  0x22 0x22
     // 4. '\'   0x5c 0x5c
@@ -77,7 +138,7 @@ namespace MercuryJson {
     // 32.'n'   0x6e 0x0a
     // 64.'r'   0x72 0x0d
     //128.'t'   0x74 0x09
-    // TODO: Unicode literals and non-escapable character validation
+    // TODO: non-escapable character validation. Unicode escapes are handled by `__parse_unicode_escape` instead.
     __m256i translate_escape_characters(__m256i input) {
         const __m256i hi_lookup = _mm256_setr_epi8(0, 0, 0x03, 0, 0, 0x04, 0x38, 0xc0, 0, 0, 0, 0, 0, 0, 0, 0,
                                                    0, 0, 0x03, 0, 0, 0x04, 0x38, 0xc0, 0, 0, 0, 0, 0, 0, 0, 0);
@@ -104,25 +165,27 @@ namespace MercuryJson {
         char *base = dest;
         while (true) {
             __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
-            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest), input);
             __mmask32 backslash_mask = __cmpeq_mask(input, '\\');
             __mmask32 quote_mask = __cmpeq_mask(input, '"');
 
             if (((backslash_mask - 1) & quote_mask) != 0) {
                 // quotes first
                 size_t quote_offset = _tzcnt_u32(quote_mask);
+                memmove(dest, src, quote_offset);
                 dest[quote_offset] = 0;
                 if (len != nullptr) *len = (dest - base) + quote_offset;
                 break;
             } else if (((quote_mask - 1) & backslash_mask) != 0) {
                 // backslash first
                 size_t backslash_offset = _tzcnt_u32(backslash_mask);
+                // When parsing in-place, `dest` lags behind `src`, and a full-width store would overwrite characters
+                // that are yet to be read, or belong to other strings parsed concurrently.
+                memmove(dest, src, backslash_offset);
                 uint8_t escape_char = src[backslash_offset + 1];
                 if (escape_char == 'u') {
-                    // TODO: deal with unicode characters
-                    memcpy(dest + backslash_offset, src + backslash_offset, 6);
-                    src += backslash_offset + 6;
-                    dest += backslash_offset + 6;
+                    dest += backslash_offset;
+                    src += backslash_offset + __parse_unicode_escape(
+                            src + backslash_offset, &dest, _src, src + backslash_offset - _src);
                 } else {
                     uint8_t escaped = kEscapeMap[escape_char];
                     if (escaped == 0U)
@@ -133,8 +196,9 @@ namespace MercuryJson {
                 }
             } else {
                 // nothing here
-                src += sizeof(__mmask32);
-                dest += sizeof(__mmask32);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest), input);
+                src += sizeof(__m256i);
+                dest += sizeof(__m256i);
             }
         }
     }
@@ -180,6 +244,14 @@ namespace MercuryJson {
                     char escaper = src[this_offset];
                     memmove(dest, src + last_offset, length);
                     dest += length;
+                    if (escaper == 'u') {
+                        // The escape sequence may run past this block, so continue from a new block after it.
+                        --dest;
+                        src += this_offset - 1 + __parse_unicode_escape(
+                                src + this_offset - 1, &dest, _src, src + this_offset - 1 - _src);
+                        prev_odd_backslash_ending_mask = 0;
+                        goto next_block;
+                    }
                     *(dest - 1) = kEscapeMap[escaper];
                     last_offset = this_offset + 1;
                     escape_mask = blsr(escape_mask);
@@ -187,22 +259,26 @@ namespace MercuryJson {
                 break;
             } else {
 #if PARSE_STR_FULLY_AVX
-                /* fully-AVX version */
-                __m256i lo_mask = convert_to_mask(escape_mask);
-                __m256i hi_mask = convert_to_mask(escape_mask >> 32U);
-                // mask ? translated : original
-                __m256i lo_trans = translate_escape_characters(input.lo);
-                __m256i hi_trans = translate_escape_characters(input.hi);
-                input.lo = _mm256_blendv_epi8(lo_trans, input.lo, lo_mask);
-                input.hi = _mm256_blendv_epi8(hi_trans, input.hi, hi_mask);
-                uint64_t escaper_mask = (escape_mask >> 1U) | (prev_odd_backslash_ending_mask << 63U);
+                if ((escape_mask & __cmpeq_mask(input, 'u')) == 0) {
+                    /* fully-AVX version */
+                    __m256i lo_mask = convert_to_mask(escape_mask);
+                    __m256i hi_mask = convert_to_mask(escape_mask >> 32U);
+                    // mask ? translated : original
+                    __m256i lo_trans = translate_escape_characters(input.lo);
+                    __m256i hi_trans = translate_escape_characters(input.hi);
+                    input.lo = _mm256_blendv_epi8(lo_trans, input.lo, lo_mask);
+                    input.hi = _mm256_blendv_epi8(hi_trans, input.hi, hi_mask);
+                    uint64_t escaper_mask = (escape_mask >> 1U) | (prev_odd_backslash_ending_mask << 63U);
 
-                deescape(input, escaper_mask);
-                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest), input.lo);
-                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + 32), input.hi);
-                dest += 64 - _mm_popcnt_u64(escaper_mask);
-                src += 64;
-#else
+                    deescape(input, escaper_mask);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest), input.lo);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + 32), input.hi);
+                    dest += 64 - _mm_popcnt_u64(escaper_mask);
+                    src += 64;
+                    continue;
+                }
+                // Unicode escapes are decoded by the scalar version.
+#endif
                 size_t last_offset = 0, length;
                 while (true) {
                     size_t this_offset = tzcnt(escape_mask);
@@ -211,18 +287,66 @@ namespace MercuryJson {
                     memmove(dest, src + last_offset, length);
                     dest += length;
                     if (this_offset >= ending_offset) break;
+                    if (escaper == 'u') {
+                        --dest;
+                        src += this_offset - 1 + __parse_unicode_escape(
+                                src + this_offset - 1, &dest, _src, src + this_offset - 1 - _src);
+                        prev_odd_backslash_ending_mask = 0;
+                        goto next_block;
+                    }
                     *(dest - 1) = kEscapeMap[escaper];
                     last_offset = this_offset + 1;
                     escape_mask = blsr(escape_mask);
                 }
                 src += sizeof(mask_t) * 8;
-#endif
             }
+            next_block:;
         }
 #undef tzcnt
 #undef blsr
     }
 
+    void parse_str_masked(const char *src, char *dest, size_t *len, size_t offset, const uint64_t *string_masks) {
+        if (dest == nullptr) dest = const_cast<char *>(src + offset);
+        char *base = dest;
+        size_t pos = offset;  // start of the characters yet to be copied
+        size_t block = offset / 64;
+        uint64_t skip_mask = ~0ULL << (offset % 64U);
+        while (true) {
+            uint64_t escape_mask = string_masks[2 * block] & skip_mask;
+            uint64_t quote_mask = string_masks[2 * block + 1] & skip_mask;
+            skip_mask = ~0ULL;
+            // Blocks without escapes or quotes are copied together with the next run of characters.
+            if ((escape_mask | quote_mask) == 0) {
+                ++block;
+                continue;
+            }
+            if (quote_mask != 0) escape_mask &= _blsmsk_u64(quote_mask);
+            for (; escape_mask; escape_mask = _blsr_u64(escape_mask)) {
+                size_t escaped = block * 64 + _tzcnt_u64(escape_mask);
+                if (escaped < pos) continue;  // second half of a surrogate pair, already decoded
+                memmove(dest, src + pos, escaped - 1 - pos);
+                dest += escaped - 1 - pos;
+                char escaper = src[escaped];
+                if (escaper == 'u') {
+                    pos = escaped - 1 + __parse_unicode_escape(src + escaped - 1, &dest, src, escaped - 1);
+                } else {
+                    *dest++ = kEscapeMap[static_cast<uint8_t>(escaper)];
+                    pos = escaped + 1;
+                }
+            }
+            if (quote_mask != 0) {
+                size_t ending = block * 64 + _tzcnt_u64(quote_mask);
+                memmove(dest, src + pos, ending - pos);
+                dest += ending - pos;
+                *dest = '\0';
+                if (len != nullptr) *len = dest - base;
+                return;
+            }
+            ++block;
+        }
+    }
+
     void parse_str_naive(const char *src, char *dest, size_t *len, size_t offset) {
         bool escape = false;
         char *ptr = dest == nullptr ? const_cast<char *>(src) : dest, *base = ptr;
@@ -254,9 +378,7 @@ namespace MercuryJson {
                         *ptr++ = '\t';
                         break;
                     case 'u':
-                        // TODO: Should deal with unicode encoding
-                        *ptr++ = '\\';
-                        *ptr++ = 'u';
+                        end += __parse_unicode_escape(end - 1, &ptr, src, end - 1 - src) - 2;
                         break;
                     default:
                         __error("invalid escape sequence", src, end - src);
@@ -267,7 +389,7 @@ namespace MercuryJson {
                 else *ptr++ = *end;
             }
         }
-        *ptr++ = 0;
+        *ptr = 0;
         if (len != nullptr) *len = ptr - base;
     }
 
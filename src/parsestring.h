@@ -12,6 +12,9 @@ namespace MercuryJson {
     void parse_str_naive(const char *src, char *dest = nullptr, size_t *len = nullptr, size_t offset = 0U);
     void parse_str_avx(const char *src, char *dest = nullptr, size_t *len = nullptr, size_t offset = 0U);
     void parse_str_none(const char *src, char *dest = nullptr, size_t *len = nullptr, size_t offset = 0U);
+    // Same as `parse_str_avx`, but reads the escape and quote masks of each block from `string_masks`, as retained by
+    // stage 1 (`JSON::string_masks`), instead of computing them again. `src` must be the input of stage 1.
+    void parse_str_masked(const char *src, char *dest, size_t *len, size_t offset, const uint64_t *string_masks);
 
     #if PARSE_STR_MODE == 0
         #define parse_str parse_str_naive
@@ -23,8 +26,46 @@ namespace MercuryJson {
         #define parse_str parse_str_none
     #endif
 
+    // Parse with `parse_str_masked` if the masks of stage 1 are available, and with `parse_str` otherwise.
+    inline void parse_str_auto(const char *src, char *dest, size_t *len, size_t offset,
+                               const uint64_t *string_masks) {
+#if PARSE_STR_MODE >= 0
+        if (string_masks != nullptr) {
+            parse_str_masked(src, dest, len, offset, string_masks);
+            return;
+        }
+#endif
+        parse_str(src, dest, len, offset);
+    }
+
     __m256i translate_escape_characters(__m256i input);
     void deescape(Warp &input, uint64_t escaper_mask);
+
+    template <bool kParseStrInline>
+    inline char *JSON::_parse_str(size_t idx) {
+#if ALLOC_PARSED_STR
+        char *dest = literals + idx + 1;
+#else
+        char *dest = input + idx + 1;
+#endif
+
+        if constexpr (kParseStrInline) {
+#if PARSE_STR_MODE >= 0
+            if (string_masks != nullptr) {
+                parse_str_masked(input, dest, nullptr, idx + 1, string_masks);
+                return dest;
+            }
+#endif
+#if PARSE_STR_MODE == 2
+            parse_str_per_bit(input, dest, nullptr, idx + 1);
+#elif PARSE_STR_MODE == 1
+            parse_str_avx(input, dest, nullptr, idx + 1);
+#elif PARSE_STR_MODE == 0
+            parse_str_naive(input, dest, nullptr, idx + 1);
+#endif
+        }
+        return dest;
+    }
 }
 
 #endif
@@ -1,5 +1,9 @@
 #include "mercuryparser.h"
 
+#include <memory>
+
+#include "parsestring.h"
+
 
 namespace MercuryJson {
 #define next_char() ({                                                            \
@@ -21,77 +25,76 @@ namespace MercuryJson {
         _error(__expected, ch, idx); \
     })
 
-    JsonValue *JSON::_parse_object() {
+    template <bool kParseStrInline>
+    JsonObject *JSON::_parse_object() {
         size_t idx;
         char ch;
         peek_char();
         if (ch == '}') {
             next_char();
-            return allocator.construct(static_cast<JsonObject *>(nullptr));
+            return JsonObject::allocate(allocator, 0);
         }
 
-        expect('"');
-        char *str = _parse_str(idx);
-        next_char();
-        next_char();
-        expect(':');
-        JsonValue *value = _parse_value();
-        auto *object = allocator.construct<JsonObject>(str, value), *ptr = object;
+        size_t stack_begin = member_stack.size();
         while (true) {
-            next_char();
-            if (ch == '}') break;
-            expect(',');
             peek_char();
             expect('"');
-            str = _parse_str(idx);
+            char *str = _parse_str<kParseStrInline>(idx);
             next_char();
             next_char();
             expect(':');
-            value = _parse_value();
-            ptr = ptr->next = allocator.construct<JsonObject>(str, value);
+            JsonValue value = _parse_value<kParseStrInline>();
+            member_stack.emplace_back(str, value);
+            next_char();
+            if (ch == '}') break;
+            expect(',');
         }
-        return allocator.construct(object);
+        // Nested objects have been moved off the stack, so the members above `stack_begin` are those of this object.
+        auto *object = JsonObject::allocate(allocator, member_stack.size() - stack_begin);
+        std::uninitialized_copy(member_stack.begin() + stack_begin, member_stack.end(), object->begin());
+        member_stack.erase(member_stack.begin() + stack_begin, member_stack.end());
+        return object;
     }
 
-    JsonValue *JSON::_parse_array() {
+    template <bool kParseStrInline>
+    JsonArray *JSON::_parse_array() {
         size_t idx;
         char ch;
         peek_char();
         if (ch == ']') {
             next_char();
-            return allocator.construct(static_cast<JsonArray *>(nullptr));
+            return JsonArray::allocate(allocator, 0);
         }
-        JsonValue *value = _parse_value();
-        auto *array = allocator.construct<JsonArray>(value), *ptr = array;
+
+        size_t stack_begin = value_stack.size();
         while (true) {
+            JsonValue value = _parse_value<kParseStrInline>();
+            value_stack.push_back(value);
             next_char();
             if (ch == ']') break;
             expect(',');
-            value = _parse_value();
-            ptr = ptr->next = allocator.construct<JsonArray>(value);
         }
-        return allocator.construct(array);
+        auto *array = JsonArray::allocate(allocator, value_stack.size() - stack_begin);
+        std::uninitialized_copy(value_stack.begin() + stack_begin, value_stack.end(), array->begin());
+        value_stack.erase(value_stack.begin() + stack_begin, value_stack.end());
+        return array;
     }
 
-    JsonValue *JSON::_parse_value() {
+    template <bool kParseStrInline>
+    JsonValue JSON::_parse_value() {
         size_t idx;
         char ch;
         next_char();
-        JsonValue *value;
         switch (ch) {
             case '"':
-                value = allocator.construct(_parse_str(idx));
-                break;
+                return JsonValue(_parse_str<kParseStrInline>(idx));
             case 't':
-                value = allocator.construct(parse_true(input, idx));
-                break;
+                return JsonValue(parse_true(input, idx));
             case 'f':
-                value = allocator.construct(parse_false(input, idx));
-                break;
+                return JsonValue(parse_false(input, idx));
             case 'n':
                 parse_null(input, idx);
-                value = allocator.construct();
-                break;
+                return JsonValue();
             case '0':
             case '1':
             case '2':
@@ -105,24 +108,23 @@ namespace MercuryJson {
             case '-': {
                 bool is_decimal;
                 long long int ret = parse_number(input, &is_decimal, idx);
-                if (is_decimal) value = allocator.construct(plain_convert(ret));
-                else value = allocator.construct(ret);
-                break;
+                if (is_decimal) return JsonValue(plain_convert(ret));
+                return JsonValue(ret);
             }
             case '[':
-                value = _parse_array();
-                break;
+                return JsonValue(_parse_array<kParseStrInline>());
             case '{':
-                value = _parse_object();
-                break;
+                return JsonValue(_parse_object<kParseStrInline>());
             default:
                 error("JSON value");
         }
-        return value;
     }
 
 #undef next_char
 #undef peek_char
 #undef expect
 #undef error
+
+    template JsonValue JSON::_parse_value<true>();
+    template JsonValue JSON::_parse_value<false>();
 }
@@ -2,47 +2,75 @@
 
 #include <assert.h>
 
-#include <thread>
 #include <vector>
 
 #include "block_allocator.hpp"
 #include "flags.h"
+#include "parsestring.h"
+#include "thread_pool.h"
 
 
 namespace MercuryJson::shift_reduce_impl {
-    struct JsonPartialValue;
-
+    // Partial objects and arrays are linked lists of complete values. The head of each list also keeps its final node
+    // and its length, so that values are appended, lists from different threads are merged, and the contiguous
+    // container is allocated, without walking the list.
     struct JsonPartialObject {
         const char *key;
-        JsonPartialValue *value;
+        JsonValue value;
         JsonPartialObject *next;
 
-        JsonPartialObject(const char *key, JsonPartialValue *value, JsonPartialObject *next = nullptr)
+        JsonPartialObject(const char *key, const JsonValue &value, JsonPartialObject *next = nullptr)
                 : key(key), value(value), next(next) {}
     };
 
     struct JsonPartialObjectHead : JsonPartialObject {
         JsonPartialObject *final;
+        size_t size;
+
+        JsonPartialObjectHead(const char *key, const JsonValue &value, JsonPartialObject *next = nullptr)
+                : JsonPartialObject(key, value, next), final(this), size(1) {}
+
+        inline void append(JsonPartialObject *elem) {
+            final = final->next = elem;
+            ++size;
+        }
 
-        JsonPartialObjectHead(const char *key, JsonPartialValue *value, JsonPartialObject *next = nullptr)
-                : JsonPartialObject(key, value, next), final(this) {}
+        inline void append(JsonPartialObjectHead *other) {
+            final->next = other;
+            final = other->final;
+            size += other->size;
+        }
     };
 
     struct JsonPartialArray {
-        JsonPartialValue *value;
+        JsonValue value;
         JsonPartialArray *next;
 
-        explicit JsonPartialArray(JsonPartialValue *value, JsonPartialArray *next = nullptr)
+        explicit JsonPartialArray(const JsonValue &value, JsonPartialArray *next = nullptr)
                 : value(value), next(next) {}
     };
 
     struct JsonPartialArrayHead : JsonPartialArray {
         JsonPartialArray *final;
+        size_t size;
+
+        explicit JsonPartialArrayHead(const JsonValue &value, JsonPartialArray *next = nullptr)
+                : JsonPartialArray(value, next), final(this), size(1) {}
+
+        inline void append(JsonPartialArray *elem) {
+            final = final->next = elem;
+            ++size;
+        }
 
-        JsonPartialArrayHead(JsonPartialValue *value, JsonPartialArray *next = nullptr)
-                : JsonPartialArray(value, next), final(this) {}
+        inline void append(JsonPartialArrayHead *other) {
+            final->next = other;
+            final = other->final;
+            size += other->size;
+        }
     };
 
+    // Entry of the parse stack. Scalars and punctuation are stored in the entry itself, so that only containers and
+    // the nodes of partial containers are allocated.
     struct JsonPartialValue {
         enum ValueType : int {
             TYPE_NULL, TYPE_BOOL, TYPE_STR, TYPE_OBJ, TYPE_ARR, TYPE_INT, TYPE_DEC,
@@ -54,8 +82,8 @@ namespace MercuryJson::shift_reduce_impl {
             const char *str;
             JsonObject *object;
             JsonArray *array;
-            JsonPartialObject *partial_object;
-            JsonPartialArray *partial_array;
+            JsonPartialObjectHead *partial_object;
+            JsonPartialArrayHead *partial_array;
             long long int integer;
             double decimal;
             char structural;
@@ -70,22 +98,40 @@ namespace MercuryJson::shift_reduce_impl {
             explicit JsonPartialValue(long long int value) : type(TYPE_INT), integer(value) {}
             explicit JsonPartialValue(double value) : type(TYPE_DEC), decimal(value) {}
 
-            explicit JsonPartialValue(JsonPartialObject *value) : type(TYPE_PARTIAL_OBJ), partial_object(value) {}
-            explicit JsonPartialValue(JsonPartialArray *value) : type(TYPE_PARTIAL_ARR), partial_array(value) {}
+            explicit JsonPartialValue(JsonPartialObjectHead *value) : type(TYPE_PARTIAL_OBJ), partial_object(value) {}
+            explicit JsonPartialValue(JsonPartialArrayHead *value) : type(TYPE_PARTIAL_ARR), partial_array(value) {}
             explicit JsonPartialValue(char value) : type(TYPE_CHAR), structural(value) {}
             //@formatter:on
+
+        // The complete value, which shares the layout of `JsonValue` for types up to `TYPE_DEC`.
+        inline JsonValue &value() { return *reinterpret_cast<JsonValue *>(this); }
     };
 
-    void print_json(JsonPartialValue *value, size_t indent = 0) {
-        switch (value->type) {
+    void print_json(JsonPartialValue &value, size_t indent = 0) {
+        switch (value.type) {
             case JsonPartialValue::TYPE_PARTIAL_OBJ:
-            case JsonPartialValue::TYPE_PARTIAL_ARR: {
                 print_indent(indent);
-                std::cout << "(partial) ";
-                JsonValue new_value = *reinterpret_cast<JsonValue *>(value);
-                new_value.type = static_cast<JsonValue::ValueType>(static_cast<int>(value->type) - 4);
-                print_json(&new_value, indent);
-            }
+                std::cout << "(partial) {" << std::endl;
+                for (JsonPartialObject *elem = value.partial_object; elem != nullptr; elem = elem->next) {
+                    print_indent(indent + 2);
+                    std::cout << "\"" << elem->key << "\": ";
+                    print_json(&elem->value, indent + 2);
+                    std::cout << std::endl;
+                }
+                print_indent(indent);
+                std::cout << "}";
+                break;
+            case JsonPartialValue::TYPE_PARTIAL_ARR:
+                print_indent(indent);
+                std::cout << "(partial) [" << std::endl;
+                for (JsonPartialArray *elem = value.partial_array; elem != nullptr; elem = elem->next) {
+                    print_indent(indent + 2);
+                    print_json(&elem->value, indent + 2);
+                    std::cout << std::endl;
+                }
+                print_indent(indent);
+                std::cout << "]";
+                break;
             case JsonPartialValue::TYPE_NULL:
             case JsonPartialValue::TYPE_BOOL:
             case JsonPartialValue::TYPE_STR:
@@ -93,11 +139,11 @@ namespace MercuryJson::shift_reduce_impl {
             case JsonPartialValue::TYPE_ARR:
             case JsonPartialValue::TYPE_INT:
             case JsonPartialValue::TYPE_DEC:
-                print_json(reinterpret_cast<JsonValue *>(value), indent);
+                print_json(&value.value(), indent);
                 break;
             case JsonPartialValue::TYPE_CHAR:
                 print_indent(indent);
-                std::cout << "'" << value->structural << "'";
+                std::cout << "'" << value.structural << "'";
                 break;
         }
         std::cout << std::endl;
@@ -106,14 +152,14 @@ namespace MercuryJson::shift_reduce_impl {
     static const size_t kDefaultStackSize = 1024;
 
     class ParseStack {
-        JsonPartialValue **stack;
+        JsonPartialValue *stack;
         size_t stack_top;
         BlockAllocator<JsonValue> &allocator;
 
     public:
         ParseStack(BlockAllocator<JsonValue> &allocator, size_t max_size = kDefaultStackSize)
                 : allocator(allocator) {
-            stack = aligned_malloc<JsonPartialValue *>(max_size);
+            stack = aligned_malloc<JsonPartialValue>(max_size);
             stack_top = 0;
         }
 
@@ -129,7 +175,7 @@ namespace MercuryJson::shift_reduce_impl {
 
         inline size_t size() const { return stack_top; }
 
-        inline JsonPartialValue *operator [](size_t idx) const { return stack[idx]; }
+        inline JsonPartialValue &operator [](size_t idx) const { return stack[idx]; }
 
         template <typename ...Args>
         inline bool _check_stack_top(Args ...) const;
@@ -152,27 +198,26 @@ namespace MercuryJson::shift_reduce_impl {
         inline bool check_pos(size_t pos, char ch) const {
             // pos starts from 1, counts from stack top.
             if (stack_top < pos) return false;
-            auto *top = stack[stack_top - pos];
-            return top->type == JsonPartialValue::TYPE_CHAR && top->structural == ch;
+            const JsonPartialValue &top = stack[stack_top - pos];
+            return top.type == JsonPartialValue::TYPE_CHAR && top.structural == ch;
         }
 
         inline bool check_pos(size_t pos, JsonPartialValue::ValueType type) const {
             // pos starts from 1, counts from stack top.
             if (stack_top < pos) return false;
-            auto *top = stack[stack_top - pos];
-            return top->type == type;
+            return stack[stack_top - pos].type == type;
         }
 
-        inline JsonPartialValue *get(size_t pos) const {
+        inline JsonPartialValue &get(size_t pos) const {
             return stack[stack_top - pos];
         }
 
         template <typename ...Args>
         inline void push(Args ...args) {
-            stack[stack_top++] = allocator.construct<JsonPartialValue>(std::forward<Args>(args)...);
+            new(&stack[stack_top++]) JsonPartialValue(std::forward<Args>(args)...);
         }
 
-        inline void push(JsonPartialValue *value) {
+        inline void push(const JsonPartialValue &value) {
             stack[stack_top++] = value;
         }
 
@@ -188,15 +233,33 @@ namespace MercuryJson::shift_reduce_impl {
             }
         }
 
+        // Copy the members of a complete partial object into a contiguous object.
+        inline JsonObject *_make_object(JsonPartialObjectHead *partial_obj) {
+            auto *obj = JsonObject::allocate(allocator, partial_obj->size);
+            JsonMember *member = obj->begin();
+            for (JsonPartialObject *elem = partial_obj; elem != nullptr; elem = elem->next)
+                new(member++) JsonMember(elem->key, elem->value);
+            return obj;
+        }
+
+        // Copy the elements of a complete partial array into a contiguous array.
+        inline JsonArray *_make_array(JsonPartialArrayHead *partial_arr) {
+            auto *arr = JsonArray::allocate(allocator, partial_arr->size);
+            JsonValue *value = arr->begin();
+            for (JsonPartialArray *elem = partial_arr; elem != nullptr; elem = elem->next)
+                new(value++) JsonValue(elem->value);
+            return arr;
+        }
+
         // "{", partial-object, "}"  =>  object
         inline void reduce_object() {
             if (check('{')) {
                 // Emtpy object.
                 pop(1);
-                push(static_cast<JsonObject *>(nullptr));
+                push(JsonObject::allocate(allocator, 0));
             } else if (check('{', JsonPartialValue::TYPE_PARTIAL_OBJ)) {
                 // Non-empty object.
-                auto *obj = reinterpret_cast<JsonObject *>(get(1)->partial_object);
+                auto *obj = _make_object(get(1).partial_object);
                 pop(2);
                 push(obj);
             } else {
@@ -210,19 +273,19 @@ namespace MercuryJson::shift_reduce_impl {
             if (check('[')) {
                 // Emtpy array.
                 pop(1);
-                push(static_cast<JsonArray *>(nullptr));
+                push(JsonArray::allocate(allocator, 0));
             } else if (check('[', true)) {
                 // Construct singleton array.
-                auto *arr = allocator.construct<JsonArray>(reinterpret_cast<JsonValue *>(get(1)));
+                auto *arr = JsonArray::allocate(allocator, 1);
+                new(arr->begin()) JsonValue(get(1).value());
                 pop(2);
                 push(arr);
             } else if (check('[', JsonPartialValue::TYPE_PARTIAL_ARR, ',', true)) {
                 // We have to manually match the final element in the array, because we only reduce to partial
                 // array on commas (,).
-                auto *partial_arr = static_cast<JsonPartialArrayHead *>(get(3)->partial_array);
-                partial_arr->final->next = reinterpret_cast<JsonPartialArray *>(
-                        allocator.construct<JsonArray>(reinterpret_cast<JsonValue *>(get(1))));
-                auto *arr = reinterpret_cast<JsonArray *>(partial_arr);
+                JsonPartialArrayHead *partial_arr = get(3).partial_array;
+                partial_arr->append(allocator.construct<JsonPartialArray>(get(1).value()));
+                auto *arr = _make_array(partial_arr);
                 pop(4);
                 push(arr);
             } else {
@@ -236,22 +299,17 @@ namespace MercuryJson::shift_reduce_impl {
             if (check('[', true)) {
                 // Construct a singleton partial array. Note that previous value must be of complete type,
                 // otherwise we might aggressively match partial objects.
-                auto *elem = get(1);
-                auto *partial_arr = allocator.construct<JsonPartialArrayHead>(elem);
+                auto *partial_arr = allocator.construct<JsonPartialArrayHead>(get(1).value());
                 pop(1);
                 push(partial_arr);
                 push(',');
             } else if (check(',', true)) {
                 // Merge with previous partial array.
-                auto *elem = get(1);
-                JsonPartialArray *partial_arr;
                 if (check_pos(3, JsonPartialValue::TYPE_PARTIAL_ARR)) {
-                    partial_arr = allocator.construct<JsonPartialArray>(elem);
-                    auto *prev_arr = static_cast<JsonPartialArrayHead *>(get(3)->partial_array);
-                    prev_arr->final = prev_arr->final->next = partial_arr;
+                    get(3).partial_array->append(allocator.construct<JsonPartialArray>(get(1).value()));
                     pop(1);  // No need to push ',' --- just re-use the previous one.
                 } else {
-                    partial_arr = allocator.construct<JsonPartialArrayHead>(elem);
+                    auto *partial_arr = allocator.construct<JsonPartialArrayHead>(get(1).value());
                     pop(1);
                     push(partial_arr);
                     push(',');
@@ -265,21 +323,16 @@ namespace MercuryJson::shift_reduce_impl {
         inline bool reduce_partial_object() {
             if (check(JsonPartialValue::TYPE_STR, ':', true)) {
                 // Construct singleton partial object.
-                auto *key = get(3)->str;
-                auto *value = get(1);
-                JsonPartialObject *partial_obj;
+                const char *key = get(3).str;
+                JsonValue value = get(1).value();
                 pop(3);
                 if (check(JsonPartialValue::TYPE_PARTIAL_OBJ, ',')) {
                     // Merge with previous partial object.
-                    partial_obj = allocator.construct<JsonPartialObject>(key, value);
-                    auto *prev_obj = static_cast<JsonPartialObjectHead *>(get(2)->partial_object);
-                    prev_obj->final = prev_obj->final->next = partial_obj;
-                    partial_obj = prev_obj;
-                    pop(2);
+                    get(2).partial_object->append(allocator.construct<JsonPartialObject>(key, value));
+                    pop(1);
                 } else {
-                    partial_obj = allocator.construct<JsonPartialObjectHead>(key, value);
+                    push(allocator.construct<JsonPartialObjectHead>(key, value));
                 }
-                push(partial_obj);
                 return true;
             }
             return false;
@@ -293,8 +346,7 @@ namespace MercuryJson::shift_reduce_impl {
     template <typename ...Args>
     inline bool ParseStack::_check_stack_top(bool first, Args ...args) const {
 //            assert(first);
-        auto *top = stack[stack_top - sizeof...(args) - 1];
-        switch (top->type) {
+        switch (stack[stack_top - sizeof...(args) - 1].type) {
             case JsonPartialValue::TYPE_PARTIAL_OBJ:
             case JsonPartialValue::TYPE_PARTIAL_ARR:
             case JsonPartialValue::TYPE_CHAR:
@@ -307,15 +359,14 @@ namespace MercuryJson::shift_reduce_impl {
 
     template <typename ...Args>
     inline bool ParseStack::_check_stack_top(char first, Args ...args) const {
-        auto *top = stack[stack_top - sizeof...(args) - 1];
-        if (top->type != JsonPartialValue::TYPE_CHAR || top->structural != first) return false;
+        const JsonPartialValue &top = stack[stack_top - sizeof...(args) - 1];
+        if (top.type != JsonPartialValue::TYPE_CHAR || top.structural != first) return false;
         return _check_stack_top(args...);
     }
 
     template <typename ...Args>
     inline bool ParseStack::_check_stack_top(JsonPartialValue::ValueType first, Args ...args) const {
-        auto *top = stack[stack_top - sizeof...(args) - 1];
-        if (top->type != first) return false;
+        if (stack[stack_top - sizeof...(args) - 1].type != first) return false;
         return _check_stack_top(args...);
     }
 
@@ -327,6 +378,7 @@ namespace MercuryJson {
         _error(__expected, ch, idx); \
     })
 
+    template <bool kParseStrInline>
     void JSON::_thread_shift_reduce_parsing(const size_t *idx_begin, const size_t *idx_end,
                                             shift_reduce_impl::ParseStack *stack) {
         using shift_reduce_impl::JsonPartialValue;
@@ -343,7 +395,7 @@ namespace MercuryJson {
             // Shift current value onto stack.
             switch (ch) {
                 case '"':
-                    stack->push(_parse_str(idx));
+                    stack->push(_parse_str<kParseStrInline>(idx));
                     break;
                 case 't':
                     stack->push(parse_true(input, idx));
@@ -412,43 +464,53 @@ namespace MercuryJson {
 //        printf("shift-reduce thread: %.6lf, stack size: %lu\n", runtime.count(), stack->size());
     }
 
+    template <bool kParseStrInline>
     JsonValue *JSON::_shift_reduce_parsing() {
         using shift_reduce_impl::JsonPartialValue;
-        using shift_reduce_impl::JsonPartialObjectHead;
-        using shift_reduce_impl::JsonPartialArrayHead;
         using shift_reduce_impl::ParseStack;
 
-#if SHIFT_REDUCE_NUM_THREADS > 1
-        std::thread shift_reduce_threads[SHIFT_REDUCE_NUM_THREADS - 1];
+        size_t num_threads = options.get_shift_reduce_num_threads(num_indices);
+        if (num_threads <= 1) {
+            ParseStack main_stack(allocator);
+            _thread_shift_reduce_parsing<kParseStrInline>(indices, indices + num_indices - 1, &main_stack);
+            assert(main_stack.size() == 1);
+            idx_ptr += num_indices - 1;  // Consume the indices to satisfy null ending check.
+            return allocator.construct(main_stack[0].value());
+        }
+
         std::vector<BlockAllocator<JsonValue>> allocators;
-        allocators.reserve(SHIFT_REDUCE_NUM_THREADS - 1);
+        allocators.reserve(num_threads - 1);
         std::vector<ParseStack> stacks;
-        stacks.reserve(SHIFT_REDUCE_NUM_THREADS);
+        stacks.reserve(num_threads);
         stacks.emplace_back(allocator);
-        size_t num_indices_per_thread = (num_indices - 1 + SHIFT_REDUCE_NUM_THREADS) / SHIFT_REDUCE_NUM_THREADS;
-        for (int i = 0; i < SHIFT_REDUCE_NUM_THREADS - 1; ++i)
+        size_t num_indices_per_thread = (num_indices - 1 + num_threads) / num_threads;
+        for (size_t i = 0; i < num_threads - 1; ++i)
             allocators.push_back(allocator.fork(2 * num_indices_per_thread * sizeof(JsonPartialValue)));
-        for (int i = 0; i < SHIFT_REDUCE_NUM_THREADS - 1; ++i)
+        for (size_t i = 0; i < num_threads - 1; ++i)
             stacks.emplace_back(allocators[i]);
-        for (int i = 0; i < SHIFT_REDUCE_NUM_THREADS - 1; ++i) {
-            size_t idx_begin = (num_indices - 1) * (i + 1) / SHIFT_REDUCE_NUM_THREADS;
-            size_t idx_end = (num_indices - 1) * (i + 2) / SHIFT_REDUCE_NUM_THREADS;
-            shift_reduce_threads[i] = std::thread(&JSON::_thread_shift_reduce_parsing, this,
-                                                  indices + idx_begin, indices + idx_end, &stacks[i + 1]);
+        Latch shift_reduce_latch;
+        for (size_t i = 0; i < num_threads - 1; ++i) {
+            size_t idx_begin = (num_indices - 1) * (i + 1) / num_threads;
+            size_t idx_end = (num_indices - 1) * (i + 2) / num_threads;
+            ParseStack *stack = &stacks[i + 1];
+            ThreadPool::global().submit(shift_reduce_latch, [this, idx_begin, idx_end, stack] {
+                _thread_shift_reduce_parsing<kParseStrInline>(indices + idx_begin, indices + idx_end, stack);
+            });
         }
-        size_t idx_end = (num_indices - 1) / SHIFT_REDUCE_NUM_THREADS;
-        _thread_shift_reduce_parsing(indices, indices + idx_end, &stacks[0]);
+        size_t idx_end = (num_indices - 1) / num_threads;
+        _thread_shift_reduce_parsing<kParseStrInline>(indices, indices + idx_end, &stacks[0]);
+        shift_reduce_latch.wait();
+        for (auto &thread_allocator : allocators) thread_allocator.join();
 
-        // Join threads and merge.
+        // Merge stacks.
         ParseStack &main_stack = stacks[0];
 //        main_stack.print();
-        for (int i = 0; i < SHIFT_REDUCE_NUM_THREADS - 1; ++i) {
-            shift_reduce_threads[i].join();
+        for (size_t i = 0; i < num_threads - 1; ++i) {
             ParseStack &merge_stack = stacks[i + 1];
 //            merge_stack.print();
             for (size_t idx = 0; idx < merge_stack.size(); ++idx) {
-                auto *value = merge_stack[idx];
-                switch (value->type) {
+                JsonPartialValue &value = merge_stack[idx];
+                switch (value.type) {
                     case JsonPartialValue::TYPE_NULL:
                     case JsonPartialValue::TYPE_BOOL:
                     case JsonPartialValue::TYPE_STR:
@@ -461,9 +523,7 @@ namespace MercuryJson {
                     case JsonPartialValue::TYPE_PARTIAL_OBJ:
                         if (main_stack.check(JsonPartialValue::TYPE_PARTIAL_OBJ, ',')) {
                             // Merge with partial object from previous stack.
-                            auto *prev_obj = static_cast<JsonPartialObjectHead *>(main_stack.get(2)->partial_object);
-                            prev_obj->final->next = value->partial_object;
-                            prev_obj->final = static_cast<JsonPartialObjectHead *>(value->partial_object)->final;
+                            main_stack.get(2).partial_object->append(value.partial_object);
                             main_stack.pop(1);
                         } else {
                             main_stack.push(value);
@@ -472,16 +532,14 @@ namespace MercuryJson {
                     case JsonPartialValue::TYPE_PARTIAL_ARR:
                         if (main_stack.check(JsonPartialValue::TYPE_PARTIAL_ARR, ',')) {
                             // Merge with partial array from previous stack.
-                            auto *prev_arr = static_cast<JsonPartialArrayHead *>(main_stack.get(2)->partial_array);
-                            prev_arr->final->next = value->partial_array;
-                            prev_arr->final = static_cast<JsonPartialArrayHead *>(value->partial_array)->final;
+                            main_stack.get(2).partial_array->append(value.partial_array);
                             main_stack.pop(1);
                         } else {
                             main_stack.push(value);
                         }
                         break;
                     case JsonPartialValue::TYPE_CHAR:
-                        switch (char ch = value->structural) {
+                        switch (char ch = value.structural) {
                             case '{':
                             case '[':
                             case ':':
@@ -512,17 +570,16 @@ namespace MercuryJson {
                 while (main_stack.reduce_partial_object()) {}
             }
         }
-#else
-        ParseStack main_stack(allocator);
-        _thread_shift_reduce_parsing(indices, indices + num_indices - 1, &main_stack);
-#endif
 //        main_stack.print();
         assert(main_stack.size() == 1);
-        auto *ret = reinterpret_cast<JsonValue *>(main_stack[0]);
+        auto *ret = allocator.construct(main_stack[0].value());
         idx_ptr += num_indices - 1;  // Consume the indices to satisfy null ending check.
 
         return ret;
     }
 
 #undef error
+
+    template JsonValue *JSON::_shift_reduce_parsing<true>();
+    template JsonValue *JSON::_shift_reduce_parsing<false>();
 }
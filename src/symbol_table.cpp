@@ -0,0 +1,43 @@
+#include "symbol_table.h"
+
+
+namespace MercuryJson {
+
+    size_t SymbolTable::_intern(const char *str, size_t len, const char **symbol) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ids.find(std::string_view(str, len));
+        if (it == ids.end()) {
+            symbols.emplace_back(str, len);
+            it = ids.emplace(symbols.back(), symbols.size() - 1).first;
+        }
+        *symbol = it->first.data();
+        return it->second;
+    }
+
+    size_t SymbolTable::find(const char *str, size_t len) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ids.find(std::string_view(str, len));
+        return it == ids.end() ? kNotFound : it->second;
+    }
+
+    void SymbolTable::clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ids.clear();
+        symbols.clear();
+    }
+
+    SymbolTable::Cache::Cache(SymbolTable &table) : table(table) {
+        for (Entry &entry : entries) {
+            entry.hash = 0;
+            entry.symbol = nullptr;
+            entry.len = kNotFound;  // never matches
+            entry.id = kNotFound;
+        }
+    }
+
+    char *SymbolTable::Cache::get_buffer(size_t size) {
+        if (buffer.size() < size) buffer.resize(size);
+        return buffer.data();
+    }
+
+}
@@ -0,0 +1,106 @@
+#ifndef MERCURYJSON_SYMBOL_TABLE_H
+#define MERCURYJSON_SYMBOL_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+namespace MercuryJson {
+
+    static inline uint64_t hash_key(const char *str, size_t len) {
+        const uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+        uint64_t hash = len * kMultiplier;
+        uint64_t word;
+        for (; len >= 8; str += 8, len -= 8) {
+            memcpy(&word, str, 8);
+            hash = (hash ^ word) * kMultiplier;
+            hash ^= hash >> 32U;
+        }
+        if (len > 0) {
+            word = 0;
+            memcpy(&word, str, len);
+            hash = (hash ^ word) * kMultiplier;
+            hash ^= hash >> 32U;
+        }
+        return hash;
+    }
+
+    // Distinct object keys of a document. Each key is stored once and identified by a dense id, so repeated keys
+    // share memory and can be compared as integers. Keys can be interned from multiple threads: each thread goes
+    // through its own `Cache`, and only takes the lock for keys it has not seen before.
+    class SymbolTable {
+        struct Hash {
+            inline size_t operator()(std::string_view key) const { return hash_key(key.data(), key.size()); }
+        };
+
+        std::deque<std::string> symbols;  // references stay valid when new symbols are added
+        std::unordered_map<std::string_view, size_t, Hash> ids;
+        mutable std::mutex mutex;
+
+        size_t _intern(const char *str, size_t len, const char **symbol);
+
+    public:
+        static const size_t kNotFound = static_cast<size_t>(-1);
+
+        // Direct-mapped cache of the keys interned by one thread.
+        class Cache {
+            static const size_t kNumEntries = 256;
+
+            struct Entry {
+                uint64_t hash;
+                const char *symbol;
+                size_t len, id;
+            };
+
+            SymbolTable &table;
+            Entry entries[kNumEntries];
+            std::vector<char> buffer;
+
+        public:
+            explicit Cache(SymbolTable &table);
+
+            // Id of the (unescaped) key `str` of length `len`, adding it to the table if it is new.
+            inline size_t intern(const char *str, size_t len) {
+                uint64_t hash = hash_key(str, len);
+                Entry &entry = entries[hash % kNumEntries];
+                if (entry.hash == hash && entry.len == len && memcmp(entry.symbol, str, len) == 0) return entry.id;
+                entry.hash = hash;
+                entry.len = len;
+                entry.id = table._intern(str, len, &entry.symbol);
+                return entry.id;
+            }
+
+            // Scratch space of at least `size` bytes for unescaping keys.
+            char *get_buffer(size_t size);
+        };
+
+        SymbolTable() = default;
+
+        SymbolTable(const SymbolTable &) = delete;
+        SymbolTable &operator=(const SymbolTable &) = delete;
+
+        // Id of key `str` of length `len`, or `kNotFound` if the document does not contain the key.
+        size_t find(const char *str, size_t len) const;
+
+        inline size_t find(const char *str) const { return find(str, strlen(str)); }
+
+        // Accessors below must not be used while keys are being interned.
+        inline const char *get(size_t id) const { return symbols[id].c_str(); }
+
+        inline size_t length(size_t id) const { return symbols[id].size(); }
+
+        inline size_t size() const { return symbols.size(); }
+
+        void clear();
+    };
+
+}
+
+#endif // MERCURYJSON_SYMBOL_TABLE_H
@@ -5,15 +5,23 @@
 #include <math.h>
 #include <cassert>
 
+#include <algorithm>
+#include <charconv>
+#include <new>
+#include <optional>
 #include <sstream>
-#include <thread>
-#include <future>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "constants.h"
 #include "flags.h"
 #include "mercuryparser.h"
 #include "utils.h"
+#include "parsenumber.h"
 #include "parsestring.h"
+#include "thread_pool.h"
 
 
 namespace MercuryJson {
@@ -40,15 +48,28 @@ namespace MercuryJson {
             case TYPE_TRUE:
                 printf("true");
                 return 1;
-            case TYPE_STR:
-                printf("\"%s\"", literals + (section & VALUE_MASK));
+            case TYPE_STR: {
+                std::string_view str = get_string(tape_idx);
+                printf("\"%.*s\"", static_cast<int>(str.size()), str.data());
+                return 1;
+            }
+            case TYPE_KEY:
+                printf("\"%s\"", symbols.get(section & VALUE_MASK));
                 return 1;
             case TYPE_INT:
                 printf("%lld", static_cast<long long int>(numeric[section & VALUE_MASK]));
                 return 1;
+            case TYPE_UINT:
+                printf("%llu", static_cast<unsigned long long int>(numeric[section & VALUE_MASK]));
+                return 1;
             case TYPE_DEC:
                 printf("%.10lf", plain_convert(static_cast<long long int>(numeric[section & VALUE_MASK])));
                 return 1;
+            case TYPE_RAW_NUMBER: {
+                std::string_view number = get_raw_number(tape_idx);
+                printf("%.*s", static_cast<int>(number.size()), number.data());
+                return 1;
+            }
             case TYPE_ARR: {
                 size_t elem_idx = tape_idx + 1;
                 bool first = true;
@@ -97,6 +118,26 @@ namespace MercuryJson {
                 printf("}");
                 return elem_idx + 1 - tape_idx;
             }
+            case TYPE_PACKED_INT:
+            case TYPE_PACKED_DEC: {
+                size_t end_idx = section & VALUE_MASK;
+                ArraySpan<int64_t> integers = get_array_span<int64_t>(tape_idx);
+                ArraySpan<double> decimals = get_array_span<double>(tape_idx);
+                printf("[");
+                for (size_t i = 0; i < end_idx - tape_idx - 1; ++i) {
+                    if (i > 0) printf(",");
+                    printf("\n");
+                    print_indent(indent + 2);
+                    if ((section & TYPE_MASK) == TYPE_PACKED_INT)
+                        printf("%lld", static_cast<long long int>(integers[i]));
+                    else
+                        printf("%.10lf", decimals[i]);
+                }
+                printf("\n");
+                print_indent(indent);
+                printf("]");
+                return end_idx + 1 - tape_idx;
+            }
             case TYPE_JUMP: {
                 size_t offset = (section & VALUE_MASK);
                 return print_json(tape_idx + offset, indent) + offset;
@@ -120,23 +161,55 @@ namespace MercuryJson {
                 case TYPE_TRUE:
                     printf("true\n");
                     break;
-                case TYPE_STR:
-                    printf("string: \"%s\"\n", literals + (section & VALUE_MASK));
+                case TYPE_STR: {
+                    std::string_view str = get_string(i);
+                    printf("string: \"%.*s\"\n", static_cast<int>(str.size()), str.data());
+                    break;
+                }
+                case TYPE_KEY:
+                    printf("key #%llu: \"%s\"\n", static_cast<unsigned long long int>(section & VALUE_MASK),
+                           symbols.get(section & VALUE_MASK));
                     break;
                 case TYPE_INT:
                     printf("integer: %lld\n", static_cast<long long int>(numeric[section & VALUE_MASK]));
                     break;
+                case TYPE_UINT:
+                    printf("unsigned integer: %llu\n",
+                           static_cast<unsigned long long int>(numeric[section & VALUE_MASK]));
+                    break;
                 case TYPE_DEC:
                     printf("decimal: %lf\n", plain_convert(static_cast<long long int>(numeric[section & VALUE_MASK])));
                     break;
+                case TYPE_RAW_NUMBER: {
+                    std::string_view number = get_raw_number(i);
+                    printf("raw number: %.*s\n", static_cast<int>(number.size()), number.data());
+                    break;
+                }
                 case TYPE_ARR:
                     printf("array: %llu\n", (section & VALUE_MASK));
                     break;
                 case TYPE_OBJ:
                     printf("object: %llu\n", (section & VALUE_MASK));
                     break;
+                case TYPE_PACKED_INT:
+                case TYPE_PACKED_DEC: {
+                    bool is_integer = (section & TYPE_MASK) == TYPE_PACKED_INT;
+                    printf("packed %s: %llu\n", is_integer ? "integers" : "decimals",
+                           static_cast<unsigned long long int>(section & VALUE_MASK));
+                    if ((section & VALUE_MASK) < i) break;
+                    ArraySpan<int64_t> integers = get_array_span<int64_t>(i);
+                    ArraySpan<double> decimals = get_array_span<double>(i);
+                    for (size_t j = 0; j < (section & VALUE_MASK) - i - 1; ++j) {
+                        if (is_integer) printf("[%3lu]   %lld\n", i + 1 + j, static_cast<long long int>(integers[j]));
+                        else printf("[%3lu]   %lf\n", i + 1 + j, decimals[j]);
+                    }
+                    i = (section & VALUE_MASK) - 1;
+                    break;
+                }
                 case TYPE_JUMP:
                     printf("jump offset: %llu\n", (section & VALUE_MASK));
+                    // The skipped words are unwritten, or left over from an array packed across segments.
+                    i += (section & VALUE_MASK) - 1;
                     break;
                 default:
                     printf("unknown: type = %llu, value = %llu\n", (section & TYPE_MASK), (section & VALUE_MASK));
@@ -150,11 +223,16 @@ namespace MercuryJson {
 
     struct TapeStack {
         size_t depth, extra_closing_count;
+        // Numbers deferred by the segment, listed in `Tape::number_list` from the first structural index on.
+        size_t num_deferred_numbers;
         void *ret_address[kMaxDepth];
         size_t scope_offset[kMaxDepth];
         size_t extra_closing_offset[kMaxDepth];  // offsets of extra closing brackets
+        // Segment boundaries whose enclosing scope is opened before the (merged) segment, stored as pairs of
+        // (structural index, number of extra closing brackets before the boundary).
+        std::vector<std::pair<size_t, size_t>> pending_boundaries;
 
-        TapeStack() : depth(0), extra_closing_count(0) {}
+        TapeStack() : depth(0), extra_closing_count(0), num_deferred_numbers(0) {}
 
         inline void push(size_t offset, void *address) {
             scope_offset[depth] = offset;
@@ -172,6 +250,7 @@ namespace MercuryJson {
         if (ch != (__char)) _error(#__char, input, ch, idx); \
     })
 
+    template <bool kParseStrInline, Tape::NumberMode kNumberMode, bool kInternKeys>
     void Tape::_thread_state_machine(char *input, const size_t *indices, size_t idx_begin, size_t idx_end,
                                      TapeStack *stack, size_t *tape_end, bool start_unknown) {
 
@@ -189,6 +268,11 @@ namespace MercuryJson {
         // Our implementation only guarantees that tape size is no greater than the number of structural characters,
         // since commas (,) and colons (:) are not stored, and numerals and literals are stored off-tape.
         size_t tape_pos = idx_begin;
+        // Keys seen by this segment, to avoid locking the symbol table for every key.
+        std::optional<SymbolTable::Cache> key_cache;
+        if constexpr (kInternKeys) key_cache.emplace(symbols);
+        // Numbers waiting to be parsed together when batching numbers.
+        NumberBatch number_batch;
 
         if (start_unknown) {
             goto unknown_start;
@@ -199,7 +283,7 @@ namespace MercuryJson {
 #define PARSE_VALUE(continue_address) ({                                             \
             switch (ch) {                                                            \
                 case '"':                                                            \
-                    write_str(tape_pos++, _parse_str(input, idx));                   \
+                    write_str(tape_pos++, _parse_str<kParseStrInline>(input, idx, idx_offset - 1));  \
                     break;                                                           \
                 case 't':                                                            \
                     parse_true(input, idx);                                          \
@@ -224,7 +308,13 @@ namespace MercuryJson {
                 case '8':                                                            \
                 case '9':                                                            \
                 case '-': {                                                          \
-                    _parse_and_write_number(input, idx, tape_pos++, idx_offset - 1); \
+                    if constexpr (kNumberMode == NumberMode::kInline)                \
+                        _parse_and_write_number(input, idx, tape_pos++, idx_offset - 1); \
+                    else if constexpr (kNumberMode == NumberMode::kDeferred)         \
+                        _write_deferred_number(tape_pos++, idx_offset - 1,           \
+                                               idx_begin + stack->num_deferred_numbers++);  \
+                    else                                                             \
+                        _batch_number(&number_batch, input, idx, indices[idx_offset], tape_pos++, idx_offset - 1); \
                     break;                                                           \
                 }                                                                    \
                 case '[': {                                                          \
@@ -242,6 +332,14 @@ namespace MercuryJson {
             }                                                                        \
         })
 
+        // Object keys are always followed by a colon, which is the next structural character.
+#define WRITE_KEY() ({                                                                             \
+            if constexpr (kInternKeys)                                                             \
+                write_key(tape_pos++, _intern_key(input, idx, indices[idx_offset], &*key_cache));  \
+            else                                                                                   \
+                write_str(tape_pos++, _parse_str<kParseStrInline>(input, idx, idx_offset - 1));                    \
+        })
+
 #ifdef DEBUG
 # define __PRINT_INFO(s) ({ printf("%lu[%c]: %s\n", idx, ch, s); })
 #else
@@ -262,9 +360,11 @@ unknown_start:
         next_char();
         switch (ch) {
             case '"':
-                write_str(tape_pos++, _parse_str(input, idx));
-                peek_char();
-                if (ch == ':') goto object_key_state;
+                if (input[indices[idx_offset]] == ':') {
+                    WRITE_KEY();
+                    goto object_key_state;
+                }
+                write_str(tape_pos++, _parse_str<kParseStrInline>(input, idx, idx_offset - 1));
                 break;
             case ']':
                 goto array_end;
@@ -295,10 +395,12 @@ unknown_2nd_value:
         __PRINT_INFO("parse unknown 2nd value");
         next_char();
         if (ch == '"') {
-            write_str(tape_pos++, _parse_str(input, idx));
-            peek_char();
-            if (ch == ':') goto object_key_state;
-            else goto array_continue;
+            if (input[indices[idx_offset]] == ':') {
+                WRITE_KEY();
+                goto object_key_state;
+            }
+            write_str(tape_pos++, _parse_str<kParseStrInline>(input, idx, idx_offset - 1));
+            goto array_continue;
         } else {
             goto array_value;
         }
@@ -308,7 +410,7 @@ object_begin:
         next_char();
         switch (ch) {
             case '"':
-                write_str(tape_pos++, _parse_str(input, idx));
+                WRITE_KEY();
                 goto object_key_state;
             case '}':
                 goto object_end;
@@ -328,7 +430,7 @@ object_continue:
             case ',':
                 next_char();
                 expect('"');
-                write_str(tape_pos++, _parse_str(input, idx));
+                WRITE_KEY();
                 goto object_key_state;
             case '}':
                 goto object_end;
@@ -386,7 +488,11 @@ array_end:
             --stack->depth;
             left_tape_idx = stack->scope_offset[stack->depth];
             right_tape_idx = tape_pos++;
-            write_array(left_tape_idx, right_tape_idx);
+            // Numbers must be parsed by now to tell whether the array can be packed.
+            if (kNumberMode == NumberMode::kInline && pack_numeric_arrays)
+                _pack_numeric_array(left_tape_idx, right_tape_idx);
+            else
+                write_array(left_tape_idx, right_tape_idx);
             //@formatter:off
             goto *stack->ret_address[stack->depth];
             //@formatter:on
@@ -396,11 +502,15 @@ fail:
         MercuryJson::__error("unexpected character when parsing value", input, idx);
 succeed:
         if (idx_offset != idx_end) MercuryJson::__error("excessive characters at end of input", input, idx);
+        for (size_t i = 0; i < number_batch.size; ++i)
+            __parse_and_write_number_fast(input, number_batch.offsets[i], number_batch.tape_idxs[i],
+                                          number_batch.numeric_idxs[i]);
         __PRINT_INFO("parse succeed");
         *tape_end = tape_pos;
 
 #undef next_char
 #undef PARSE_VALUE
+#undef WRITE_KEY
     }
 
     inline bool __is_opening_bracket(char ch) {
@@ -419,44 +529,207 @@ succeed:
         return !(__is_opening_bracket(ch) || __is_closing_bracket(ch) || __is_separator(ch));
     }
 
-    void Tape::state_machine(char *input, size_t *idx_ptr, size_t structural_size) {
+    /* Grammar checks for cross-boundary input.
+     * This is to make sure structural characters that are not stored on tape (, and :) are properly inserted
+     * between segments, i.e. the following cases should fail when running with 2 threads:
+     *  No.  Reason                    1st Thread         2nd Thread
+     *   1.  Missing colon (:)         { "1": 2, "3"      4, "5": 6 }
+     *   2.  Missing comma (,)         [ 1, 2             3, 4]
+     *   3.  Missing comma (,)         [ [ 1, 2 ]         [ 3, 4 ] ]
+     *   4.  Extra colon (:)           { "1": 2, "3":     : 4, "5": 6 }
+     *   5.  Extra comma (,)           [ 1, 2,            , 3, 4 ]
+     *   6.  Extra kv-pair in object   { "1": 2, "3":     "4": 5, "5": 6 }
+     *   7.  Array value in object     { "1": 2,          "3", "5": 6 }
+     * Cases 6 and 7 depend on the innermost scope enclosing the boundary, which may be opened several segments
+     * before the boundary.
+     */
+
+    // Cases 1 to 5 for the boundary before structural index `pos`.
+    static void __check_boundary_separators(const char *input, const size_t *idx_ptr, size_t structural_size,
+                                            size_t pos) {
+        if (pos < 1 || pos >= structural_size) return;
+        size_t idx = idx_ptr[pos];
+        char left_char = input[idx_ptr[pos - 1]], right_char = input[idx];
+        if ((__is_non_structural(left_char) || __is_closing_bracket(left_char))
+            && (__is_non_structural(right_char) || __is_opening_bracket(right_char)))  // case 1, 2, 3
+            MercuryJson::__error("expected separator", input, idx);
+        if (__is_separator(left_char) && __is_separator(right_char))  // cases 4 & 5
+            MercuryJson::__error("extra separator", input, idx);
+    }
+
+    // Cases 6 and 7 for the boundary before structural index `pos`, enclosed in a scope of the given type.
+    static void __check_boundary_scope(const char *input, const size_t *idx_ptr, size_t structural_size,
+                                       size_t pos, bool in_object) {
+        for (size_t right_pos = pos; right_pos <= pos + 1; ++right_pos) {
+            if (right_pos >= 2 && right_pos < structural_size) {
+                char left_char = input[idx_ptr[right_pos - 2]], right_char = input[idx_ptr[right_pos]];
+                if (left_char == ':' && right_char == ':')  // case 6
+                    MercuryJson::__error("extra colon (:)", input, idx_ptr[right_pos]);
+                if (in_object && left_char == ',' && right_char == ',')
+                    MercuryJson::__error("non key-value pair in object", input, idx_ptr[right_pos]);
+            }
+        }
+    }
+
+    void Tape::_merge_segments(const char *input, const size_t *idx_ptr, size_t structural_size, size_t boundary,
+                               TapeStack *left, TapeStack *right) {
+        __check_boundary_separators(input, idx_ptr, structural_size, boundary);
+
+        // Resolve scope checks for the boundary itself and the pending ones of the right segment. Their enclosing
+        // scope is either still open at the end of the left segment, or opened even before the left segment.
+        right->pending_boundaries.emplace_back(boundary, 0);
+        for (auto[pos, level] : right->pending_boundaries) {
+            if (level < left->depth) {
+                size_t scope_tape_idx = left->scope_offset[left->depth - 1 - level];
+                __check_boundary_scope(input, idx_ptr, structural_size, pos,
+                                       (tape[scope_tape_idx] & TYPE_MASK) == TYPE_OBJ);
+            } else {
+                left->pending_boundaries.emplace_back(pos, level - left->depth + left->extra_closing_count);
+            }
+        }
+
+        // Match extra closing brackets of the right segment with unclosed brackets of the left segment.
+        size_t num_matched = std::min(right->extra_closing_count, left->depth);
+        for (size_t i = 0; i < num_matched; ++i) {
+            size_t right_tape_idx = right->extra_closing_offset[i];
+            size_t left_tape_idx = left->scope_offset[left->depth - 1 - i];
+            if ((tape[left_tape_idx] & TYPE_MASK) != (tape[right_tape_idx] & TYPE_MASK)) {
+                size_t right_input_idx = idx_ptr[tape[right_tape_idx] & VALUE_MASK];
+                MercuryJson::__error("matching brackets have different types", input, right_input_idx);
+            }
+            write_content(right_tape_idx, left_tape_idx);
+            write_content(left_tape_idx, right_tape_idx);
+        }
+        left->depth -= num_matched;
+
+        size_t num_extra = right->extra_closing_count - num_matched;
+        if (left->extra_closing_count + num_extra > kMaxDepth || left->depth + right->depth > kMaxDepth)
+            throw std::runtime_error("exceeded maximum nesting depth");
+        if (num_extra > 0) {
+            // The left segment has no unclosed brackets left, so the merged segment has the same extra closing
+            // brackets as the left one, followed by the unmatched ones of the right segment.
+            memcpy(left->extra_closing_offset + left->extra_closing_count,
+                   right->extra_closing_offset + num_matched, num_extra * sizeof(size_t));
+            left->extra_closing_count += num_extra;
+        }
+        memcpy(left->scope_offset + left->depth, right->scope_offset, right->depth * sizeof(size_t));
+        left->depth += right->depth;
+    }
+
+    void Tape::state_machine(char *input, size_t *idx_ptr, size_t structural_size, const ParserOptions &options,
+                             const Stage1Strings &strings) {
         if (structural_size == 1)
             __error("emtpy string is not valid JSON", input, 0);
 
-#if PARSE_STR_NUM_THREADS
-        std::thread parse_str_threads[PARSE_STR_NUM_THREADS];
-        for (size_t i = 0; i < PARSE_STR_NUM_THREADS; ++i)
-            parse_str_threads[i] = std::thread(&Tape::_thread_parse_str, this, i, input, idx_ptr, structural_size);
+        ThreadPool &pool = ThreadPool::global();
+        // Lazy strings rely on stage 1 to tell which strings need unescaping, and are never parsed during stage 2.
+        lazy_strings = options.lazy_strings && strings.escaped_strings != nullptr;
+        this->strings = strings;
+        if (!lazy_strings) this->strings.escaped_strings = nullptr;
+        size_t num_str_threads = lazy_strings ? 0 : options.get_parse_str_num_threads(structural_size);
+#if NO_PARSE_NUMBER
+        size_t num_num_threads = 0;
+        batch_numbers = false;
+#else
+        size_t num_num_threads = options.get_parse_num_num_threads(structural_size);
+        batch_numbers = options.batch_numbers;
 #endif
+        intern_keys = options.intern_keys;
+        raw_big_numbers = options.raw_big_numbers;
+        pack_numeric_arrays = options.pack_numeric_arrays;
+        symbols.clear();
+        Latch parse_str_latch(pool);
+        for (size_t i = 0; i < num_str_threads; ++i)
+            pool.submit(parse_str_latch, [=] {
+                _thread_parse_str(i, num_str_threads, input, idx_ptr, structural_size);
+            });
         literals = input;
 
-#if TAPE_STATE_MACHINE_NUM_THREADS == 1
-        TapeStack stack;
-        _thread_state_machine(input, idx_ptr, 0, structural_size, &stack, &tape_size);
-        if (stack.depth != 0) throw std::runtime_error("unclosed brackets at end of input");
-#else
-        TapeStack stack[TAPE_STATE_MACHINE_NUM_THREADS];
-        std::future<void> parse_threads[TAPE_STATE_MACHINE_NUM_THREADS - 1];
-        size_t tape_ends[TAPE_STATE_MACHINE_NUM_THREADS];
-        size_t idx_splits[TAPE_STATE_MACHINE_NUM_THREADS + 1];
+        // Pick the specialization of the state machine once, so the parsing loop has no checks for the options.
+        // Indexed by whether strings are parsed inline, how numbers are parsed, and whether keys are interned.
+#define SEGMENT_PARSERS(kParseStrInline, kNumberMode)                                          \
+        {&Tape::_thread_state_machine<kParseStrInline, NumberMode::kNumberMode, false>,        \
+         &Tape::_thread_state_machine<kParseStrInline, NumberMode::kNumberMode, true>}
+        static const SegmentParser kSegmentParsers[2][3][2] = {
+                {SEGMENT_PARSERS(false, kInline), SEGMENT_PARSERS(false, kDeferred), SEGMENT_PARSERS(false, kBatched)},
+                {SEGMENT_PARSERS(true, kInline), SEGMENT_PARSERS(true, kDeferred), SEGMENT_PARSERS(true, kBatched)}};
+#undef SEGMENT_PARSERS
+        NumberMode number_mode = num_num_threads > 0 ? NumberMode::kDeferred
+                                                     : batch_numbers ? NumberMode::kBatched : NumberMode::kInline;
+        SegmentParser parse_segment = kSegmentParsers[num_str_threads == 0 && !lazy_strings]
+                                                     [static_cast<size_t>(number_mode)][intern_keys];
 
         // Choose a reasonable number of threads such that each split contains more than 1 character.
-        size_t num_threads = std::min(static_cast<size_t>(TAPE_STATE_MACHINE_NUM_THREADS),
+        size_t num_threads = std::min(options.get_tape_num_threads(structural_size),
                                       std::max(1UL, (structural_size - 1) / 2));
-        for (int i = 0; i <= num_threads; ++i)
+        if (number_mode == NumberMode::kDeferred && number_list == nullptr)
+            number_list = aligned_malloc<size_t>(capacity);
+        number_lists.clear();
+        if (num_threads == 1) {
+            TapeStack stack;
+            (this->*parse_segment)(input, idx_ptr, 0, structural_size - 1, &stack, &tape_size, false);
+            if (stack.depth != 0) throw std::runtime_error("unclosed brackets at end of input");
+            number_lists.emplace_back(0, stack.num_deferred_numbers);
+        } else {
+            _parallel_state_machine(input, idx_ptr, structural_size, num_threads, parse_segment);
+        }
+
+        if (num_num_threads > 0) {
+            // Split the deferred numbers evenly, the calling thread taking the first part.
+            size_t num_numbers = 0;
+            for (const auto &list : number_lists) num_numbers += list.second;
+            size_t num_parts = num_num_threads + 1;
+            Latch parse_num_latch(pool);
+            for (size_t i = 1; i < num_parts; ++i)
+                pool.submit(parse_num_latch, [=] {
+                    _thread_parse_num(input, idx_ptr, num_numbers * i / num_parts, num_numbers * (i + 1) / num_parts);
+                });
+            _thread_parse_num(input, idx_ptr, 0, num_numbers / num_parts);
+            parse_num_latch.wait();
+        }
+        // Arrays that could not be packed as they were closed: their numbers were not parsed yet, or they cross a
+        // thread segment.
+        if (pack_numeric_arrays && (number_mode != NumberMode::kInline || num_threads > 1)) _pack_numeric_arrays();
+        parse_str_latch.wait();
+        // The buffers belong to the JSON, which may be destroyed before the tape, so strings decoded later by
+        // `get_string` are parsed without the masks of stage 1.
+        this->strings = Stage1Strings();
+//        print_tape();
+//        print_json();
+//        printf("\n");
+    }
+
+    void Tape::_parallel_state_machine(char *input, const size_t *idx_ptr, size_t structural_size,
+                                       size_t num_threads, SegmentParser parse_segment) {
+        ThreadPool &pool = ThreadPool::global();
+        std::vector<TapeStack> stack(num_threads);
+        std::vector<size_t> tape_ends(num_threads);
+        std::vector<size_t> idx_splits(num_threads + 1);
+
+        for (size_t i = 0; i <= num_threads; ++i)
             idx_splits[i] = (structural_size - 1) * i / num_threads;
-        for (int i = 1; i < num_threads; ++i) {
+        Latch state_machine_latch(pool);
+#if NUMA_AWARE
+        // Run every segment on the node holding its part of `indices`, including the first one.
+        const size_t first_segment = 0;
+#else
+        const size_t first_segment = 1;
+#endif
+        for (size_t i = first_segment; i < num_threads; ++i) {
             size_t idx_begin = idx_splits[i];
             size_t idx_end = idx_splits[i + 1];
-            parse_threads[i - 1] = std::async(std::launch::async, &Tape::_thread_state_machine, this, input, idx_ptr,
-                                              idx_begin, idx_end, &stack[i], &tape_ends[i], /*start_unknown=*/true);
-//            parse_threads[i - 1].get();
+            pool.submit(state_machine_latch, [=, &stack, &tape_ends] {
+                (this->*parse_segment)(input, idx_ptr, idx_begin, idx_end, &stack[i], &tape_ends[i],
+                        /*start_unknown=*/i > 0);
+            }, pool.node_for_part(idx_begin, structural_size - 1));
         }
-        _thread_state_machine(input, idx_ptr, idx_splits[0], idx_splits[1], &stack[0], &tape_ends[0]);
+        if (first_segment > 0)
+            (this->*parse_segment)(input, idx_ptr, idx_splits[0], idx_splits[1], &stack[0], &tape_ends[0], false);
+        state_machine_latch.wait();
+        for (size_t i = 0; i < num_threads; ++i)
+            number_lists.emplace_back(idx_splits[i], stack[i].num_deferred_numbers);
 
-//        for (int pid = 1; pid < TAPE_STATE_MACHINE_NUM_THREADS; ++pid)
-//            parse_threads[pid - 1].get();
-//        for (int i = 0; i < TAPE_STATE_MACHINE_NUM_THREADS; ++i) {
+//        for (int i = 0; i < num_threads; ++i) {
 //            size_t idx_begin = idx_splits[i];
 //            printf("Segment #%d: tape span = [%lu, %lu), stack size = %lu, extra brackets = %lu\n",
 //                   i, idx_begin, tape_ends[i], stack[i].depth, stack[i].extra_closing_count);
@@ -476,105 +749,115 @@ succeed:
 //            printf("\n");
 //        }
 
-        // Join threads and merge.
-        size_t merge_stack[kMaxDepth];
-        size_t top = 0;
-        for (int i = 0; i < stack[0].depth; ++i)
-            merge_stack[top++] = stack[0].scope_offset[i];
-        for (int pid = 1; pid < num_threads; ++pid) {
-            parse_threads[pid - 1].get();
-
-            // Verify grammar correctness checks for cross-boundary input.
-            // This is to make sure structural characters that are not stored on tape (, and :) are properly inserted
-            // between segments, i.e. the following cases should fail when running with 2 threads:
-            //  No.  Reason                    1st Thread         2nd Thread
-            //   1.  Missing colon (:)         { "1": 2, "3"      4, "5": 6 }
-            //   2.  Missing comma (,)         [ 1, 2             3, 4]
-            //   3.  Missing comma (,)         [ [ 1, 2 ]         [ 3, 4 ] ]
-            //   4.  Extra colon (:)           { "1": 2, "3":     : 4, "5": 6 }
-            //   5.  Extra comma (,)           [ 1, 2,            , 3, 4 ]
-            //   6.  Extra kv-pair in object   { "1": 2, "3":     "4": 5, "5": 6 }
-            //   7.  Array value in object     { "1": 2,          "3", "5": 6 }
-            size_t pos = idx_splits[pid];
-            size_t idx = idx_ptr[pos];
-            if (pos >= 1 && pos < structural_size) {
-                char left_char = input[idx_ptr[pos - 1]], right_char = input[idx];
-                if ((__is_non_structural(left_char) || __is_closing_bracket(left_char))
-                    && (__is_non_structural(right_char) || __is_opening_bracket(right_char)))  // case 1, 2, 3
-                    MercuryJson::__error("expected separator", input, idx);
-                if (__is_separator(left_char) && __is_separator(right_char))  // cases 4 & 5
-                    MercuryJson::__error("extra separator", input, idx);
-            }
-            if (top > 0) {
-                bool in_object = (tape[merge_stack[top - 1]] & TYPE_MASK) == TYPE_OBJ;
-                for (size_t right_pos = pos; right_pos <= pos + 1; ++right_pos) {
-                    if (right_pos >= 2 && right_pos < structural_size) {
-                        char left_char = input[idx_ptr[right_pos - 2]], right_char = input[idx_ptr[right_pos]];
-                        if (left_char == ':' && right_char == ':')  // case 6
-                            MercuryJson::__error("extra colon (:)", input, idx_ptr[right_pos]);
-                        if (in_object && left_char == ',' && right_char == ',')
-                            MercuryJson::__error("non key-value pair in object", input, idx_ptr[right_pos]);
-                    }
-                }
-            }
-
-            TapeStack &cur_stack = stack[pid];
-            for (int i = 0; i < cur_stack.extra_closing_count; ++i) {
-                size_t right_tape_idx = cur_stack.extra_closing_offset[i];
-                size_t right_input_idx = idx_ptr[tape[right_tape_idx] & VALUE_MASK];
-                if (top == 0) MercuryJson::__error("unmatched closing bracket", input, right_input_idx);
-                size_t left_tape_idx = merge_stack[--top];
-                if ((tape[left_tape_idx] & TYPE_MASK) != (tape[right_tape_idx] & TYPE_MASK))
-                    MercuryJson::__error("matching brackets have different types", input, right_input_idx);
-                write_content(right_tape_idx, left_tape_idx);
-                write_content(left_tape_idx, right_tape_idx);
+        // Merge segments pairwise in a tree. After the round with stride `step`, `stack[i]` for each `i` divisible
+        // by `2 * step` summarizes segments [i, i + 2 * step), so log2(num_threads) rounds are needed in total.
+        for (size_t step = 1; step < num_threads; step *= 2) {
+            Latch merge_latch(pool);
+            for (size_t i = 2 * step; i + step < num_threads; i += 2 * step) {
+                size_t boundary = idx_splits[i + step];
+                pool.submit(merge_latch, [=, &stack] {
+                    _merge_segments(input, idx_ptr, structural_size, boundary, &stack[i], &stack[i + step]);
+                }, pool.node_for_part(idx_splits[i], structural_size - 1));
             }
-            for (int i = 0; i < cur_stack.depth; ++i)
-                merge_stack[top++] = cur_stack.scope_offset[i];
+            _merge_segments(input, idx_ptr, structural_size, idx_splits[step], &stack[0], &stack[step]);
+            merge_latch.wait();
+        }
+        // Boundaries still pending are not enclosed in any scope, and are left for the checks below.
+        if (stack[0].extra_closing_count > 0) {
+            size_t right_input_idx = idx_ptr[tape[stack[0].extra_closing_offset[0]] & VALUE_MASK];
+            MercuryJson::__error("unmatched closing bracket", input, right_input_idx);
         }
-        if (top > 0) throw std::runtime_error("unmatched opening brackets");
+        if (stack[0].depth > 0) throw std::runtime_error("unmatched opening brackets");
         if (size_t pos = idx_ptr[idx_splits[num_threads] - 1]; input[pos] == ',')
             MercuryJson::__error("extra separator", input, pos);
-        for (int i = 0; i < num_threads - 1; ++i) {
+        for (size_t i = 0; i < num_threads - 1; ++i) {
             size_t idx_begin_next = idx_splits[i + 1];
             if (tape_ends[i] < idx_begin_next) write_jump(tape_ends[i], idx_begin_next);
         }
         tape_size = tape_ends[num_threads - 1];
+    }
 
-#endif
-
-#if PARSE_NUM_NUM_THREADS && !NO_PARSE_NUMBER
-        std::thread parse_num_threads[PARSE_STR_NUM_THREADS];
-        for (size_t i = 0; i < PARSE_STR_NUM_THREADS; ++i)
-            parse_num_threads[i] = std::thread(&Tape::_thread_parse_num, this, i, input, idx_ptr, structural_size);
-        for (std::thread &thread : parse_num_threads)
-            thread.join();
-#endif
-#if PARSE_STR_NUM_THREADS
-        for (std::thread &thread : parse_str_threads)
-            thread.join();
-#endif
-//        print_tape();
-//        print_json();
-//        printf("\n");
+    void Tape::_pack_numeric_array(size_t left_tape_idx, size_t right_tape_idx) {
+        // Numbers take one tape word each, so an array of numbers is the words between its brackets, apart from the
+        // jumps of an array that crosses a thread segment.
+        bool all_integers = true, has_jumps = false;
+        size_t num_elements = 0;
+        for (size_t i = left_tape_idx + 1; i < right_tape_idx; ++i) {
+            uint64_t type = tape[i] & TYPE_MASK;
+            if (type == TYPE_JUMP) {
+                has_jumps = true;
+                i += (tape[i] & VALUE_MASK) - 1;
+                continue;
+            }
+            if (type == TYPE_DEC) all_integers = false;
+            else if (type != TYPE_INT) return write_array(left_tape_idx, right_tape_idx);
+            ++num_elements;
+        }
+        if (num_elements == 0) return write_array(left_tape_idx, right_tape_idx);
+        if (!all_integers) {
+            // Integers are only packed with decimals if they convert to doubles exactly.
+            const int64_t kMaxExactInteger = 1LL << 53;
+            for (size_t i = left_tape_idx + 1; i < right_tape_idx; ++i) {
+                if ((tape[i] & TYPE_MASK) == TYPE_JUMP) {
+                    i += (tape[i] & VALUE_MASK) - 1;
+                    continue;
+                }
+                if ((tape[i] & TYPE_MASK) != TYPE_INT) continue;
+                auto value = static_cast<int64_t>(numeric[tape[i] & VALUE_MASK]);
+                if (value > kMaxExactInteger || value < -kMaxExactInteger)
+                    return write_array(left_tape_idx, right_tape_idx);
+            }
+        }
+        // Elements are moved towards the opening bracket over the jumps, so they are never overwritten before being
+        // read. They are created as `int64_t` or `double` objects, for `get_array_span` to point to.
+        size_t elem_idx = left_tape_idx + 1;
+        for (size_t i = left_tape_idx + 1; i < right_tape_idx; ++i) {
+            uint64_t section = tape[i];
+            if ((section & TYPE_MASK) == TYPE_JUMP) {
+                i += (section & VALUE_MASK) - 1;
+                continue;
+            }
+            auto value = static_cast<int64_t>(numeric[section & VALUE_MASK]);
+            if (all_integers) new(tape + elem_idx++) int64_t(value);
+            else if ((section & TYPE_MASK) == TYPE_INT) new(tape + elem_idx++) double(static_cast<double>(value));
+            else new(tape + elem_idx++) double(plain_convert(static_cast<long long int>(value)));
+        }
+        uint64_t type = all_integers ? TYPE_PACKED_INT : TYPE_PACKED_DEC;
+        tape[left_tape_idx] = type | elem_idx;
+        tape[elem_idx] = type | left_tape_idx;
+        if (has_jumps) {
+            // Skip the words freed by the jumps, up to what followed the array.
+            size_t next_idx = right_tape_idx + 1;
+            while (next_idx < tape_size && (tape[next_idx] & TYPE_MASK) == TYPE_JUMP)
+                next_idx += tape[next_idx] & VALUE_MASK;
+            if (next_idx >= tape_size) tape_size = elem_idx + 1;
+            else write_jump(elem_idx + 1, next_idx);
+        }
     }
 
-    void Tape::__parse_and_write_number_backoff(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx) {
-        bool is_decimal;
-        auto ret = parse_number(input, &is_decimal, offset);
-        if (is_decimal) {
-            tape[tape_idx] = TYPE_DEC | numeric_idx;
-            numeric[numeric_idx] = *reinterpret_cast<uint64_t *>(&ret);
-        } else {
-            tape[tape_idx] = TYPE_INT | numeric_idx;
-            numeric[numeric_idx] = *reinterpret_cast<uint64_t *>(&ret);
+    void Tape::_pack_numeric_arrays() {
+        for (size_t i = 0; i < tape_size;) {
+            uint64_t section = tape[i];
+            uint64_t type = section & TYPE_MASK;
+            if (type == TYPE_JUMP) {
+                i += section & VALUE_MASK;
+            } else if ((type == TYPE_PACKED_INT || type == TYPE_PACKED_DEC) && (section & VALUE_MASK) > i) {
+                // Packed in its segment already. Its elements are not tagged, so they must not be scanned.
+                i = (section & VALUE_MASK) + 1;
+            } else if (type == TYPE_ARR && (section & VALUE_MASK) > i) {
+                // Once packed, the array is skipped as a whole on the next iteration.
+                _pack_numeric_array(i, section & VALUE_MASK);
+                if ((tape[i] & TYPE_MASK) == TYPE_ARR) ++i;
+            } else {
+                ++i;
+            }
         }
     }
 
     void Tape::__parse_and_write_number_fast(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx) {
         const char *s = input + offset;
         uint64_t integer = 0ULL;
-        bool negative = false;
+        bool negative = false, is_decimal = false;
         int64_t exponent = 0LL;
         if (*s == '-') {
             ++s;
@@ -591,11 +874,13 @@ succeed:
                 integer = integer * 10 + (*s++ - '0');
             } while (*s >= '0' && *s <= '9');
         }
+        size_t num_digits = s - input - offset - negative;
         if (*s == '.') {
+            is_decimal = true;
             const char *const base = ++s;
 #if PARSE_NUMBER_AVX
             if (_all_digits(s)) {
-                integer += integer * 100000000 + _parse_eight_digits(s);
+                integer = integer * 100000000 + _parse_eight_digits(s);
                 s += 8;
             }
 #endif
@@ -604,13 +889,10 @@ succeed:
             exponent = base - s;
             if (exponent == 0)
                 __error("excessive characters at end of number", input, s - input - 1);
-        }
-        if (s - input - offset >= 18) {
-            // use the slower back-off method
-            __parse_and_write_number_backoff(input, offset, tape_idx, numeric_idx);
-            return;
+            num_digits += s - base;
         }
         if (*s == 'e' || *s == 'E') {
+            is_decimal = true;
             ++s;
             bool negative_exp = false;
             if (*s == '-') {
@@ -621,31 +903,44 @@ succeed:
             if (*s < '0' || *s > '9')
                 MercuryJson::__error("numbers must not have null exponents", input, s - input);
             do {
-                expo = expo * 10 + (*s++ - '0');
+                if (expo < kMaxDecimalExponent) expo = expo * 10 + (*s - '0');
+                ++s;
             } while (*s >= '0' && *s <= '9');
             exponent += negative_exp ? -expo : expo;
         }
         if (!kStructuralOrWhitespace[*s])
             __error("excessive characters at end of number", input, s - input);
-        if (exponent == 0) {
-            tape[tape_idx] = TYPE_INT | numeric_idx;
+        if (!is_decimal) {
+            const char first_digit = input[offset + negative];
+            if (negative ? !integer_fits_int64(integer, num_digits, true)
+                         : !integer_fits_uint64(integer, num_digits, first_digit)) {
+                _write_big_number(input, offset, tape_idx, numeric_idx, "integer out of range");
+                return;
+            }
+            bool is_unsigned = !negative && integer > static_cast<uint64_t>(INT64_MAX);
+            tape[tape_idx] = (is_unsigned ? TYPE_UINT : TYPE_INT) | numeric_idx;
             numeric[numeric_idx] = negative ? -integer : integer;
         } else {
-            if (exponent < -308 || exponent > 308)
-                MercuryJson::__error("decimal exponent out of range", input, offset);
-            double decimal = negative ? -integer : integer;
-            decimal *= kPowerOfTen[308 + exponent];
+            double decimal = parse_decimal(input, offset, integer, exponent, num_digits, negative);
+            if (decimal_out_of_range(decimal, input, offset, integer, num_digits)) {
+                _write_big_number(input, offset, tape_idx, numeric_idx, "decimal out of range");
+                return;
+            }
             tape[tape_idx] = TYPE_DEC | numeric_idx;
             numeric[numeric_idx] = plain_convert(decimal);
         }
     }
 
+    void Tape::_write_big_number(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx,
+                                 const char *message) {
+        if (!raw_big_numbers) MercuryJson::__error(message, input, offset);
+        tape[tape_idx] = TYPE_RAW_NUMBER | numeric_idx;
+        numeric[numeric_idx] = offset;
+    }
+
     void Tape::_parse_and_write_number(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx) {
 #if NO_PARSE_NUMBER
         tape[tape_idx] = 0;
-#elif PARSE_NUM_NUM_THREADS
-        tape[tape_idx] = numeric_idx;
-        numeric[numeric_idx] = tape_idx;
 #else
         __parse_and_write_number_fast(input, offset, tape_idx, numeric_idx);
 #endif
@@ -760,47 +1055,814 @@ succeed:
         return index;
     }
 
-    size_t Tape::_parse_str(char *input, size_t idx) {
-#if PARSE_STR_NUM_THREADS
-        return idx + 1;
-#endif
+    template <bool kParseStrInline>
+    size_t Tape::_parse_str(char *input, size_t idx, size_t idx_offset) {
+        if constexpr (!kParseStrInline) {
+            const uint64_t *escaped_strings = strings.escaped_strings;
+            if (escaped_strings != nullptr && (escaped_strings[idx_offset / 64] >> (idx_offset % 64)) & 1U)
+                return (idx + 1) | STR_ESCAPED;
+            return idx + 1;
+        }
         // size_t index = literals_size;
         // char *dest = literals + index;
         size_t index = idx;
         char *dest = input + idx + 1;
         size_t len = 0;
-        parse_str(input, dest, &len, idx + 1);
+        parse_str_auto(input, dest, &len, idx + 1, strings.string_masks);
         literals_size += len + 1;
         return index + 1;
     }
 
-    void Tape::_thread_parse_str(size_t pid, char *input, const size_t *idx_ptr, size_t structural_size) {
-#if PARSE_STR_NUM_THREADS
+    size_t Tape::_intern_key(const char *input, size_t idx, size_t colon_idx, SymbolTable::Cache *cache) {
+        if (input[colon_idx] != ':') _error("':'", input, input[colon_idx], colon_idx);
+        // Only whitespace may separate the closing quote from the colon.
+        size_t end = colon_idx - 1;
+        while (end > idx && (input[end] == ' ' || input[end] == '\t' || input[end] == '\n' || input[end] == '\r'))
+            --end;
+        if (end == idx || input[end] != '"') _error("'\"'", input, input[end], end);
+        const char *key = input + idx + 1;
+        size_t len = end - idx - 1;
+        // Without string parsing, keys are interned as written, like every other string is left escaped.
+#if PARSE_STR_MODE >= 0
+        if (memchr(key, '\\', len) != nullptr) {
+            // Keys are compared by their unescaped content. The buffer is padded for vectorized string parsing.
+            char *buffer = cache->get_buffer(len + 2 * kAlignmentSize);
+            parse_str_auto(input, buffer, &len, idx + 1, strings.string_masks);
+            key = buffer;
+        }
+#endif
+        return cache->intern(key, len);
+    }
+
+    void Tape::_thread_parse_str(size_t pid, size_t num_threads, char *input, const size_t *idx_ptr,
+                                 size_t structural_size) {
+        if (strings.string_starts != nullptr) {
+            // Split by the length of strings, so threads finish together even if long strings are clustered.
+            for (size_t i = strings.split(pid, num_threads), end = strings.split(pid + 1, num_threads); i < end; ++i) {
+                size_t start = strings.string_starts[i], idx = idx_ptr[start];
+                // Interned keys are copied into the symbol table by the state machine, and left untouched here.
+                if (intern_keys && start + 1 < structural_size && input[idx_ptr[start + 1]] == ':') continue;
+                parse_str_auto(input, input + idx + 1, nullptr, idx + 1, strings.string_masks);
+            }
+            return;
+        }
         size_t idx;
-        size_t begin = pid * structural_size / PARSE_STR_NUM_THREADS;
-        size_t end = (pid + 1) * structural_size / PARSE_STR_NUM_THREADS;
+        size_t begin = pid * structural_size / num_threads;
+        size_t end = (pid + 1) * structural_size / num_threads;
         if (end > structural_size) end = structural_size;
         for (size_t i = begin; i < end; ++i) {
             idx = idx_ptr[i];
             char *dest = input + idx + 1;
             if (input[idx] == '"') {
-                parse_str(input, dest, nullptr, idx + 1);
+                // Interned keys are copied into the symbol table by the state machine, and left untouched here.
+                if (intern_keys && i + 1 < structural_size && input[idx_ptr[i + 1]] == ':') continue;
+                parse_str_auto(input, dest, nullptr, idx + 1, strings.string_masks);
             }
         }
-#endif
     }
 
-    void Tape::_thread_parse_num(size_t pid, char *input, const size_t *idx_ptr, size_t structural_size) {
-#if PARSE_NUM_NUM_THREADS
-        size_t begin = pid * structural_size / PARSE_NUM_NUM_THREADS;
-        size_t end = (pid + 1) * structural_size / PARSE_NUM_NUM_THREADS;
-        for (size_t numeric_idx = begin; numeric_idx < end; ++numeric_idx) {
-            size_t offset = idx_ptr[numeric_idx];
-            if (!(input[offset] == '-' || (input[offset] >= '0' && input[offset] <= '9'))) continue;
-            size_t tape_idx = numeric[numeric_idx];
-            __parse_and_write_number(input, offset, tape_idx, numeric_idx);
+    void Tape::_thread_parse_num(const char *input, const size_t *idx_ptr, size_t begin, size_t end) {
+        NumberBatch batch;
+        size_t list_begin = 0;
+        for (const auto &[list_offset, list_size] : number_lists) {
+            size_t list_end = list_begin + list_size;
+            for (size_t i = std::max(begin, list_begin); i < std::min(end, list_end); ++i) {
+                size_t numeric_idx = number_list[list_offset + i - list_begin];
+                size_t offset = idx_ptr[numeric_idx], tape_idx = numeric[numeric_idx];
+                if (batch_numbers)
+                    _batch_number(&batch, input, offset, idx_ptr[numeric_idx + 1], tape_idx, numeric_idx);
+                else
+                    __parse_and_write_number_fast(input, offset, tape_idx, numeric_idx);
+            }
+            list_begin = list_end;
         }
-#endif
+        for (size_t i = 0; i < batch.size; ++i)
+            __parse_and_write_number_fast(input, batch.offsets[i], batch.tape_idxs[i], batch.numeric_idxs[i]);
+    }
+
+    void Tape::_parse_and_write_numbers_x4(const char *input, const NumberBatch &batch) {
+        static const uint64_t kTypes[2] = {TYPE_INT, TYPE_DEC};
+        uint64_t values[4];
+        unsigned decimal_mask;
+        unsigned parsed = parse_numbers_x4(input, batch.offsets, values, &decimal_mask);
+        for (unsigned i = 0; i < 4; ++i) {
+            if (parsed & (1U << i)) {
+                tape[batch.tape_idxs[i]] = kTypes[(decimal_mask >> i) & 1U] | batch.numeric_idxs[i];
+                numeric[batch.numeric_idxs[i]] = values[i];
+            } else {
+                __parse_and_write_number_fast(input, batch.offsets[i], batch.tape_idxs[i], batch.numeric_idxs[i]);
+            }
+        }
+    }
+
+    std::string_view Tape::get_string(size_t tape_idx) {
+        uint64_t section = tape[tape_idx];
+        char *str = literals + (section & STR_OFFSET_MASK);
+        if (!lazy_strings || (section & STR_DECODED)) return std::string_view(str);
+        if (!(section & STR_ESCAPED)) return std::string_view(str, strchr(str, '"') - str);
+        // Unescaping never makes a string longer, so it is decoded in place and NUL-terminated like eager strings.
+        size_t len = 0;
+        parse_str_auto(literals, str, &len, section & STR_OFFSET_MASK, strings.string_masks);
+        tape[tape_idx] = section | STR_DECODED;
+        return std::string_view(str, len);
+    }
+
+    std::string_view Tape::get_raw_number(size_t tape_idx) const {
+        const char *number = literals + numeric[tape[tape_idx] & VALUE_MASK];
+        // The number has been validated, so it extends up to the next structural or whitespace character.
+        const char *end = number;
+        while (!kStructuralOrWhitespace[static_cast<unsigned char>(*end)]) ++end;
+        return std::string_view(number, end - number);
+    }
+
+    size_t Tape::find_field(size_t tape_idx, size_t key_id) const {
+        size_t end_idx = tape[tape_idx] & VALUE_MASK;
+        size_t elem_idx = tape_idx + 1;
+        while (true) {
+            while ((tape[elem_idx] & TYPE_MASK) == TYPE_JUMP) elem_idx += tape[elem_idx] & VALUE_MASK;
+            if (elem_idx >= end_idx) return kNotFound;
+            bool found = tape[elem_idx] == (TYPE_KEY | key_id);
+            ++elem_idx;
+            while ((tape[elem_idx] & TYPE_MASK) == TYPE_JUMP) elem_idx += tape[elem_idx] & VALUE_MASK;
+            if (found) return elem_idx;
+            uint64_t type = tape[elem_idx] & TYPE_MASK;
+            if (type == TYPE_OBJ || type == TYPE_ARR || type == TYPE_PACKED_INT || type == TYPE_PACKED_DEC)
+                elem_idx = tape[elem_idx] & VALUE_MASK;
+            ++elem_idx;
+        }
+    }
+
+    size_t Tape::_count_entries(size_t tape_idx) const {
+        size_t end_idx = tape[tape_idx] & VALUE_MASK;
+        size_t count = 0;
+        for (size_t elem_idx = _skip_jumps(tape_idx + 1); elem_idx < end_idx;
+             elem_idx = _skip_jumps(_value_end(elem_idx)))
+            ++count;
+        return count;
+    }
+
+    const char *Tape::_dom_string(size_t tape_idx) {
+        uint64_t section = tape[tape_idx];
+        if ((section & TYPE_MASK) == TYPE_KEY) return symbols.get(section & VALUE_MASK);
+        if (lazy_strings && !(section & (STR_ESCAPED | STR_DECODED))) {
+            // The string is read from the input up to its closing quote, which is replaced to terminate it. It is
+            // then marked as decoded, so that `get_string` finds its end the same way as for other strings.
+            char *str = literals + (section & STR_OFFSET_MASK);
+            *strchr(str, '"') = '\0';
+            tape[tape_idx] = section | STR_DECODED;
+            return str;
+        }
+        return get_string(tape_idx).data();
+    }
+
+    JsonValue Tape::_to_dom_value(BlockAllocator<JsonValue> &allocator, size_t *tape_idx) {
+        size_t value_idx = _skip_jumps(*tape_idx);
+        uint64_t section = tape[value_idx];
+        *tape_idx = _value_end(value_idx);
+        switch (section & TYPE_MASK) {
+            case TYPE_NULL:
+                return JsonValue();
+            case TYPE_FALSE:
+                return JsonValue(false);
+            case TYPE_TRUE:
+                return JsonValue(true);
+            case TYPE_STR:
+                return JsonValue(_dom_string(value_idx));
+            case TYPE_INT:
+                return JsonValue(static_cast<long long int>(numeric[section & VALUE_MASK]));
+            case TYPE_DEC:
+                return JsonValue(plain_convert(static_cast<long long int>(numeric[section & VALUE_MASK])));
+            case TYPE_ARR: {
+                auto *array = JsonArray::allocate(allocator, _count_entries(value_idx));
+                size_t elem_idx = value_idx + 1;
+                for (JsonValue &elem : *array)
+                    new(&elem) JsonValue(_to_dom_value(allocator, &elem_idx));
+                return JsonValue(array);
+            }
+            case TYPE_OBJ: {
+                auto *object = JsonObject::allocate(allocator, _count_entries(value_idx) / 2);
+                size_t elem_idx = value_idx + 1;
+                for (JsonMember &member : *object) {
+                    size_t key_idx = _skip_jumps(elem_idx);
+                    elem_idx = key_idx + 1;
+                    const char *key = _dom_string(key_idx);
+                    new(&member) JsonMember(key, _to_dom_value(allocator, &elem_idx));
+                }
+                return JsonValue(object);
+            }
+            case TYPE_PACKED_INT:
+            case TYPE_PACKED_DEC: {
+                size_t end_idx = section & VALUE_MASK;
+                auto *array = JsonArray::allocate(allocator, end_idx - value_idx - 1);
+                ArraySpan<int64_t> integers = get_array_span<int64_t>(value_idx);
+                ArraySpan<double> decimals = get_array_span<double>(value_idx);
+                for (size_t i = 0; i < array->size; ++i) {
+                    if (decimals.size > 0) new(&(*array)[i]) JsonValue(decimals[i]);
+                    else new(&(*array)[i]) JsonValue(static_cast<long long int>(integers[i]));
+                }
+                return JsonValue(array);
+            }
+            case TYPE_UINT:
+            case TYPE_RAW_NUMBER:
+                throw std::runtime_error("number out of range for the DOM");
+            default:
+                throw std::runtime_error("unexpected element on tape");
+        }
+    }
+
+    std::vector<size_t> Tape::_entries(size_t tape_idx) const {
+        size_t end_idx = tape[tape_idx] & VALUE_MASK;
+        std::vector<size_t> entry_idxs;
+        for (size_t elem_idx = _skip_jumps(tape_idx + 1); elem_idx < end_idx;
+             elem_idx = _skip_jumps(_value_end(elem_idx)))
+            entry_idxs.push_back(elem_idx);
+        return entry_idxs;
+    }
+
+    size_t Tape::_split_elements(size_t tape_idx, const std::vector<size_t> &entry_idxs, size_t stride, size_t part,
+                                 size_t num_parts) const {
+        size_t end_idx = tape[tape_idx] & VALUE_MASK;
+        size_t split_idx = tape_idx + (end_idx - tape_idx) * part / num_parts;
+        size_t entry = std::lower_bound(entry_idxs.begin(), entry_idxs.end(), split_idx) - entry_idxs.begin();
+        return std::min((entry + stride - 1) / stride, entry_idxs.size() / stride);
+    }
+
+    JsonValue Tape::to_dom(BlockAllocator<JsonValue> &allocator, const ParserOptions &options) {
+        size_t root_idx = _skip_jumps(0);
+        uint64_t type = tape[root_idx] & TYPE_MASK;
+        size_t num_threads = type == TYPE_ARR || type == TYPE_OBJ
+                             ? options.get_to_dom_num_threads((tape[root_idx] & VALUE_MASK) - root_idx) : 1;
+        if (num_threads <= 1) {
+            size_t tape_idx = root_idx;
+            return _to_dom_value(allocator, &tape_idx);
+        }
+
+        // Each thread builds the elements of the root starting within its share of the tape, into the slots of the
+        // root allocated here.
+        std::vector<size_t> entry_idxs = _entries(root_idx);
+        bool is_object = type == TYPE_OBJ;
+        size_t stride = is_object ? 2 : 1;
+        size_t size = entry_idxs.size() / stride;
+        JsonArray *array = is_object ? nullptr : JsonArray::allocate(allocator, size);
+        JsonObject *object = is_object ? JsonObject::allocate(allocator, size) : nullptr;
+
+        auto build_elements = [&](BlockAllocator<JsonValue> &thread_allocator, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                size_t tape_idx = entry_idxs[i * stride + stride - 1];
+                JsonValue value = _to_dom_value(thread_allocator, &tape_idx);
+                if (is_object) new(&(*object)[i]) JsonMember(_dom_string(entry_idxs[i * 2]), value);
+                else new(&(*array)[i]) JsonValue(value);
+            }
+        };
+        auto split = [&](size_t part) { return _split_elements(root_idx, entry_idxs, stride, part, num_threads); };
+
+        std::vector<BlockAllocator<JsonValue>> allocators;
+        allocators.reserve(num_threads - 1);
+        for (size_t i = 1; i < num_threads; ++i) allocators.push_back(allocator.fork());
+        {
+            // Forks must outlive the tasks using them, so the latch is waited for before they are destroyed, even
+            // when the calling thread fails.
+            Latch latch;
+            for (size_t i = 1; i < num_threads; ++i) {
+                size_t begin = split(i), end = split(i + 1);
+                if (begin == end) continue;
+                BlockAllocator<JsonValue> *thread_allocator = &allocators[i - 1];
+                ThreadPool::global().submit(latch, [&build_elements, thread_allocator, begin, end] {
+                    build_elements(*thread_allocator, begin, end);
+                });
+            }
+            build_elements(allocator, 0, split(1));
+            latch.wait();
+        }
+        for (auto &thread_allocator : allocators) thread_allocator.join();
+        return is_object ? JsonValue(object) : JsonValue(array);
+    }
+
+    // Appends encoded values to a byte buffer.
+    class ByteWriter {
+    protected:
+        std::vector<uint8_t> &output;
+
+        inline void _put(uint8_t byte) { output.push_back(byte); }
+
+        template <typename T>
+        inline void _put_big_endian(T value) {
+            static_assert(std::is_unsigned_v<T>, "values are written as unsigned integers");
+            if constexpr (sizeof(T) == 2) value = __builtin_bswap16(value);
+            else if constexpr (sizeof(T) == 4) value = __builtin_bswap32(value);
+            else if constexpr (sizeof(T) == 8) value = __builtin_bswap64(value);
+            _put_bytes(&value, sizeof(T));
+        }
+
+        inline void _put_bytes(const void *data, size_t size) {
+            size_t offset = output.size();
+            output.resize(offset + size);
+            memcpy(output.data() + offset, data, size);
+        }
+
+        inline void _put_double(double value) {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            _put_big_endian(bits);
+        }
+
+    public:
+        explicit ByteWriter(std::vector<uint8_t> *output) : output(*output) {}
+    };
+
+    // MessagePack, encoding integers and lengths in their smallest form, and decimals as float 64.
+    class MsgPackEncoder : public ByteWriter {
+    public:
+        using ByteWriter::ByteWriter;
+
+        inline void null() { _put(0xc0); }
+
+        inline void boolean(bool value) { _put(value ? 0xc3 : 0xc2); }
+
+        void unsigned_integer(uint64_t value) {
+            if (value < 0x80) {
+                _put(static_cast<uint8_t>(value));
+            } else if (value <= UINT8_MAX) {
+                _put(0xcc);
+                _put(static_cast<uint8_t>(value));
+            } else if (value <= UINT16_MAX) {
+                _put(0xcd);
+                _put_big_endian(static_cast<uint16_t>(value));
+            } else if (value <= UINT32_MAX) {
+                _put(0xce);
+                _put_big_endian(static_cast<uint32_t>(value));
+            } else {
+                _put(0xcf);
+                _put_big_endian(value);
+            }
+        }
+
+        void integer(int64_t value) {
+            if (value >= 0) {
+                unsigned_integer(static_cast<uint64_t>(value));
+            } else if (value >= -32) {
+                _put(static_cast<uint8_t>(value));
+            } else if (value >= INT8_MIN) {
+                _put(0xd0);
+                _put(static_cast<uint8_t>(value));
+            } else if (value >= INT16_MIN) {
+                _put(0xd1);
+                _put_big_endian(static_cast<uint16_t>(value));
+            } else if (value >= INT32_MIN) {
+                _put(0xd2);
+                _put_big_endian(static_cast<uint32_t>(value));
+            } else {
+                _put(0xd3);
+                _put_big_endian(static_cast<uint64_t>(value));
+            }
+        }
+
+        inline void decimal(double value) {
+            _put(0xcb);
+            _put_double(value);
+        }
+
+        void string(std::string_view str) {
+            if (str.size() < 32) {
+                _put(static_cast<uint8_t>(0xa0 | str.size()));
+            } else if (str.size() <= UINT8_MAX) {
+                _put(0xd9);
+                _put(static_cast<uint8_t>(str.size()));
+            } else if (str.size() <= UINT16_MAX) {
+                _put(0xda);
+                _put_big_endian(static_cast<uint16_t>(str.size()));
+            } else {
+                _put(0xdb);
+                _put_big_endian(static_cast<uint32_t>(str.size()));
+            }
+            _put_bytes(str.data(), str.size());
+        }
+
+        void array(size_t size) { _container(size, 0x90, 0xdc); }
+
+        void map(size_t size) { _container(size, 0x80, 0xde); }
+
+    private:
+        // Header of a container of `size` elements: the fix type `fix` with the size, or the 16-bit type `type16`,
+        // followed by the 32-bit type.
+        void _container(size_t size, uint8_t fix, uint8_t type16) {
+            if (size < 16) {
+                _put(static_cast<uint8_t>(fix | size));
+            } else if (size <= UINT16_MAX) {
+                _put(type16);
+                _put_big_endian(static_cast<uint16_t>(size));
+            } else {
+                _put(type16 + 1);
+                _put_big_endian(static_cast<uint32_t>(size));
+            }
+        }
+    };
+
+    // CBOR, encoding integers and lengths in their smallest form, and decimals as double precision floats.
+    class CborEncoder : public ByteWriter {
+    public:
+        using ByteWriter::ByteWriter;
+
+        inline void null() { _put(0xf6); }
+
+        inline void boolean(bool value) { _put(value ? 0xf5 : 0xf4); }
+
+        inline void unsigned_integer(uint64_t value) { _header(0, value); }
+
+        inline void integer(int64_t value) {
+            // Negative integers are encoded as -1 - value.
+            if (value >= 0) _header(0, static_cast<uint64_t>(value));
+            else _header(1, ~static_cast<uint64_t>(value));
+        }
+
+        inline void decimal(double value) {
+            _put(0xfb);
+            _put_double(value);
+        }
+
+        inline void string(std::string_view str) {
+            _header(3, str.size());
+            _put_bytes(str.data(), str.size());
+        }
+
+        inline void array(size_t size) { _header(4, size); }
+
+        inline void map(size_t size) { _header(5, size); }
+
+    private:
+        void _header(uint8_t major_type, uint64_t value) {
+            auto initial = static_cast<uint8_t>(major_type << 5U);
+            if (value < 24) {
+                _put(initial | value);
+            } else if (value <= UINT8_MAX) {
+                _put(initial | 24);
+                _put(static_cast<uint8_t>(value));
+            } else if (value <= UINT16_MAX) {
+                _put(initial | 25);
+                _put_big_endian(static_cast<uint16_t>(value));
+            } else if (value <= UINT32_MAX) {
+                _put(initial | 26);
+                _put_big_endian(static_cast<uint32_t>(value));
+            } else {
+                _put(initial | 27);
+                _put_big_endian(value);
+            }
+        }
+    };
+
+    template <typename Encoder>
+    void Tape::_encode_value(Encoder *encoder, size_t *tape_idx) {
+        size_t value_idx = _skip_jumps(*tape_idx);
+        uint64_t section = tape[value_idx];
+        *tape_idx = _value_end(value_idx);
+        switch (section & TYPE_MASK) {
+            case TYPE_NULL:
+                encoder->null();
+                break;
+            case TYPE_FALSE:
+                encoder->boolean(false);
+                break;
+            case TYPE_TRUE:
+                encoder->boolean(true);
+                break;
+            case TYPE_STR:
+                encoder->string(get_string(value_idx));
+                break;
+            case TYPE_KEY: {
+                size_t id = section & VALUE_MASK;
+                encoder->string(std::string_view(symbols.get(id), symbols.length(id)));
+                break;
+            }
+            case TYPE_INT:
+                encoder->integer(static_cast<int64_t>(numeric[section & VALUE_MASK]));
+                break;
+            case TYPE_UINT:
+                encoder->unsigned_integer(numeric[section & VALUE_MASK]);
+                break;
+            case TYPE_DEC:
+                encoder->decimal(plain_convert(static_cast<long long int>(numeric[section & VALUE_MASK])));
+                break;
+            case TYPE_ARR:
+            case TYPE_OBJ: {
+                // Keys are encoded as strings, so objects are encoded as their header followed by all their entries.
+                size_t num_entries = _count_entries(value_idx);
+                if ((section & TYPE_MASK) == TYPE_ARR) encoder->array(num_entries);
+                else encoder->map(num_entries / 2);
+                size_t elem_idx = value_idx + 1;
+                for (size_t i = 0; i < num_entries; ++i) _encode_value(encoder, &elem_idx);
+                break;
+            }
+            case TYPE_PACKED_INT:
+            case TYPE_PACKED_DEC: {
+                size_t end_idx = section & VALUE_MASK;
+                ArraySpan<int64_t> integers = get_array_span<int64_t>(value_idx);
+                ArraySpan<double> decimals = get_array_span<double>(value_idx);
+                encoder->array(end_idx - value_idx - 1);
+                for (double value : decimals) encoder->decimal(value);
+                for (int64_t value : integers) encoder->integer(value);
+                break;
+            }
+            case TYPE_RAW_NUMBER:
+                throw std::runtime_error("raw numbers cannot be encoded");
+            default:
+                throw std::runtime_error("unexpected element on tape");
+        }
+    }
+
+    template <typename Encoder>
+    void Tape::_transcode(std::vector<uint8_t> *output, const ParserOptions &options) {
+        output->clear();
+        size_t root_idx = _skip_jumps(0);
+        uint64_t type = tape[root_idx] & TYPE_MASK;
+        size_t num_threads = type == TYPE_ARR || type == TYPE_OBJ
+                             ? options.get_export_num_threads((tape[root_idx] & VALUE_MASK) - root_idx) : 1;
+        Encoder encoder(output);
+        if (num_threads <= 1) {
+            size_t tape_idx = root_idx;
+            _encode_value(&encoder, &tape_idx);
+            return;
+        }
+
+        // Each thread encodes the elements of the root starting within its share of the tape into its own buffer,
+        // except for the calling thread, which encodes the first share right after the header of the root.
+        std::vector<size_t> entry_idxs = _entries(root_idx);
+        size_t stride = type == TYPE_OBJ ? 2 : 1;
+        if (type == TYPE_ARR) encoder.array(entry_idxs.size());
+        else encoder.map(entry_idxs.size() / 2);
+        auto encode_elements = [&](Encoder *thread_encoder, size_t begin, size_t end) {
+            if (begin == end) return;
+            size_t tape_idx = entry_idxs[begin * stride];
+            for (size_t i = begin * stride; i < end * stride; ++i) _encode_value(thread_encoder, &tape_idx);
+        };
+        auto split = [&](size_t part) { return _split_elements(root_idx, entry_idxs, stride, part, num_threads); };
+
+        std::vector<std::vector<uint8_t>> buffers(num_threads - 1);
+        {
+            Latch latch;
+            for (size_t i = 1; i < num_threads; ++i) {
+                size_t begin = split(i), end = split(i + 1);
+                std::vector<uint8_t> *buffer = &buffers[i - 1];
+                ThreadPool::global().submit(latch, [&encode_elements, buffer, begin, end] {
+                    Encoder thread_encoder(buffer);
+                    encode_elements(&thread_encoder, begin, end);
+                });
+            }
+            encode_elements(&encoder, 0, split(1));
+            latch.wait();
+        }
+        size_t size = output->size();
+        for (auto &buffer : buffers) size += buffer.size();
+        output->reserve(size);
+        for (auto &buffer : buffers) output->insert(output->end(), buffer.begin(), buffer.end());
+    }
+
+    void Tape::to_msgpack(std::vector<uint8_t> *output, const ParserOptions &options) {
+        _transcode<MsgPackEncoder>(output, options);
+    }
+
+    void Tape::to_cbor(std::vector<uint8_t> *output, const ParserOptions &options) {
+        _transcode<CborEncoder>(output, options);
+    }
+
+    // Bit mask of the bytes among the first `len` bytes at `str`, at most 32, that equal `a`, `b`, `c` or `d`.
+    static inline uint32_t __match_bytes(const char *str, size_t len, char a, char b, char c, char d) {
+        __m256i block;
+        if (len >= 32) {
+            block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str));
+        } else {
+            alignas(32) char tail[32] = {};
+            memcpy(tail, str, len);
+            block = _mm256_load_si256(reinterpret_cast<const __m256i *>(tail));
+        }
+        __m256i match = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(a)),
+                                _mm256_cmpeq_epi8(block, _mm256_set1_epi8(b))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)),
+                                _mm256_cmpeq_epi8(block, _mm256_set1_epi8(d))));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(match));
+        // `_bzhi_u32` only reads the low 8 bits of the length, so a full block must not go through it.
+        return len >= 32 ? mask : _bzhi_u32(mask, static_cast<uint32_t>(len));
+    }
+
+    // Appends the rows of a CSV text, or of a TSV text when the separator is a tab, one field at a time.
+    class CsvWriter {
+        std::string &output;
+        char separator;
+        size_t num_fields;  // fields written in the current row
+        size_t row_begin;
+
+        inline void _separate() {
+            if (num_fields++ > 0) output += separator;
+        }
+
+        // CSV fields containing the separator, quotes or line breaks are quoted, with quotes doubled.
+        void _write_quoted(std::string_view str) {
+            bool needs_quotes = false;
+            for (size_t idx = 0; idx < str.size() && !needs_quotes; idx += 32)
+                needs_quotes = __match_bytes(str.data() + idx, str.size() - idx, '"', separator, '\n', '\r') != 0;
+            if (!needs_quotes) {
+                output.append(str);
+                return;
+            }
+            output += '"';
+            size_t begin = 0;
+            for (size_t idx = 0; idx < str.size(); idx += 32) {
+                uint32_t mask = __match_bytes(str.data() + idx, str.size() - idx, '"', '"', '"', '"');
+                for (; mask != 0; mask = _blsr_u32(mask)) {
+                    size_t pos = idx + _tzcnt_u32(mask);
+                    output.append(str.data() + begin, pos + 1 - begin);
+                    output += '"';
+                    begin = pos + 1;
+                }
+            }
+            output.append(str.data() + begin, str.size() - begin);
+            output += '"';
+        }
+
+        // TSV has no quoting, so tabs, line breaks and backslashes are escaped instead.
+        void _write_escaped(std::string_view str) {
+            size_t begin = 0;
+            for (size_t idx = 0; idx < str.size(); idx += 32) {
+                uint32_t mask = __match_bytes(str.data() + idx, str.size() - idx, '\t', '\n', '\r', '\\');
+                for (; mask != 0; mask = _blsr_u32(mask)) {
+                    size_t pos = idx + _tzcnt_u32(mask);
+                    output.append(str.data() + begin, pos - begin);
+                    output += '\\';
+                    switch (str[pos]) {
+                        case '\t': output += 't'; break;
+                        case '\n': output += 'n'; break;
+                        case '\r': output += 'r'; break;
+                        default: output += '\\'; break;
+                    }
+                    begin = pos + 1;
+                }
+            }
+            output.append(str.data() + begin, str.size() - begin);
+        }
+
+    public:
+        CsvWriter(std::string *output, char separator)
+                : output(*output), separator(separator), num_fields(0), row_begin(output->size()) {}
+
+        inline void empty() { _separate(); }
+
+        void string(std::string_view str) {
+            _separate();
+            if (separator == '\t') _write_escaped(str);
+            else _write_quoted(str);
+        }
+
+        // Text needing no quoting or escaping, such as numbers and literals.
+        inline void plain(std::string_view text) {
+            _separate();
+            output.append(text);
+        }
+
+        template <typename T>
+        inline void number(T value) {
+            char buffer[32];
+            char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+            plain(std::string_view(buffer, end - buffer));
+        }
+
+        inline void end_row() {
+            // A row of a single empty field is quoted in CSV, so it does not read back as a blank line.
+            if (num_fields == 1 && output.size() == row_begin && separator != '\t') output += "\"\"";
+            output += '\n';
+            num_fields = 0;
+            row_begin = output.size();
+        }
+    };
+
+    void Tape::_write_csv_field(CsvWriter *writer, size_t tape_idx) {
+        uint64_t section = tape[tape_idx];
+        switch (section & TYPE_MASK) {
+            case TYPE_NULL:
+                writer->empty();
+                break;
+            case TYPE_FALSE:
+                writer->plain("false");
+                break;
+            case TYPE_TRUE:
+                writer->plain("true");
+                break;
+            case TYPE_STR:
+                writer->string(get_string(tape_idx));
+                break;
+            case TYPE_INT:
+                writer->number(static_cast<int64_t>(numeric[section & VALUE_MASK]));
+                break;
+            case TYPE_UINT:
+                writer->number(numeric[section & VALUE_MASK]);
+                break;
+            case TYPE_DEC:
+                writer->number(plain_convert(static_cast<long long int>(numeric[section & VALUE_MASK])));
+                break;
+            case TYPE_RAW_NUMBER:
+                writer->plain(get_raw_number(tape_idx));
+                break;
+            default:
+                throw std::runtime_error("nested values cannot be exported as CSV");
+        }
+    }
+
+    void Tape::to_csv(std::string *output, const std::vector<std::string> &columns, char separator,
+                      const ParserOptions &options) {
+        output->clear();
+        size_t root_idx = _skip_jumps(0);
+        if ((tape[root_idx] & TYPE_MASK) != TYPE_ARR) throw std::runtime_error("CSV export needs an array of objects");
+        std::vector<size_t> record_idxs = _entries(root_idx);
+        for (size_t record_idx : record_idxs) {
+            if ((tape[record_idx] & TYPE_MASK) != TYPE_OBJ)
+                throw std::runtime_error("CSV export needs an array of objects");
+        }
+
+        // Interned keys are mapped to their column by id, other keys by their contents.
+        std::vector<std::string_view> names(columns.begin(), columns.end());
+        std::unordered_map<std::string_view, size_t> column_idxs;
+        std::vector<size_t> symbol_columns(symbols.size(), kNotFound);
+        for (size_t i = 0; i < names.size(); ++i) {
+            column_idxs.emplace(names[i], i);
+            size_t id = symbols.find(names[i].data(), names[i].size());
+            if (id != SymbolTable::kNotFound && symbol_columns[id] == kNotFound) symbol_columns[id] = i;
+        }
+        auto column_of = [&](size_t key_idx) {
+            uint64_t section = tape[key_idx];
+            if ((section & TYPE_MASK) == TYPE_KEY) return symbol_columns[section & VALUE_MASK];
+            auto it = column_idxs.find(get_string(key_idx));
+            return it == column_idxs.end() ? kNotFound : it->second;
+        };
+        auto for_each_field = [&](size_t record_idx, auto &&callback) {
+            size_t end_idx = tape[record_idx] & VALUE_MASK;
+            for (size_t key_idx = _skip_jumps(record_idx + 1); key_idx < end_idx;) {
+                size_t value_idx = _skip_jumps(key_idx + 1);
+                callback(key_idx, value_idx);
+                key_idx = _skip_jumps(_value_end(value_idx));
+            }
+        };
+        if (columns.empty()) {
+            for (size_t record_idx : record_idxs) {
+                for_each_field(record_idx, [&](size_t key_idx, size_t) {
+                    if (column_of(key_idx) != kNotFound) return;
+                    uint64_t section = tape[key_idx];
+                    std::string_view name = (section & TYPE_MASK) == TYPE_KEY
+                                            ? std::string_view(symbols.get(section & VALUE_MASK),
+                                                               symbols.length(section & VALUE_MASK))
+                                            : get_string(key_idx);
+                    if ((section & TYPE_MASK) == TYPE_KEY) symbol_columns[section & VALUE_MASK] = names.size();
+                    column_idxs.emplace(name, names.size());
+                    names.push_back(name);
+                });
+            }
+        }
+
+        auto write_records = [&](std::string *buffer, size_t begin, size_t end) {
+            CsvWriter writer(buffer, separator);
+            std::vector<size_t> field_idxs(names.size());
+            for (size_t i = begin; i < end; ++i) {
+                std::fill(field_idxs.begin(), field_idxs.end(), kNotFound);
+                for_each_field(record_idxs[i], [&](size_t key_idx, size_t value_idx) {
+                    size_t column = column_of(key_idx);
+                    if (column != kNotFound) field_idxs[column] = value_idx;
+                });
+                for (size_t value_idx : field_idxs) {
+                    if (value_idx == kNotFound) writer.empty();
+                    else _write_csv_field(&writer, value_idx);
+                }
+                writer.end_row();
+            }
+        };
+
+        CsvWriter header(output, separator);
+        for (std::string_view name : names) header.string(name);
+        header.end_row();
+        size_t num_threads = options.get_export_num_threads((tape[root_idx] & VALUE_MASK) - root_idx);
+        if (num_threads <= 1) {
+            write_records(output, 0, record_idxs.size());
+            return;
+        }
+
+        // Each thread writes the rows of the objects starting within its share of the tape into its own buffer, except
+        // for the calling thread, which writes the first share right after the header.
+        auto split = [&](size_t part) { return _split_elements(root_idx, record_idxs, 1, part, num_threads); };
+        std::vector<std::string> buffers(num_threads - 1);
+        {
+            Latch latch;
+            for (size_t i = 1; i < num_threads; ++i) {
+                size_t begin = split(i), end = split(i + 1);
+                if (begin == end) continue;
+                std::string *buffer = &buffers[i - 1];
+                ThreadPool::global().submit(latch, [&write_records, buffer, begin, end] {
+                    write_records(buffer, begin, end);
+                });
+            }
+            write_records(output, 0, split(1));
+            latch.wait();
+        }
+        size_t size = output->size();
+        for (auto &buffer : buffers) size += buffer.size();
+        output->reserve(size);
+        for (auto &buffer : buffers) output->append(buffer);
     }
 
     void Tape::components_analysis() {
@@ -809,12 +1871,24 @@ succeed:
         for (size_t i = 0; i < tape_size; ++i) {
             uint64_t section = tape[i];
             stats[(section & TYPE_MASK) >> 60]++;
+            if (((section & TYPE_MASK) == TYPE_PACKED_INT || (section & TYPE_MASK) == TYPE_PACKED_DEC)
+                && (section & VALUE_MASK) > i) {
+                // Count the elements of packed arrays as numbers.
+                uint64_t element_type = (section & TYPE_MASK) == TYPE_PACKED_INT ? TYPE_INT : TYPE_DEC;
+                stats[element_type >> 60] += (section & VALUE_MASK) - i - 1;
+                i = (section & VALUE_MASK) - 1;
+            }
         }
         printf("integer: %10llu\n", stats[TYPE_INT >> 60]);
+        printf("unsigned:%10llu\n", static_cast<unsigned long long int>(stats[TYPE_UINT >> 60]));
         printf("decimal: %10llu\n", stats[TYPE_DEC >> 60]);
+        printf("raw:     %10llu\n", static_cast<unsigned long long int>(stats[TYPE_RAW_NUMBER >> 60]));
         printf("string:  %10llu\n", stats[TYPE_STR >> 60]);
+        printf("key:     %10llu\n", static_cast<unsigned long long int>(stats[TYPE_KEY >> 60]));
         printf("object:  %10llu\n", stats[TYPE_OBJ >> 60] / 2);
         printf("array:   %10llu\n", stats[TYPE_ARR >> 60] / 2);
+        printf("packed:  %10llu\n",
+               static_cast<unsigned long long int>(stats[TYPE_PACKED_INT >> 60] + stats[TYPE_PACKED_DEC >> 60]) / 2);
         printf("null:    %10llu\n", stats[TYPE_NULL >> 60]);
         printf("true:    %10llu\n", stats[TYPE_TRUE >> 60]);
         printf("false:   %10llu\n", stats[TYPE_FALSE >> 60]);
@@ -3,18 +3,46 @@
 
 #include <immintrin.h>
 #include <stdio.h>
+#include <string.h>
 #include <atomic>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "mercuryparser.h"
+#include "parsenumber.h"
+#include "symbol_table.h"
 #include "utils.h"
 
 
 namespace MercuryJson {
 
+    class CsvWriter;
+
+    // Contiguous elements of a packed array on the tape. Packing creates the elements as `T` objects in place of the
+    // tape words, so `data` can be handed to code working on plain `const int64_t *` or `const double *` arrays.
+    template <typename T>
+    struct ArraySpan {
+        const T *data;
+        size_t size;
+
+        inline const T *begin() const { return data; }
+        inline const T *end() const { return data + size; }
+        inline const T &operator[](size_t idx) const { return data[idx]; }
+    };
+
     class Tape {
         static const uint64_t TYPE_MASK = 0xf000000000000000;
         static const uint64_t VALUE_MASK = ~TYPE_MASK;
         static const uint64_t TYPE_JUMP = 0x8000000000000000;  // skip empty tape positions when merging
+        // With lazy strings, string offsets are tagged with whether the string contains escapes, and whether it has
+        // been unescaped in place since.
+        static const uint64_t STR_ESCAPED = 0x0800000000000000;
+        static const uint64_t STR_DECODED = 0x0400000000000000;
+        static const uint64_t STR_OFFSET_MASK = 0x03ffffffffffffff;
 
         uint64_t *tape;
         // Numerals are also stored off-tape, in the `numeric` array, at the same offset as the structural character.
@@ -23,6 +51,33 @@ namespace MercuryJson {
         uint64_t *numeric;
         char *literals;
         size_t tape_size, literals_size, numeric_size;
+        size_t capacity;
+        // When interning keys, object keys are stored on tape as ids into `symbols` instead of strings.
+        SymbolTable symbols;
+        bool intern_keys;
+        // Outputs of stage 1 about strings, only set during `state_machine`. `escaped_strings` is only set when parsing
+        // strings lazily.
+        Stage1Strings strings;
+        bool lazy_strings;
+        // Whether numbers out of range are stored as `TYPE_RAW_NUMBER` instead of failing.
+        bool raw_big_numbers;
+        // Whether arrays of numbers are packed, when numbers are parsed inline.
+        bool pack_numeric_arrays;
+        // Whether numbers are parsed in batches of four.
+        bool batch_numbers;
+        // When numbers are parsed by dedicated threads, each segment of the state machine lists the structural
+        // indices of its numbers in `number_list`, and the lists are given by `number_lists` as pairs of (offset in
+        // `number_list`, number of numbers).
+        size_t *number_list;
+        std::vector<std::pair<size_t, size_t>> number_lists;
+
+        // How the state machine parses numbers: as they are found, by dedicated threads afterwards, or in batches.
+        enum class NumberMode { kInline, kDeferred, kBatched };
+        // Numbers found by the state machine and not parsed yet, when batching numbers.
+        struct NumberBatch {
+            size_t offsets[4], tape_idxs[4], numeric_idxs[4];
+            size_t size = 0;
+        };
 
         //@formatter:off
         inline void write_null() { write_null(tape_size++); }
@@ -57,6 +112,10 @@ namespace MercuryJson {
             tape[offset] = TYPE_STR | literal_idx;
         }
 
+        inline void write_key(size_t offset, uint64_t key_id) {
+            tape[offset] = TYPE_KEY | key_id;
+        }
+
         inline void write_array(size_t idx1, size_t idx2) {
             tape[idx1] = TYPE_ARR | idx2;
             tape[idx2] = TYPE_ARR | idx1;
@@ -101,16 +160,106 @@ namespace MercuryJson {
         }
 
         void _parse_and_write_number(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx);
-        void __parse_and_write_number_backoff(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx);
+        // Rewrite the array from `left_tape_idx` to `right_tape_idx` as a packed array if all its elements are
+        // numbers, or write it as a regular array. The elements of an array crossing thread segments are moved
+        // together, and a jump skips the rest of the array.
+        void _pack_numeric_array(size_t left_tape_idx, size_t right_tape_idx);
+        // Pack the arrays of a finished tape, once all numbers are parsed.
+        void _pack_numeric_arrays();
         void __parse_and_write_number_fast(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx);
-        size_t _parse_str(char *input, size_t idx);
+        // Write the number at `input[offset]`, which does not fit into 64 bits or a double, as a raw number, or fail
+        // with `message` if raw numbers are disabled.
+        void _write_big_number(const char *input, size_t offset, size_t tape_idx, size_t numeric_idx,
+                               const char *message);
+        // Record the tape offset of a number for the number parsing threads, and list it at `list_idx`.
+        inline void _write_deferred_number(size_t tape_idx, size_t numeric_idx, size_t list_idx) {
+            tape[tape_idx] = numeric_idx;
+            numeric[numeric_idx] = tape_idx;
+            number_list[list_idx] = numeric_idx;
+        }
 
-        void _thread_parse_str(size_t pid, char *input, const size_t *idx_ptr, size_t structural_size);
-        void _thread_parse_num(size_t pid, char *input, const size_t *idx_ptr, size_t structural_size);
+        // Parse the string starting at `input[idx]` ("), which is structural character `idx_offset`, and return the
+        // offset of the parsed string in `literals`.
+        template <bool kParseStrInline>
+        size_t _parse_str(char *input, size_t idx, size_t idx_offset);
+        // Intern the object key starting at `input[idx]` (") and followed by the colon at `input[colon_idx]`.
+        size_t _intern_key(const char *input, size_t idx, size_t colon_idx, SymbolTable::Cache *cache);
+
+        void _thread_parse_str(size_t pid, size_t num_threads, char *input, const size_t *idx_ptr,
+                               size_t structural_size);
+        // Parse the four numbers of a full batch, at once where possible.
+        void _parse_and_write_numbers_x4(const char *input, const NumberBatch &batch);
+        // Add the number at `input[offset]` to the batch, or parse it right away if it is too long for batches, as
+        // told by the offset of the next structural character.
+        inline void _batch_number(NumberBatch *batch, const char *input, size_t offset, size_t next_offset,
+                                  size_t tape_idx, size_t numeric_idx) {
+            if (next_offset - offset > kBatchMaxLength) {
+                __parse_and_write_number_fast(input, offset, tape_idx, numeric_idx);
+                return;
+            }
+            batch->offsets[batch->size] = offset;
+            batch->tape_idxs[batch->size] = tape_idx;
+            batch->numeric_idxs[batch->size] = numeric_idx;
+            if (++batch->size == 4) {
+                _parse_and_write_numbers_x4(input, *batch);
+                batch->size = 0;
+            }
+        }
 
+        // Parse the deferred numbers from `begin` to `end`, counted over all of `number_lists`.
+        void _thread_parse_num(const char *input, const size_t *idx_ptr, size_t begin, size_t end);
+
+        // The state machine is specialized on whether strings are parsed inline, or deferred to dedicated threads, on
+        // how numbers are parsed, and on whether object keys are interned.
+        template <bool kParseStrInline, NumberMode kNumberMode, bool kInternKeys>
         void _thread_state_machine(char *input, const size_t *indices, size_t idx_begin, size_t idx_end,
                                    struct TapeStack *stack, size_t *tape_end, bool start_unknown = false);
 
+        using SegmentParser = void (Tape::*)(char *, const size_t *, size_t, size_t, struct TapeStack *, size_t *,
+                                             bool);
+        void _parallel_state_machine(char *input, const size_t *idx_ptr, size_t structural_size, size_t num_threads,
+                                     SegmentParser parse_segment);
+        // Merge the segment summarized by `right` into the adjacent segment summarized by `left`, which ends at
+        // structural index `boundary`.
+        void _merge_segments(const char *input, const size_t *idx_ptr, size_t structural_size, size_t boundary,
+                             struct TapeStack *left, struct TapeStack *right);
+
+        // Index of the first entry from `tape_idx` on that is not a jump.
+        inline size_t _skip_jumps(size_t tape_idx) const {
+            while ((tape[tape_idx] & TYPE_MASK) == TYPE_JUMP) tape_idx += tape[tape_idx] & VALUE_MASK;
+            return tape_idx;
+        }
+        // Index of the entry following the value starting at `tape_idx`.
+        inline size_t _value_end(size_t tape_idx) const {
+            uint64_t section = tape[tape_idx];
+            uint64_t type = section & TYPE_MASK;
+            if (type == TYPE_OBJ || type == TYPE_ARR || type == TYPE_PACKED_INT || type == TYPE_PACKED_DEC)
+                return (section & VALUE_MASK) + 1;
+            return tape_idx + 1;
+        }
+        // Number of entries of the array or object starting at `tape_idx`, counting keys and values separately.
+        size_t _count_entries(size_t tape_idx) const;
+        // Tape indices of the entries of the array or object starting at `tape_idx`: its elements, or its keys and
+        // values in turn.
+        std::vector<size_t> _entries(size_t tape_idx) const;
+        // First element of part `part` when splitting the elements of the array or object starting at `tape_idx`,
+        // with entries `entry_idxs` and `stride` entries per element, into `num_parts` parts of about the same length
+        // of tape.
+        size_t _split_elements(size_t tape_idx, const std::vector<size_t> &entry_idxs, size_t stride, size_t part,
+                               size_t num_parts) const;
+        // NUL-terminated contents of the string or interned key at `tape_idx`, for the DOM.
+        const char *_dom_string(size_t tape_idx);
+        // Build the DOM value starting at or jumped to from `*tape_idx`, allocated from `allocator`, and advance
+        // `*tape_idx` past it.
+        JsonValue _to_dom_value(BlockAllocator<JsonValue> &allocator, size_t *tape_idx);
+        // Encode the value starting at or jumped to from `*tape_idx` with `encoder`, and advance `*tape_idx` past it.
+        template <typename Encoder>
+        void _encode_value(Encoder *encoder, size_t *tape_idx);
+        template <typename Encoder>
+        void _transcode(std::vector<uint8_t> *output, const ParserOptions &options);
+        // Write the value at `tape_idx` as a field of `writer`.
+        void _write_csv_field(CsvWriter *writer, size_t tape_idx);
+
     public:
         static const uint64_t TYPE_NULL = 0xf000000000000000;
         static const uint64_t TYPE_FALSE = 0x1000000000000000;
@@ -120,32 +269,115 @@ namespace MercuryJson {
         static const uint64_t TYPE_DEC = 0x5000000000000000;
         static const uint64_t TYPE_OBJ = 0x6000000000000000;
         static const uint64_t TYPE_ARR = 0x7000000000000000;
+        static const uint64_t TYPE_KEY = 0x9000000000000000;  // object key interned in the symbol table
+        static const uint64_t TYPE_UINT = 0xa000000000000000;  // integer above INT64_MAX
+        static const uint64_t TYPE_RAW_NUMBER = 0xb000000000000000;  // number out of range, kept as its source text
+        // Arrays of numbers can be packed: the opening and closing entries hold the same offsets as those of regular
+        // arrays, and each element is stored on the tape in between, as an int64_t or a double.
+        static const uint64_t TYPE_PACKED_INT = 0xc000000000000000;
+        static const uint64_t TYPE_PACKED_DEC = 0xd000000000000000;
+
+        static const size_t kNotFound = static_cast<size_t>(-1);
 
         Tape(size_t string_size, size_t structural_size) {
+            capacity = structural_size;
+#if NUMA_AWARE
+            // Each segment of the tape is first written by the worker parsing it, so pages stay on its node.
+            tape = untouched_malloc<uint64_t>(structural_size);
+            numeric = untouched_malloc<uint64_t>(structural_size);
+#else
             tape = aligned_malloc<uint64_t>(structural_size);
             numeric = aligned_malloc<uint64_t>(structural_size);
+#endif
 #if !TAPE_STATE_MACHINE
             literals = static_cast<char *>(aligned_malloc(string_size + kAlignmentSize));
 #endif
             tape_size = 0;
             literals_size = 0;
             numeric_size = 0;
+            intern_keys = false;
+            lazy_strings = false;
+            raw_big_numbers = false;
+            batch_numbers = false;
+            number_list = nullptr;
+            pack_numeric_arrays = false;
         }
 
         ~Tape() {
+#if NUMA_AWARE
+            untouched_free(tape, capacity);
+            untouched_free(numeric, capacity);
+#else
             aligned_free(tape);
+            aligned_free(numeric);
+#endif
 #if !TAPE_STATE_MACHINE
             aligned_free(literals);
 #endif
-            aligned_free(numeric);
+            if (number_list != nullptr) aligned_free(number_list);
         }
 
         friend class TapeWriter;
 
+        inline const SymbolTable &get_symbol_table() const { return symbols; }
+
+        // Tape index of the value of key `key_id` in the object starting at tape index `tape_idx`, or `kNotFound` if
+        // the object has no such key. Keys must be interned.
+        size_t find_field(size_t tape_idx, size_t key_id) const;
+
+        // Contents of the string at tape index `tape_idx`. With lazy strings, escaped strings are unescaped in place
+        // on first access, so this must not be called concurrently for the same string.
+        std::string_view get_string(size_t tape_idx);
+
+        // Elements of the packed array at tape index `tape_idx`, of `int64_t` or `double`, or an empty span if the
+        // value is not a packed array of `T`. With `pack_numeric_arrays`, every non-empty array of numbers is packed,
+        // whatever the number mode and thread counts, except arrays holding integers above INT64_MAX or raw numbers,
+        // and arrays mixing decimals with integers beyond 2^53, which cannot be held exactly as doubles.
+        template <typename T>
+        ArraySpan<T> get_array_span(size_t tape_idx) const {
+            static_assert(std::is_same_v<T, int64_t> || std::is_same_v<T, double>,
+                          "packed arrays hold int64_t or double elements");
+            uint64_t section = tape[tape_idx];
+            if ((section & TYPE_MASK) != (std::is_same_v<T, int64_t> ? TYPE_PACKED_INT : TYPE_PACKED_DEC))
+                return {nullptr, 0};
+            const T *data = std::launder(reinterpret_cast<const T *>(tape + tape_idx + 1));
+            return {data, (section & VALUE_MASK) - tape_idx - 1};
+        }
+
+        // Source text of the raw number at tape index `tape_idx`.
+        std::string_view get_raw_number(size_t tape_idx) const;
+
+        // Build a DOM of the document from the tape, allocated from `allocator`. The elements of the root array or
+        // object are split by tape position between `ParserOptions::to_dom_num_threads` threads, each allocating from
+        // its own fork of `allocator`. Strings point into the literals, so the tape and its input must outlive the DOM;
+        // with lazy strings, unescaped strings are NUL-terminated in place of their closing quote. Elements of packed
+        // arrays keep the type they are packed as. Integers above INT64_MAX and raw numbers have no DOM
+        // representation and fail.
+        JsonValue to_dom(BlockAllocator<JsonValue> &allocator, const ParserOptions &options = ParserOptions());
+
+        // Encode the document as MessagePack or CBOR into `output`, replacing its contents. Like every container, the
+        // root array or object is encoded with its number of elements first, so its elements can be encoded by
+        // `ParserOptions::export_num_threads` threads into separate buffers, which are then appended in order. Raw
+        // numbers have no representation in these formats and fail.
+        void to_msgpack(std::vector<uint8_t> *output, const ParserOptions &options = ParserOptions());
+        void to_cbor(std::vector<uint8_t> *output, const ParserOptions &options = ParserOptions());
+
+        // Export the document, an array of flat objects, as CSV into `output`, replacing its contents: a header row
+        // of `columns`, then a row per object with the values of these keys, left empty for missing keys and nulls.
+        // Without `columns`, the columns are the keys of all objects in order of first appearance, which takes a
+        // sequential pass over the keys. Fields are quoted when needed; with a tab as `separator`, the output is TSV
+        // instead, with tabs, line breaks and backslashes escaped by a backslash. Rows are split between
+        // `ParserOptions::export_num_threads` threads, each writing into its own buffer, which are then appended in
+        // order. Nested arrays and objects have no representation and fail.
+        void to_csv(std::string *output, const std::vector<std::string> &columns = {}, char separator = ',',
+                    const ParserOptions &options = ParserOptions());
+
         size_t print_json(size_t tape_idx = 0, size_t indent = 0);
         void print_tape();
 
-        void state_machine(char *input, size_t *idx_ptr, size_t structural_size);
+        // `strings` holds the optional outputs of stage 1 about strings (`JSON::get_stage1_strings`).
+        void state_machine(char *input, size_t *idx_ptr, size_t structural_size,
+                           const ParserOptions &options = ParserOptions(), const Stage1Strings &strings = {});
 
         void components_analysis();
     };
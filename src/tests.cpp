@@ -8,16 +8,33 @@
 #include <time.h>
 
 #include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 
-// Ugly workaround to test private methods.
+// Ugly workaround to test private methods. Every standard header used by the headers below must be included before
+// this, as the macros would otherwise rewrite the standard library as well.
 #define private public
 #define class struct
 
+#include "json_writer.h"
 #include "mercuryparser.h"
+#include "parsenumber.h"
 #include "parsestring.h"
 #include "tape.h"
 #include "utils.h"
@@ -175,6 +192,23 @@ void test_parse_str_per_bit() {
     std::cout << std::endl;
 }
 
+void test_parse_str_unicode() {
+    const char *text = R"("caf\u00e9 \u4e2d\u6587 \ud83d\ude00 \u0041\u005C\u0022, surrogate pair: \uD834\uDD1E!")";
+    const char *expected = "caf\xc3\xa9 \xe4\xb8\xad\xe6\x96\x87 \xf0\x9f\x98\x80 A\\\", surrogate pair: \xf0\x9d\x84\x9e!";
+    std::cout << "Original:" << std::endl << text << std::endl;
+    char naive[256], avx[256], per_bit[256];
+    strcpy(naive, text);
+    strcpy(avx, text);
+    parse_str_naive(naive + 1);
+    parse_str_avx(avx + 1);
+    parse_str_per_bit(text + 1, per_bit);
+    std::cout << "Parsed: " << std::endl << avx + 1 << std::endl;
+    if (strcmp(naive + 1, expected) != 0) std::cout << "parse_str_naive incorrect" << std::endl;
+    if (strcmp(avx + 1, expected) != 0) std::cout << "parse_str_avx incorrect" << std::endl;
+    if (strcmp(per_bit, expected) != 0) std::cout << "parse_str_per_bit incorrect" << std::endl;
+    std::cout << std::endl;
+}
+
 char *generate_random_string(size_t length) {
     char *text = aligned_malloc(length);
     char *base = text;
@@ -272,6 +306,139 @@ void test_parse_float() {
 #undef FLOAT_VAL
 }
 
+void test_parse_integer_range() {
+    struct Case { const char *text; uint64_t type, value; };
+    const Case cases[] = {
+            {"9223372036854775807 ", Tape::TYPE_INT, 9223372036854775807ULL},
+            {"-9223372036854775808 ", Tape::TYPE_INT, 9223372036854775808ULL},
+            {"9223372036854775808 ", Tape::TYPE_UINT, 9223372036854775808ULL},
+            {"18446744073709551615 ", Tape::TYPE_UINT, 18446744073709551615ULL},
+            {"18446744073709551616 ", Tape::TYPE_RAW_NUMBER, 0},
+            {"-9223372036854775809 ", Tape::TYPE_RAW_NUMBER, 0},
+            {"29999999999999999999 ", Tape::TYPE_RAW_NUMBER, 0},
+            {"1e400 ", Tape::TYPE_RAW_NUMBER, 0},
+    };
+    bool passed = true;
+    Tape tape(0, 1);
+    tape.raw_big_numbers = true;
+    for (const Case &c : cases) {
+        tape.literals = const_cast<char *>(c.text);
+        tape._parse_and_write_number(c.text, 0, 0, 0);
+        uint64_t type = tape.tape[0] & Tape::TYPE_MASK;
+        bool ok = type == c.type && (type == Tape::TYPE_RAW_NUMBER
+                                     ? tape.get_raw_number(0) == std::string_view(c.text, strlen(c.text) - 1)
+                                     : tape.numeric[0] == c.value);
+        if (!ok) {
+            printf("test_parse_integer_range: incorrect result for %s\n", c.text);
+            passed = false;
+        }
+    }
+    bool is_decimal;
+    if (static_cast<uint64_t>(parse_number("-9223372036854775808", &is_decimal)) != 9223372036854775808ULL) {
+        printf("test_parse_integer_range: incorrect result for INT64_MIN\n");
+        passed = false;
+    }
+    if (passed) printf("test_parse_integer_range: passed\n");
+}
+
+void test_parse_decimal_range() {
+    // Decimals are out of range when they overflow, or underflow to zero; subnormal values are in range, whatever the
+    // exponent as written. The DOM and the tape must agree on both.
+    struct Case { const char *text; bool in_range; };
+    const Case cases[] = {
+            {"1e-310 ", true}, {"5e-324 ", true}, {"1000e-310 ", true}, {"0.001e309 ", true},
+            {"1.7976931348623157e308 ", true}, {"0e999999 ", true}, {"-2.5e-320 ", true},
+            {"1e309 ", false}, {"2e308 ", false}, {"1e-400 ", false}, {"-3e-330 ", false}, {"1e99999999999 ", false},
+            // More than 19 digits, with mantissas that wrap around to zero modulo 2^64.
+            {"0.000000000000000000000000e5 ", true}, {"18446744073709551616e-400 ", false},
+            {"-368934881474.19103232e-390 ", false},
+    };
+    bool passed = true;
+    Tape tape(0, 1);
+    tape.raw_big_numbers = true;
+    for (const Case &c : cases) {
+        double expected = strtod(c.text, nullptr);
+        bool is_decimal, dom_in_range = true;
+        double dom_value = 0;
+        try {
+            dom_value = plain_convert(parse_number(c.text, &is_decimal));
+        } catch (std::exception &) {
+            dom_in_range = false;
+        }
+        tape.literals = const_cast<char *>(c.text);
+        tape._parse_and_write_number(c.text, 0, 0, 0);
+        bool tape_in_range = (tape.tape[0] & Tape::TYPE_MASK) == Tape::TYPE_DEC;
+        bool ok = dom_in_range == c.in_range && tape_in_range == c.in_range;
+        if (ok && c.in_range) {
+            ok = dom_value == expected && plain_convert(static_cast<long long int>(tape.numeric[0])) == expected;
+        }
+        if (!ok) {
+            printf("test_parse_decimal_range: incorrect result for %s\n", c.text);
+            passed = false;
+        }
+    }
+    if (passed) printf("test_parse_decimal_range: passed\n");
+}
+
+void test_parse_numbers_batch() {
+    // Numbers, and whether they are simple enough to be parsed in batches.
+    struct Case { const char *text; bool batched; };
+    const Case cases[] = {
+            {"0,", true}, {"-7]", true}, {"123456789012345 ", true}, {"-0.5}", true},
+            {"3.1415926535897,", true}, {"1e5,", false}, {"0012,", false}, {"-123456.7890123\n", true},
+            {"1234567890123456,", false}, {"2.,", false}, {"-,", false}, {"99.99]", true},
+    };
+    const size_t num_cases = sizeof(cases) / sizeof(cases[0]);
+    static_assert(num_cases % 4 == 0);
+    char input[num_cases * 32];
+    size_t offsets[num_cases];
+    memset(input, ' ', sizeof(input));
+    for (size_t i = 0; i < num_cases; ++i) {
+        offsets[i] = i * 32;
+        memcpy(input + offsets[i], cases[i].text, strlen(cases[i].text));
+    }
+    bool passed = true;
+    for (size_t i = 0; i < num_cases; i += 4) {
+        uint64_t values[4];
+        unsigned decimal_mask;
+        unsigned parsed = parse_numbers_x4(input, offsets + i, values, &decimal_mask);
+        for (size_t j = 0; j < 4; ++j) {
+            const Case &c = cases[i + j];
+            if (static_cast<bool>(parsed & (1U << j)) != c.batched) {
+                printf("test_parse_numbers_batch: %s should%s be parsed in batches\n", c.text, c.batched ? "" : " not");
+                passed = false;
+                continue;
+            }
+            if (!c.batched) continue;
+            bool is_decimal;
+            long long int expected = parse_number(input, &is_decimal, offsets[i + j]);
+            if (is_decimal != static_cast<bool>(decimal_mask & (1U << j))
+                || static_cast<uint64_t>(expected) != values[j]) {
+                printf("test_parse_numbers_batch: incorrect result for %s\n", c.text);
+                passed = false;
+            }
+        }
+    }
+    if (passed) printf("test_parse_numbers_batch: passed\n");
+}
+
+void test_minify() {
+    // Spans several blocks, with whitespace and escaped quotes within strings, and strings across blocks.
+    std::string text, expected;
+    for (int i = 0; i < 10; ++i) {
+        text += "{ \"key \\\" \" :\t[ 1 ,\n\r \"  spaced   out  \" ] }\n";
+        expected += "{\"key \\\" \":[1,\"  spaced   out  \"]}";
+    }
+    char *output = aligned_malloc(text.size());
+    size_t len = minify(text.c_str(), text.size(), output);
+    bool passed = std::string(output, len) == expected;
+    // In place.
+    len = minify(text.data(), text.size(), text.data());
+    passed = passed && text.substr(0, len) == expected;
+    aligned_free(output);
+    printf("test_minify: %s\n", passed ? "passed" : "failed");
+}
+
 void test_translate() {
     const char *s = R"(/0"1\2b3f4n5r6t7t8r9nAfBbC\D"E/F)";
     __m256i input = Warp(s).lo;
@@ -313,3 +480,681 @@ void test_tape(const char *filename) {
     // tape.print_tape();
     tape.print_json();
 }
+
+// Parse `text` into `tape` with `options`.
+static void __parse_tape(const std::string &text, Tape *tape, const ParserOptions &options, char *input) {
+    // Stage 1 reads whole blocks, so the padding must not hold leftovers of a previous text.
+    memcpy(input, text.c_str(), text.size());
+    memset(input + text.size(), 0, 2 * kAlignmentSize);
+    JSON json(input, text.size(), true, options);
+    json.exec_stage1();
+    tape->state_machine(input, json.indices, json.num_indices, options, json.get_stage1_strings());
+}
+
+void test_deferred_numbers() {
+    // A number-heavy document, with strings in between so that number and string threads run at the same time.
+    std::string text = "[";
+    srand(618);
+    for (int i = 0; i < 20000; ++i) {
+        if (i > 0) text += ",";
+        char number[64];
+        switch (rand() % 5) {
+            case 0: snprintf(number, sizeof(number), "%d", rand() - RAND_MAX / 2); break;
+            case 1: snprintf(number, sizeof(number), "%.6f", (rand() - RAND_MAX / 2) / 1000.0); break;
+            case 2: snprintf(number, sizeof(number), "%.17g", rand() / 3.0 * 1e-20); break;
+            case 3:
+                snprintf(number, sizeof(number), "%d%09d%09d", rand() % 9 + 1, rand() % 1000000000,
+                         rand() % 1000000000);
+                break;
+            default: snprintf(number, sizeof(number), "{\"x\\ty\": [%d, \"s%d\"]}", rand() % 1000, rand());
+        }
+        text += number;
+    }
+    text += "]";
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+
+    bool passed = true;
+    for (size_t tape_num_threads : {1, 3}) {
+        ParserOptions inline_options;
+        inline_options.tape_num_threads = tape_num_threads;
+        inline_options.parse_num_num_threads = 0;
+        Tape expected(text.size(), text.size());
+        __parse_tape(text, &expected, inline_options, input);
+        for (size_t parse_num_num_threads : {1, 2, 5}) {
+            for (bool batch_numbers : {false, true}) {
+                ParserOptions options = inline_options;
+                options.parse_num_num_threads = parse_num_num_threads;
+                options.batch_numbers = batch_numbers;
+                Tape tape(text.size(), text.size());
+                __parse_tape(text, &tape, options, input);
+                bool same = tape.tape_size == expected.tape_size;
+                for (size_t i = 0; same && i < tape.tape_size;) {
+                    uint64_t type = tape.tape[i] & Tape::TYPE_MASK, value = tape.tape[i] & Tape::VALUE_MASK;
+                    same = tape.tape[i] == expected.tape[i];
+                    if (same && (type == Tape::TYPE_INT || type == Tape::TYPE_UINT || type == Tape::TYPE_DEC))
+                        same = tape.numeric[value] == expected.numeric[value];
+                    // Tape positions skipped by jumps are left unwritten.
+                    i += type == Tape::TYPE_JUMP ? value : 1;
+                }
+                if (!same) {
+                    printf("test_deferred_numbers: different tape with %lu tape threads, %lu number threads%s\n",
+                           tape_num_threads, parse_num_num_threads, batch_numbers ? " in batches" : "");
+                    passed = false;
+                }
+            }
+        }
+    }
+    aligned_free(input);
+    if (passed) printf("test_deferred_numbers: passed\n");
+}
+
+static bool __dom_equal(const JsonValue &a, const JsonValue &b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case JsonValue::TYPE_NULL: return true;
+        case JsonValue::TYPE_BOOL: return a.boolean == b.boolean;
+        case JsonValue::TYPE_STR: return strcmp(a.str, b.str) == 0;
+        case JsonValue::TYPE_INT: return a.integer == b.integer;
+        case JsonValue::TYPE_DEC: return a.decimal == b.decimal;
+        case JsonValue::TYPE_ARR:
+            if (a.array->size != b.array->size) return false;
+            for (size_t i = 0; i < a.array->size; ++i)
+                if (!__dom_equal((*a.array)[i], (*b.array)[i])) return false;
+            return true;
+        case JsonValue::TYPE_OBJ:
+            if (a.object->size != b.object->size) return false;
+            for (size_t i = 0; i < a.object->size; ++i) {
+                const JsonMember &x = (*a.object)[i], &y = (*b.object)[i];
+                if (strcmp(x.key, y.key) != 0 || !__dom_equal(x.value, y.value)) return false;
+            }
+            return true;
+    }
+    return false;
+}
+
+void test_packed_arrays() {
+    std::string text = "{\"i\": [1, -2, 9223372036854775807], \"d\": [1, 2.5, -3e2], \"m\": [1, \"x\"], \"e\": [], "
+                       "\"b\": [9007199254740993, 0.5]}";
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    ParserOptions options;
+    options.parse_num_num_threads = 0;
+    options.pack_numeric_arrays = true;
+    Tape tape(text.size(), text.size());
+    __parse_tape(text, &tape, options, input);
+
+    std::vector<ArraySpan<int64_t>> int_spans;
+    std::vector<ArraySpan<double>> dec_spans;
+    std::vector<uint64_t> types;
+    auto skip_jumps = [&tape](size_t idx) {
+        while ((tape.tape[idx] & Tape::TYPE_MASK) == Tape::TYPE_JUMP) idx += tape.tape[idx] & Tape::VALUE_MASK;
+        return idx;
+    };
+    for (size_t i = skip_jumps(1); i < tape.tape_size - 1; i = skip_jumps(i)) {
+        // Values follow their keys.
+        size_t value_idx = skip_jumps(i + 1);
+        uint64_t section = tape.tape[value_idx];
+        types.push_back(section & Tape::TYPE_MASK);
+        int_spans.push_back(tape.get_array_span<int64_t>(value_idx));
+        dec_spans.push_back(tape.get_array_span<double>(value_idx));
+        i = (section & Tape::VALUE_MASK) + 1;
+    }
+    bool passed = types.size() == 5;
+    passed = passed && types[0] == Tape::TYPE_PACKED_INT && int_spans[0].size == 3 && int_spans[0][0] == 1 &&
+             int_spans[0][1] == -2 && int_spans[0][2] == INT64_MAX && dec_spans[0].data == nullptr;
+    passed = passed && types[1] == Tape::TYPE_PACKED_DEC && dec_spans[1].size == 3 && dec_spans[1][0] == 1.0 &&
+             dec_spans[1][1] == 2.5 && dec_spans[1][2] == -300.0 && int_spans[1].data == nullptr;
+    // Arrays with other values, empty arrays, and integers that cannot be represented exactly as doubles next to
+    // decimals are left as regular arrays.
+    passed = passed && types[2] == Tape::TYPE_ARR && types[3] == Tape::TYPE_ARR && types[4] == Tape::TYPE_ARR;
+    passed = passed && int_spans[2].size == 0 && dec_spans[4].size == 0;
+    aligned_free(input);
+
+    // Arrays are packed whatever the number mode and thread counts, including arrays that cross thread segments.
+    std::string numbers_text = "[";
+    size_t num_numeric_arrays = 0;
+    srand(39);
+    for (int i = 0; i < 400; ++i) {
+        if (i > 0) numbers_text += ", ";
+        size_t size = i % 100 == 50 ? 2000 : rand() % 20;
+        bool decimals = rand() % 2 == 0;
+        if (i % 7 == 0) {
+            numbers_text += "{\"s\": \"x\", \"a\": [" + std::to_string(i) + ", [1.5, 2.5]]}";
+            ++num_numeric_arrays;
+            continue;
+        }
+        numbers_text += "[";
+        for (size_t j = 0; j < size; ++j) {
+            if (j > 0) numbers_text += ", ";
+            numbers_text += std::to_string(rand() - RAND_MAX / 2) + (decimals ? ".5" : "");
+        }
+        numbers_text += "]";
+        if (size > 0) ++num_numeric_arrays;
+    }
+    numbers_text += "]";
+    char *numbers_input = aligned_malloc(numbers_text.size() + 2 * kAlignmentSize);
+    memcpy(numbers_input, numbers_text.c_str(), numbers_text.size());
+    memset(numbers_input + numbers_text.size(), 0, 2 * kAlignmentSize);
+    BlockAllocator<JsonValue> expected_allocator(1024);
+    JSON expected(numbers_input, numbers_text.size(), expected_allocator);
+    for (size_t tape_num_threads : {1, 3, 4}) {
+        for (size_t parse_num_num_threads : {0, 2}) {
+            for (bool batch_numbers : {false, true}) {
+                ParserOptions options;
+                options.tape_num_threads = tape_num_threads;
+                options.parse_num_num_threads = parse_num_num_threads;
+                options.batch_numbers = batch_numbers;
+                options.pack_numeric_arrays = true;
+                Tape tape(numbers_text.size(), numbers_text.size());
+                __parse_tape(numbers_text, &tape, options, numbers_input);
+                size_t num_packed = 0;
+                for (size_t i = 0; i < tape.tape_size;) {
+                    uint64_t type = tape.tape[i] & Tape::TYPE_MASK, value = tape.tape[i] & Tape::VALUE_MASK;
+                    if (type == Tape::TYPE_JUMP) {
+                        i += value;
+                    } else if ((type == Tape::TYPE_PACKED_INT || type == Tape::TYPE_PACKED_DEC) && value > i) {
+                        size_t size = tape.get_array_span<int64_t>(i).size + tape.get_array_span<double>(i).size;
+                        passed = passed && size == value - i - 1;
+                        ++num_packed;
+                        i = value + 1;
+                    } else {
+                        ++i;
+                    }
+                }
+                BlockAllocator<JsonValue> allocator(1024);
+                JsonValue document = tape.to_dom(allocator, options);
+                if (num_packed != num_numeric_arrays || !__dom_equal(document, *expected.document)) {
+                    printf("test_packed_arrays: different arrays with %lu tape threads, %lu number threads%s\n",
+                           tape_num_threads, parse_num_num_threads, batch_numbers ? " in batches" : "");
+                    passed = false;
+                }
+            }
+        }
+    }
+    aligned_free(numbers_input);
+    printf("test_packed_arrays: %s\n", passed ? "passed" : "failed");
+}
+
+void test_intern_keys() {
+    std::string text = R"({"ab": 1, "a\u0062": 2, "x\ty": 3, "x\u0009y": 4})";
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    ParserOptions options;
+    options.tape_num_threads = 1;
+    options.intern_keys = true;
+    Tape tape(text.size(), text.size());
+    __parse_tape(text, &tape, options, input);
+
+    // Keys are interned by their unescaped content.
+    std::vector<uint64_t> key_ids;
+    for (size_t i = 0; i < tape.tape_size; ++i) {
+        if ((tape.tape[i] & Tape::TYPE_MASK) == Tape::TYPE_KEY) key_ids.push_back(tape.tape[i] & Tape::VALUE_MASK);
+    }
+    bool passed = key_ids.size() == 4 && key_ids[0] == key_ids[1] && key_ids[2] == key_ids[3] &&
+                  key_ids[0] != key_ids[2] && tape.symbols.size() == 2;
+    aligned_free(input);
+    printf("test_intern_keys: %s\n", passed ? "passed" : "failed");
+}
+
+void test_lazy_strings() {
+    std::string text = R"(["plain", "tab\tand \"quotes\"", {"k\\ey": "caf\u00e9"}, "\ud83d\ude00"])";
+    const char *expected[] = {"plain", "tab\tand \"quotes\"", "k\\ey", "caf\xc3\xa9", "\xf0\x9f\x98\x80"};
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    ParserOptions options;
+    options.tape_num_threads = 1;
+    options.lazy_strings = true;
+    options.string_masks = true;
+    Tape tape(text.size(), text.size());
+    // The JSON holding the masks of stage 1 is destroyed before any escaped string is decoded.
+    __parse_tape(text, &tape, options, input);
+
+    std::vector<std::string> strings;
+    for (size_t i = 0; i < tape.tape_size; ++i) {
+        if ((tape.tape[i] & Tape::TYPE_MASK) == Tape::TYPE_STR) strings.emplace_back(tape.get_string(i));
+    }
+    bool passed = tape.lazy_strings && strings.size() == std::size(expected);
+    for (size_t i = 0; passed && i < strings.size(); ++i) passed = strings[i] == expected[i];
+    aligned_free(input);
+    printf("test_lazy_strings: %s\n", passed ? "passed" : "failed");
+}
+
+void test_tape_to_dom() {
+    std::string text = "{";
+    srand(43);
+    for (int i = 0; i < 3000; ++i) {
+        if (i > 0) text += ",";
+        text += "\"k" + std::to_string(i % 50) + "\": ";
+        switch (rand() % 4) {
+            case 0: text += "[" + std::to_string(rand()) + ", 2.5, -3]"; break;
+            case 1: text += "{\"s\": \"a\\tb\", \"t\": [true, false, null, []], \"u\": {}}"; break;
+            case 2: text += "\"plain " + std::to_string(rand()) + "\""; break;
+            case 3: text += std::to_string(rand() - RAND_MAX / 2); break;
+        }
+    }
+    text += "}";
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    memcpy(input, text.c_str(), text.size());
+    memset(input + text.size(), 0, 2 * kAlignmentSize);
+    BlockAllocator<JsonValue> expected_allocator(1024);
+    JSON expected(input, text.size(), expected_allocator);
+
+    bool passed = true;
+    char *tape_input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    for (size_t to_dom_num_threads : {1, 2, 7}) {
+        for (bool lazy : {false, true}) {
+            ParserOptions options;
+            options.tape_num_threads = 3;
+            options.parse_str_num_threads = 0;
+            options.parse_num_num_threads = 0;
+            options.intern_keys = lazy;
+            options.lazy_strings = lazy;
+            options.to_dom_num_threads = to_dom_num_threads;
+            Tape tape(text.size(), text.size());
+            __parse_tape(text, &tape, options, tape_input);
+            BlockAllocator<JsonValue> allocator(1024);
+            JsonValue document = tape.to_dom(allocator, options);
+            passed = passed && __dom_equal(document, *expected.document);
+        }
+    }
+    aligned_free(tape_input);
+    aligned_free(input);
+    printf("test_tape_to_dom: %s\n", passed ? "passed" : "failed");
+}
+
+// Random nested values of at most `depth` levels, with empty containers at every level.
+static std::string __nested_json(int depth) {
+    switch (depth > 0 ? rand() % 6 : rand() % 3) {
+        case 0: return std::to_string(rand() % 1000 - 500);
+        case 1: return "\"s" + std::to_string(rand() % 100) + "\"";
+        case 2: return rand() % 2 ? "[]" : "{}";
+        case 3: return rand() % 2 ? "2.5" : "null";
+        case 4: {
+            std::string text = "[";
+            for (int i = rand() % 5; i >= 0; --i) text += __nested_json(depth - 1) + (i > 0 ? ", " : "");
+            return text + "]";
+        }
+        default: {
+            std::string text = "{";
+            for (int i = rand() % 5; i >= 0; --i)
+                text += "\"k" + std::to_string(i) + "\": " + __nested_json(depth - 1) + (i > 0 ? ", " : "");
+            return text + "}";
+        }
+    }
+}
+
+void test_shift_reduce() {
+    // The shift-reduce parser must build the same DOM as the recursive descent parser, with the document split between
+    // threads inside nested and empty containers.
+    std::vector<std::string> texts = {
+            "[]", "{}", "[[]]", "{\"a\": {}}", "[[], {}, [[]], [{}], {\"a\": []}]",
+            R"({"a": [], "b": {}, "c": [[], [{}], [1, [2, [3, {"d": [4.5, "x", null]}]]]], )"
+            R"("e": {"f": {"g": {"h": [true, false, {}, []]}}}, "i": [{"j": [], "k": {"l": []}}, 7, "s"]})"};
+    srand(44);
+    for (int i = 0; i < 20; ++i) texts.push_back(rand() % 2 ? "[" + __nested_json(6) + "]" : __nested_json(8));
+
+    bool passed = true;
+    for (const std::string &text : texts) {
+        char *expected_input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+        memcpy(expected_input, text.c_str(), text.size());
+        memset(expected_input + text.size(), 0, 2 * kAlignmentSize);
+        BlockAllocator<JsonValue> expected_allocator(1024);
+        JSON expected(expected_input, text.size(), expected_allocator, true);
+        expected.exec_stage1();
+        JsonValue expected_document = expected._parse_value<true>();
+
+        char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+        for (size_t shift_reduce_num_threads : {1, 2, 3, 4, 7}) {
+            memcpy(input, text.c_str(), text.size());
+            memset(input + text.size(), 0, 2 * kAlignmentSize);
+            ParserOptions options;
+            options.shift_reduce_num_threads = shift_reduce_num_threads;
+            BlockAllocator<JsonValue> allocator(1024);
+            JSON json(input, text.size(), allocator, true, options);
+            json.exec_stage1();
+            JsonValue *document = json._shift_reduce_parsing<true>();
+            if (!__dom_equal(*document, expected_document)) {
+                printf("test_shift_reduce: different DOM with %lu threads for %s\n", shift_reduce_num_threads,
+                       text.c_str());
+                passed = false;
+            }
+        }
+        aligned_free(input);
+        aligned_free(expected_input);
+    }
+    if (passed) printf("test_shift_reduce: passed\n");
+}
+
+void test_json_containers() {
+    // Arrays and objects built directly, then parsed, must keep their sizes and elements in order, also when empty and
+    // nested across many blocks of the allocator. The depth stays within the default stack of the shift-reduce parser.
+    const size_t kNumElements = 1000, kDepth = 400;
+    BlockAllocator<JsonValue> allocator(64);
+    bool passed = true;
+
+    JsonArray *array = JsonArray::allocate(allocator, kNumElements);
+    for (size_t i = 0; i < kNumElements; ++i) new(&(*array)[i]) JsonValue(static_cast<long long int>(i * 3));
+    JsonObject *object = JsonObject::allocate(allocator, kNumElements);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < kNumElements; ++i) keys.push_back("k" + std::to_string(i));
+    for (size_t i = 0; i < kNumElements; ++i)
+        new(&(*object)[i]) JsonMember(keys[i].c_str(), JsonValue(static_cast<double>(i) / 2));
+    passed = passed && array->size == kNumElements && object->size == kNumElements;
+    size_t count = 0;
+    for (JsonValue &value : *array) {
+        passed = passed && value.type == JsonValue::TYPE_INT && value.integer == static_cast<long long int>(count * 3);
+        ++count;
+    }
+    passed = passed && count == kNumElements;
+    count = 0;
+    for (JsonMember &member : *object) {
+        passed = passed && strcmp(member.key, keys[count].c_str()) == 0 && member.value.decimal == count / 2.0;
+        ++count;
+    }
+    passed = passed && count == kNumElements;
+    passed = passed && (*array)[kNumElements - 1].integer == static_cast<long long int>(kNumElements - 1) * 3;
+    passed = passed && (*object)[7].value.decimal == 3.5;
+
+    JsonArray *empty_array = JsonArray::allocate(allocator, 0);
+    JsonObject *empty_object = JsonObject::allocate(allocator, 0);
+    passed = passed && empty_array->size == 0 && empty_array->begin() == empty_array->end();
+    passed = passed && empty_object->size == 0 && empty_object->begin() == empty_object->end();
+
+    // Alternate arrays and objects of one element each, with an empty array at the bottom.
+    JsonValue nested(JsonArray::allocate(allocator, 0));
+    for (size_t depth = 0; depth < kDepth; ++depth) {
+        if (depth % 2) {
+            JsonObject *parent = JsonObject::allocate(allocator, 1);
+            new(&(*parent)[0]) JsonMember("a", nested);
+            nested = JsonValue(parent);
+        } else {
+            JsonArray *parent = JsonArray::allocate(allocator, 1);
+            new(&(*parent)[0]) JsonValue(nested);
+            nested = JsonValue(parent);
+        }
+    }
+    std::string text;
+    for (size_t depth = kDepth; depth-- > 0;) text += depth % 2 ? "{\"a\": " : "[";
+    text += "[]";
+    for (size_t depth = 0; depth < kDepth; ++depth) text += depth % 2 ? "}" : "]";
+
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    memcpy(input, text.c_str(), text.size());
+    memset(input + text.size(), 0, 2 * kAlignmentSize);
+    BlockAllocator<JsonValue> parsed_allocator(64);
+    JSON json(input, text.size(), parsed_allocator);
+    passed = passed && __dom_equal(*json.document, nested);
+    const JsonValue *value = json.document;
+    for (size_t depth = kDepth; depth-- > 0;) {
+        if (depth % 2) {
+            passed = passed && value->type == JsonValue::TYPE_OBJ && value->object->size == 1 &&
+                     strcmp((*value->object)[0].key, "a") == 0;
+            value = &(*value->object)[0].value;
+        } else {
+            passed = passed && value->type == JsonValue::TYPE_ARR && value->array->size == 1;
+            value = &(*value->array)[0];
+        }
+        if (!passed) break;
+    }
+    passed = passed && value->type == JsonValue::TYPE_ARR && value->array->size == 0;
+    aligned_free(input);
+
+    text = R"([[], {}, [1, 2, 3], {"a": 1, "b": [], "c": {}}, [[[]]]])";
+    input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    memcpy(input, text.c_str(), text.size());
+    memset(input + text.size(), 0, 2 * kAlignmentSize);
+    JSON small(input, text.size(), parsed_allocator);
+    JsonArray &elements = *small.document->array;
+    passed = passed && elements.size == 5 && elements[0].array->size == 0 && elements[1].object->size == 0;
+    passed = passed && elements[2].array->size == 3 && (*elements[2].array)[2].integer == 3;
+    JsonObject &members = *elements[3].object;
+    passed = passed && members.size == 3 && strcmp(members[1].key, "b") == 0 && members[1].value.array->size == 0 &&
+             strcmp(members[2].key, "c") == 0 && members[2].value.object->size == 0;
+    passed = passed && (*(*elements[4].array)[0].array)[0].array->size == 0;
+    aligned_free(input);
+    printf("test_json_containers: %s\n", passed ? "passed" : "failed");
+}
+
+void test_tape_transcode() {
+    std::string text = R"({"a": [1, -1, 300, -200, 70000, 1.5, true, false, null], "bb": {}, "s": "x\ty", )"
+                       R"("u": 18446744073709551615})";
+    const std::vector<uint8_t> expected_msgpack = {
+            0x84,
+            0xa1, 'a', 0x99, 0x01, 0xff, 0xcd, 0x01, 0x2c, 0xd1, 0xff, 0x38, 0xce, 0x00, 0x01, 0x11, 0x70,
+            0xcb, 0x3f, 0xf8, 0, 0, 0, 0, 0, 0, 0xc3, 0xc2, 0xc0,
+            0xa2, 'b', 'b', 0x80,
+            0xa1, 's', 0xa3, 'x', '\t', 'y',
+            0xa1, 'u', 0xcf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    const std::vector<uint8_t> expected_cbor = {
+            0xa4,
+            0x61, 'a', 0x89, 0x01, 0x20, 0x19, 0x01, 0x2c, 0x38, 0xc7, 0x1a, 0x00, 0x01, 0x11, 0x70,
+            0xfb, 0x3f, 0xf8, 0, 0, 0, 0, 0, 0, 0xf5, 0xf4, 0xf6,
+            0x62, 'b', 'b', 0xa0,
+            0x61, 's', 0x63, 'x', '\t', 'y',
+            0x61, 'u', 0x1b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+    bool passed = true;
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    for (size_t export_num_threads : {1, 2, 3}) {
+        for (bool lazy : {false, true}) {
+            ParserOptions options;
+            options.intern_keys = lazy;
+            options.lazy_strings = lazy;
+            options.export_num_threads = export_num_threads;
+            Tape tape(text.size(), text.size());
+            __parse_tape(text, &tape, options, input);
+            std::vector<uint8_t> output;
+            tape.to_msgpack(&output, options);
+            passed = passed && output == expected_msgpack;
+            tape.to_cbor(&output, options);
+            passed = passed && output == expected_cbor;
+        }
+    }
+    aligned_free(input);
+    printf("test_tape_transcode: %s\n", passed ? "passed" : "failed");
+}
+
+void test_tape_to_csv() {
+    std::string text = R"([{"id": 1, "name": "plain", "score": 2.5}, {"name": "a, \"quoted\"\nname", "extra": true}, )"
+                       R"({"id": -3, "name": "tab\tand\\backslash", "score": null}])";
+    const std::string expected_csv = "id,name,score,extra\n"
+                                     "1,plain,2.5,\n"
+                                     ",\"a, \"\"quoted\"\"\nname\",,true\n"
+                                     "-3,tab\tand\\backslash,,\n";
+    const std::string expected_tsv = "id\tname\tscore\textra\n"
+                                     "1\tplain\t2.5\t\n"
+                                     "\ta, \"quoted\"\\nname\t\ttrue\n"
+                                     "-3\ttab\\tand\\\\backslash\t\t\n";
+    const std::string expected_columns = "name,missing\n"
+                                         "plain,\n"
+                                         "\"a, \"\"quoted\"\"\nname\",\n"
+                                         "tab\tand\\backslash,\n";
+
+    bool passed = true;
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    for (size_t export_num_threads : {1, 2, 3}) {
+        for (bool lazy : {false, true}) {
+            ParserOptions options;
+            options.intern_keys = lazy;
+            options.lazy_strings = lazy;
+            options.export_num_threads = export_num_threads;
+            Tape tape(text.size(), text.size());
+            __parse_tape(text, &tape, options, input);
+            std::string output;
+            tape.to_csv(&output, {}, ',', options);
+            passed = passed && output == expected_csv;
+            tape.to_csv(&output, {}, '\t', options);
+            passed = passed && output == expected_tsv;
+            tape.to_csv(&output, {"name", "missing"}, ',', options);
+            passed = passed && output == expected_columns;
+        }
+    }
+    aligned_free(input);
+
+    // Fields of 256 bytes or more, with the characters to quote or escape in the first block of 32 bytes.
+    for (size_t length : {256, 260, 287, 300, 512}) {
+        std::string padding(length - 5, 'x');
+        std::string long_text = "[{\"csv\": \"a,b\\\"c" + padding + "\", \"tsv\": \"a\\tb\\nc\\\\" + padding + "\"}]";
+        std::string expected_long_csv = "csv,tsv\n\"a,b\"\"c" + padding + "\",\"a\tb\nc\\" + padding + "\"\n";
+        std::string expected_long_tsv = "csv\ttsv\na,b\"c" + padding + "\ta\\tb\\nc\\\\" + padding + "\n";
+        char *long_input = aligned_malloc(long_text.size() + 2 * kAlignmentSize);
+        ParserOptions options;
+        Tape tape(long_text.size(), long_text.size());
+        __parse_tape(long_text, &tape, options, long_input);
+        std::string output;
+        tape.to_csv(&output, {}, ',', options);
+        passed = passed && output == expected_long_csv;
+        tape.to_csv(&output, {}, '\t', options);
+        passed = passed && output == expected_long_tsv;
+        aligned_free(long_input);
+    }
+    printf("test_tape_to_csv: %s\n", passed ? "passed" : "failed");
+}
+
+void test_block_allocator() {
+    // Forked allocators outgrow their first block from several threads at once, while the parent allocates too.
+    const size_t kNumForks = 4, kNumValues = 100000;
+    BlockAllocator<JsonValue> allocator(64);
+    std::vector<BlockAllocator<JsonValue>> forks;
+    for (size_t i = 0; i < kNumForks; ++i) forks.push_back(allocator.fork(64));
+    std::vector<std::vector<JsonValue *>> values(kNumForks + 1);
+    auto fill = [&values](BlockAllocator<JsonValue> *thread_allocator, size_t thread_idx) {
+        for (size_t i = 0; i < kNumValues; ++i) {
+            if (i % 7 == 0) thread_allocator->allocate<char>(i % 1000 + 1);
+            values[thread_idx].push_back(thread_allocator->construct(static_cast<long long int>(thread_idx * i)));
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kNumForks; ++i) threads.emplace_back(fill, &forks[i], i + 1);
+    fill(&allocator, 0);
+    for (size_t i = 0; i < kNumForks; ++i) {
+        threads[i].join();
+        forks[i].join();
+    }
+    forks.clear();
+
+    bool passed = true;
+    for (size_t thread_idx = 0; thread_idx <= kNumForks; ++thread_idx)
+        for (size_t i = 0; i < kNumValues; ++i)
+            if (values[thread_idx][i]->integer != static_cast<long long int>(thread_idx * i)) passed = false;
+    printf("test_block_allocator: %s\n", passed ? "passed" : "failed");
+}
+
+void test_allocator_reset() {
+    BlockAllocator<JsonValue> allocator(64);
+    auto fill = [&allocator](size_t num_values) {
+        for (size_t i = 0; i < num_values; ++i) allocator.construct(static_cast<long long int>(i));
+    };
+    bool passed = true;
+    // The blocks used by a parse are replaced by a single block, which is then reused as is.
+    fill(100000);
+    allocator.reset();
+    size_t reserved_size = allocator.reserved_size();
+    JsonValue *first_value = allocator.construct();
+    passed = passed && reserved_size >= 100000 * sizeof(JsonValue);
+    fill(100000);
+    allocator.reset();
+    passed = passed && allocator.reserved_size() == reserved_size && allocator.construct() == first_value;
+    // A much smaller parse trims the block.
+    fill(1000);
+    allocator.reset();
+    passed = passed && allocator.reserved_size() < 100000 * sizeof(JsonValue);
+
+    // Blocks stop growing at `kMaxBlockSize` (64 MiB), and the block kept by a reset has at most that much to spare.
+    // The memory is never touched, so only address space is used.
+    const size_t kMaxBlockSize = 64 << 20, kUsedSize = 3 * kMaxBlockSize;
+    for (size_t i = 0; i < kUsedSize >> 20; ++i) allocator.allocate<char>(1 << 20);
+    passed = passed && allocator.reserved_size() <= kUsedSize + kMaxBlockSize + (1 << 20);
+    allocator.reset();
+    passed = passed && allocator.reserved_size() <= kUsedSize + kMaxBlockSize + (1 << 20);
+
+    // Documents parsed into the same allocator in turn.
+    std::string text = "{\"a\": [1, 2.5, \"x\", true, null], \"b\": {\"c\": -3}}";
+    char *input = aligned_malloc(text.size() + 2 * kAlignmentSize);
+    // Stage 1 reads whole blocks, so the padding must not hold leftovers of earlier allocations.
+    memset(input + text.size(), 0, 2 * kAlignmentSize);
+    for (int i = 0; i < 3; ++i) {
+        allocator.reset();
+        memcpy(input, text.c_str(), text.size() + 1);
+        JSON json(input, text.size(), allocator);
+        JsonObject &object = *json.document->object;
+        passed = passed && object.size == 2 && strcmp(object[0].key, "a") == 0 &&
+                 (*object[0].value.array)[1].decimal == 2.5 && (*object[1].value.object)[0].value.integer == -3;
+    }
+    aligned_free(input);
+    printf("test_allocator_reset: %s\n", passed ? "passed" : "failed");
+}
+
+void test_untouched_malloc() {
+    bool passed = true;
+    size_t *indices = untouched_malloc<size_t>(1024);
+    indices[1023] = 42;
+    passed = passed && indices[1023] == 42;
+    untouched_free(indices, 1024);
+    // Mappings that cannot be made throw instead of returning a pointer that callers would write to.
+    const size_t kHugeSize = static_cast<size_t>(1) << 62;
+    for (int i = 0; i < 2; ++i) {
+        try {
+            void *memblock = i == 0 ? __untouched_malloc(kHugeSize) : __huge_page_malloc(kHugeSize);
+            __untouched_free(memblock, kHugeSize);
+            passed = false;
+        } catch (const std::bad_alloc &) {}
+    }
+    printf("test_untouched_malloc: %s\n", passed ? "passed" : "failed");
+}
+
+void test_json_writer() {
+    JsonWriter writer;
+    // Long enough to escape characters in several blocks.
+    std::string escaped = "quote \" backslash \\ tab \t nul " + std::string(1, '\0') + " " + std::string(40, 'x') +
+                          "\n";
+    auto write = [&writer, &escaped]() {
+        writer.start_object();
+        writer.key("integers");
+        writer.start_array();
+        writer.value(0);
+        writer.value(-42);
+        writer.value(INT64_MIN);
+        writer.value(UINT64_MAX);
+        writer.end_array();
+        writer.key("decimals");
+        writer.start_array();
+        writer.value(0.1);
+        writer.value(3.0);
+        writer.value(-1e300);
+        writer.value(NAN);
+        writer.end_array();
+        writer.key("string");
+        writer.value(escaped);
+        writer.key("empty");
+        writer.start_object();
+        writer.end_object();
+        writer.key("literals");
+        writer.start_array();
+        writer.value(true);
+        writer.value(false);
+        writer.null_value();
+        writer.end_array();
+        writer.end_object();
+    };
+    std::string expected = "{\"integers\":[0,-42,-9223372036854775808,18446744073709551615],"
+                           "\"decimals\":[0.1,3.0,-1e+300,null],"
+                           "\"string\":\"quote \\\" backslash \\\\ tab \\t nul \\u0000 " + std::string(40, 'x') +
+                           "\\n\",\"empty\":{},\"literals\":[true,false,null]}";
+    write();
+    bool passed = writer.str() == expected;
+    // Messages written in turn reuse the buffer.
+    const char *data = writer.str().data();
+    writer.clear();
+    write();
+    passed = passed && writer.str() == expected && writer.str().data() == data;
+
+    JsonWriter pretty_writer(true);
+    pretty_writer.start_object();
+    pretty_writer.key("a");
+    pretty_writer.start_array();
+    pretty_writer.value(1);
+    pretty_writer.start_array();
+    pretty_writer.end_array();
+    pretty_writer.end_array();
+    pretty_writer.end_object();
+    passed = passed && pretty_writer.str() == "{\n  \"a\": [\n    1,\n    []\n  ]\n}";
+    printf("test_json_writer: %s\n", passed ? "passed" : "failed");
+}
@@ -13,14 +13,35 @@ void test_parse(bool print = false);
 void test_parse_str_naive();
 void test_parse_str_avx();
 void test_parse_str_per_bit();
+void test_parse_str_unicode();
 
 void test_parse_string();
 
 void test_parse_float();
+void test_parse_integer_range();
+void test_parse_decimal_range();
+void test_parse_numbers_batch();
+
+void test_minify();
 
 void test_translate();
 void test_remove_escaper();
 
 void test_tape(const char *filename);
+void test_deferred_numbers();
+void test_packed_arrays();
+void test_intern_keys();
+void test_lazy_strings();
+void test_tape_to_dom();
+void test_shift_reduce();
+void test_json_containers();
+void test_tape_transcode();
+void test_tape_to_csv();
+
+void test_block_allocator();
+void test_allocator_reset();
+void test_untouched_malloc();
+
+void test_json_writer();
 
 #endif // MERCURYJSON_TESTS_H
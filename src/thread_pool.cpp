@@ -0,0 +1,238 @@
+#include "thread_pool.h"
+
+#include <immintrin.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <utility>
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+#include "flags.h"
+
+
+namespace MercuryJson {
+
+    // Number of spin iterations before an idle worker goes to sleep. Phases are submitted in quick succession, so
+    // spinning briefly avoids paying the wake-up latency on every task.
+    static const size_t kSpinCount = 4096;
+
+    // CPUs this process may run on, as restricted by `taskset`, cgroups or container limits, in increasing order.
+    static std::vector<int> __allowed_cpus() {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &cpu_set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &cpu_set)) cpus.push_back(cpu);
+        }
+#endif
+        if (cpus.empty()) {
+            unsigned num_cpus = std::thread::hardware_concurrency();
+            for (unsigned cpu = 0; cpu < num_cpus; ++cpu) cpus.push_back(static_cast<int>(cpu));
+        }
+        return cpus;
+    }
+
+    // Allowed CPUs of each NUMA node, leaving out nodes with none. Without `NUMA_AWARE` (or on systems without NUMA
+    // information), all allowed CPUs are treated as a single node.
+    static std::vector<std::vector<int>> __read_numa_topology(const std::vector<int> &allowed_cpus) {
+        std::vector<std::vector<int>> nodes;
+#if NUMA_AWARE && defined(__linux__)
+        for (int node = 0;; ++node) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE *file = fopen(path, "r");
+            if (file == nullptr) break;
+            // Format: comma-separated list of CPUs or CPU ranges, e.g. "0-7,16-23".
+            std::vector<int> cpus;
+            int first, last;
+            while (fscanf(file, "%d", &first) == 1) {
+                last = first;
+                int ch = fgetc(file);
+                if (ch == '-') {
+                    if (fscanf(file, "%d", &last) != 1) break;
+                    ch = fgetc(file);
+                }
+                for (int cpu = first; cpu <= last; ++cpu)
+                    if (std::binary_search(allowed_cpus.begin(), allowed_cpus.end(), cpu)) cpus.push_back(cpu);
+                if (ch != ',') break;
+            }
+            fclose(file);
+            if (!cpus.empty()) nodes.push_back(std::move(cpus));
+        }
+#endif
+        if (nodes.empty()) nodes.push_back(allowed_cpus);
+        return nodes;
+    }
+
+    Latch::Latch(ThreadPool &pool) : pool(pool), pending(0) {}
+
+    Latch::Latch() : Latch(ThreadPool::global()) {}
+
+    Latch::~Latch() {
+        try {
+            wait();
+        } catch (...) {}
+    }
+
+    void Latch::wait() {
+        // The waiting thread is not pinned, so it only helps with node-specific tasks when there are no workers.
+        bool steal = pool.workers.empty();
+        while (!done()) {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            ThreadPool::Task task;
+            if (pool._pop_task(&task, -1, steal)) {
+                lock.unlock();
+                pool._run(task);
+                continue;
+            }
+            pool.done_cond.wait(lock, [this, steal] { return done() || pool._has_task(-1, steal); });
+        }
+        if (error) {
+            std::exception_ptr _error = error;
+            error = nullptr;
+            std::rethrow_exception(_error);
+        }
+    }
+
+    ThreadPool::ThreadPool(size_t num_workers) : num_queued(0), stopping(false) {
+        std::vector<int> allowed_cpus = __allowed_cpus();
+        std::vector<std::vector<int>> topology = __read_numa_topology(allowed_cpus);
+        num_nodes = topology.size();
+        queues.resize(num_nodes + 1);
+
+        // Assign the allowed CPUs to workers round-robin across nodes. The first CPU of node 0 is left for the thread
+        // that submits work.
+        std::vector<std::pair<int, int>> slots;  // (cpu, node)
+        for (size_t i = 0, remaining = 1; remaining > 0; ++i) {
+            remaining = 0;
+            for (size_t node = 0; node < num_nodes; ++node) {
+                size_t pos = node == 0 ? i + 1 : i;
+                if (pos < topology[node].size()) {
+                    slots.emplace_back(topology[node][pos], static_cast<int>(node));
+                    ++remaining;
+                }
+            }
+        }
+        // With a single allowed CPU, workers share it with the submitting thread and are not pinned.
+        if (slots.empty()) slots.emplace_back(-1, 0);
+
+        workers.reserve(num_workers);
+        worker_nodes.reserve(num_workers);
+        for (size_t i = 0; i < num_workers; ++i) {
+            auto[cpu, node] = slots[i % slots.size()];
+            worker_nodes.push_back(num_nodes > 1 ? node : -1);
+            workers.emplace_back(&ThreadPool::_worker_loop, this, i);
+#if THREAD_POOL_PIN_WORKERS && defined(__linux__)
+            if (cpu >= 0) {
+                cpu_set_t cpu_set;
+                CPU_ZERO(&cpu_set);
+                CPU_SET(cpu, &cpu_set);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpu_set_t), &cpu_set);
+            }
+#else
+            (void) cpu;
+#endif
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        task_cond.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    ThreadPool &ThreadPool::global() {
+#if THREAD_POOL_NUM_THREADS
+        static ThreadPool pool(THREAD_POOL_NUM_THREADS);
+#else
+        // One worker per allowed CPU, besides the thread that submits work.
+        static ThreadPool pool(std::max(__allowed_cpus().size(), static_cast<size_t>(1)) - 1);
+#endif
+        return pool;
+    }
+
+    void ThreadPool::submit(Latch &latch, std::function<void()> func, int node) {
+        latch.pending.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queues[node < 0 || node >= static_cast<int>(num_nodes) ? 0 : node + 1].push_back({std::move(func), &latch});
+            num_queued.fetch_add(1, std::memory_order_release);
+        }
+        if (node < 0) task_cond.notify_one();
+        else task_cond.notify_all();  // wake up a worker on the right node
+        done_cond.notify_all();  // a waiting thread may help with the new task
+    }
+
+    bool ThreadPool::_has_task(int node, bool steal) const {
+        if (steal) return num_queued.load(std::memory_order_relaxed) > 0;
+        return !queues[0].empty() || (node >= 0 && !queues[node + 1].empty());
+    }
+
+    bool ThreadPool::_pop_task(Task *task, int node, bool steal) {
+        std::deque<Task> *queue = nullptr;
+        if (node >= 0 && !queues[node + 1].empty()) queue = &queues[node + 1];
+        else if (!queues[0].empty()) queue = &queues[0];
+        else if (steal) {
+            for (std::deque<Task> &other : queues)
+                if (!other.empty()) {
+                    queue = &other;
+                    break;
+                }
+        }
+        if (queue == nullptr) return false;
+        *task = std::move(queue->front());
+        queue->pop_front();
+        num_queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void ThreadPool::_run(Task &task) {
+        Latch *latch = task.latch;
+        try {
+            task.func();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(latch->error_mutex);
+            if (!latch->error) latch->error = std::current_exception();
+        }
+        if (latch->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // Lock before notifying so a waiter cannot miss the wake-up between checking and sleeping.
+            std::lock_guard<std::mutex> lock(mutex);
+            done_cond.notify_all();
+        }
+    }
+
+    void ThreadPool::_worker_loop(size_t pid) {
+        int node = worker_nodes[pid];
+        while (true) {
+            for (size_t i = 0; i < kSpinCount && num_queued.load(std::memory_order_acquire) == 0; ++i)
+                _mm_pause();
+            Task task;
+            bool found;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_cond.wait(lock, [this] { return stopping || num_queued.load(std::memory_order_relaxed) > 0; });
+                found = _pop_task(&task, node, /*steal=*/false);
+                if (!found && stopping && num_queued.load(std::memory_order_relaxed) == 0) return;
+            }
+            if (!found) {
+                // Only other nodes have pending tasks. Give their own workers a chance to take them first, but steal
+                // rather than sit idle.
+                for (size_t i = 0; i < kSpinCount; ++i) _mm_pause();
+                std::lock_guard<std::mutex> lock(mutex);
+                found = _pop_task(&task, node, /*steal=*/true);
+            }
+            if (found) _run(task);
+        }
+    }
+
+}
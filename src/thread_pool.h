@@ -0,0 +1,101 @@
+#ifndef MERCURYJSON_THREAD_POOL_H
+#define MERCURYJSON_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "flags.h"
+
+
+namespace MercuryJson {
+
+    class ThreadPool;
+
+    // Tracks a group of tasks submitted to a `ThreadPool`. The first exception thrown by a task is stored and
+    // re-thrown by `wait()`. The destructor also waits (without re-throwing), so tasks never outlive the stack data
+    // they reference as long as the latch is declared after that data.
+    class Latch {
+        ThreadPool &pool;
+        std::atomic<size_t> pending;
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
+        friend class ThreadPool;
+
+    public:
+        explicit Latch(ThreadPool &pool);
+        Latch();
+
+        Latch(const Latch &) = delete;
+        Latch &operator=(const Latch &) = delete;
+
+        ~Latch();
+
+        inline bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+
+        // Block until all tasks finish. The calling thread runs queued tasks while waiting.
+        void wait();
+    };
+
+    // Process-wide pool of (optionally pinned) worker threads shared by all parallel parsing phases, so that parsing
+    // a document does not create any threads.
+    class ThreadPool {
+        struct Task {
+            std::function<void()> func;
+            Latch *latch;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<int> worker_nodes;
+        // Queue 0 accepts tasks for any worker; queue `n + 1` holds tasks for workers on NUMA node `n`.
+        std::vector<std::deque<Task>> queues;
+        size_t num_nodes;
+        std::atomic<size_t> num_queued;
+        std::mutex mutex;
+        std::condition_variable task_cond, done_cond;
+        bool stopping;
+
+        void _worker_loop(size_t pid);
+        // Pop a task, preferring the queue of `node`, or return false if there is no task to run.
+        // Tasks for other nodes are only taken when `steal` is set. Caller must hold `mutex`.
+        bool _pop_task(Task *task, int node, bool steal);
+        bool _has_task(int node, bool steal) const;
+        void _run(Task &task);
+
+        friend class Latch;
+
+    public:
+        // Create a pool with `num_workers` threads. The calling thread is expected to help through `Latch::wait`,
+        // so zero workers is valid and runs all tasks inline. With `NUMA_AWARE`, workers are spread evenly across
+        // the NUMA nodes of the machine.
+        explicit ThreadPool(size_t num_workers);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        static ThreadPool &global();
+
+        inline size_t size() const { return workers.size(); }
+
+        inline size_t nodes() const { return num_nodes; }
+
+        // NUMA node for part `part` out of `num_parts` consecutive parts of a buffer, or -1 for a single node.
+        inline int node_for_part(size_t part, size_t num_parts) const {
+            return num_nodes > 1 ? static_cast<int>(part * num_nodes / num_parts) : -1;
+        }
+
+        // Submit a task to workers on NUMA node `node`, or to any worker when `node` is -1. Idle workers on other
+        // nodes still take the task if its own node falls behind.
+        void submit(Latch &latch, std::function<void()> func, int node = -1);
+    };
+
+}
+
+#endif // MERCURYJSON_THREAD_POOL_H
@@ -1,10 +1,15 @@
 #include "utils.h"
 
+#include <new>
 #include <stdexcept>
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __linux__
+# include <sys/mman.h>
+#endif
+
 
 char *read_file(const char *filename, size_t *size) {
     std::FILE *pfile = std::fopen(filename, "rb");
@@ -43,3 +48,41 @@ long long int plain_convert(double value) {
     union { long long int integer; double decimal; };
     decimal = value; return integer;
 }
+
+void *__untouched_malloc(size_t size) {
+#ifdef __linux__
+    // Anonymous mappings are always backed by fresh pages, while `malloc` may hand out pages already faulted in.
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    return p;
+#else
+    void *p = aligned_malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+#endif
+}
+
+void __untouched_free(void *memblock, size_t size) {
+    if (memblock == nullptr) return;
+#ifdef __linux__
+    munmap(memblock, size);
+#else
+    aligned_free(memblock);
+#endif
+}
+
+void *__huge_page_malloc(size_t size) {
+#ifdef __linux__
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+    // No huge pages reserved: fall back to regular pages, and let the kernel collapse them into huge pages.
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    madvise(p, size, MADV_HUGEPAGE);
+    return p;
+#else
+    void *p = aligned_malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+#endif
+}
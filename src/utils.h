@@ -34,6 +34,27 @@ static inline void aligned_free(const T *memblock) {
     aligned_free<T>(const_cast<T *>(memblock));
 }
 
+// Allocate fresh pages that are not touched before being returned. Under the first-touch policy, each page is then
+// placed on the NUMA node of the thread that first writes to it. Throws `std::bad_alloc` if the memory cannot be
+// mapped. Must be freed with `untouched_free`.
+void *__untouched_malloc(size_t size);
+void __untouched_free(void *memblock, size_t size);
+
+template <typename T = char>
+static inline T *untouched_malloc(size_t count) {
+    return static_cast<T *>(__untouched_malloc(count * sizeof(T)));
+}
+
+template <typename T>
+static inline void untouched_free(T *memblock, size_t count) {
+    __untouched_free(reinterpret_cast<void *>(memblock), count * sizeof(T));
+}
+
+// Allocate `size` bytes backed by huge pages where possible: explicit huge pages if the system has some reserved, or
+// else pages marked for transparent huge pages. `size` should be a multiple of the huge page size. Throws
+// `std::bad_alloc` on failure. Must be freed with `untouched_free`.
+void *__huge_page_malloc(size_t size);
+
 void print_indent(int indent);
 
 double plain_convert(long long int value);